@@ -0,0 +1,148 @@
+#pragma once
+
+#include "CommandProcessor.h"
+
+#include <cerrno>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+struct AggregateOptions {
+  // интервал подсчёта команд; 0 — без агрегирующего вывода
+  std::chrono::seconds interval{0};
+  std::string prefix = "bulk-aggregate-";
+};
+
+/**
+ * @brief вывод числа повторений каждой команды за интервал
+ *
+ * Вместо самих команд в файл попадают итоги: по окончании каждого
+ * интервала времени команд — строки "<начало интервала, с> <число>
+ * <команда>" по убыванию числа. Интервалы выровнены по кратным interval
+ * секундам эпохи; пустые интервалы не пишутся, последний — в деструкторе.
+ * Команды, пришедшие с опозданием из уже закрытого интервала, считаются в
+ * текущем.
+ *
+ * Команда, интернированная в таблицу table, считается по своему номеру,
+ * без хеширования и копирования текста; остальные — в словаре по тексту,
+ * который хранит каждую различную команду один раз. Вывод держит таблицу
+ * живой, пока не запишет последний интервал.
+ */
+class AggregateOutput : public Output { // subscriber
+public:
+  AggregateOutput(BatchCommandProcessor *processor, const AggregateOptions& options,
+                  std::shared_ptr<const CommandTable> table = nullptr)
+    : m_options(options), m_table(std::move(table)),
+      m_interval(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                   std::max(options.interval, std::chrono::seconds(1)))) {
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    const auto filename = m_options.prefix + std::to_string(micros) + ".log";
+    m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Unable to open aggregate file " + filename);
+    }
+    if (processor) {
+      processor->subscribe(this);
+    }
+  }
+
+  ~AggregateOutput() override {
+    try {
+      WriteInterval();
+    }
+    catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+    ::close(m_fd);
+  }
+
+  void update(const BatchPtr& batch) override {
+    TraceSpan span("write aggregate", batch->TraceId(), batch->Size());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // номера пакетов с чужой таблицей не годятся
+    const bool ownTable = m_table && batch->GetCommandTable() == m_table.get();
+    batch->ForEachCommandId([this, ownTable](uint32_t id, const CommandView& command) {
+      if (command.timeStamp >= m_intervalEnd) {
+        WriteInterval();
+        m_intervalStart = command.timeStamp.time_since_epoch() / m_interval * m_interval;
+        m_intervalEnd = std::chrono::system_clock::time_point(m_intervalStart + m_interval);
+      }
+      if (!ownTable) {
+        id = CommandTable::NO_ID;
+      }
+      if (id == CommandTable::NO_ID && m_table) {
+        // номер вынесенной на диск команды ищется заново
+        id = m_table->Find(command.text);
+      }
+      if (id == CommandTable::NO_ID) {
+        ++m_other[std::string(command.text)];
+        return;
+      }
+      if (id >= m_counts.size()) {
+        m_counts.resize(id + 1, 0);
+      }
+      if (m_counts[id]++ == 0) {
+        m_touched.push_back(id);
+      }
+    });
+  }
+
+private:
+  void WriteInterval() {
+    if (m_touched.empty() && m_other.empty()) {
+      return;
+    }
+    std::vector<std::pair<uint64_t, std::string_view>> totals;
+    totals.reserve(m_touched.size() + m_other.size());
+    for (const auto id : m_touched) {
+      totals.emplace_back(m_counts[id], m_table->Text(id));
+      m_counts[id] = 0;
+    }
+    m_touched.clear();
+    for (const auto& [text, count] : m_other) {
+      totals.emplace_back(count, text);
+    }
+    std::sort(totals.begin(), totals.end(), [](const auto& a, const auto& b) {
+      return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    const auto start = std::to_string(
+          std::chrono::duration_cast<std::chrono::seconds>(m_intervalStart).count());
+    std::string buffer;
+    for (const auto& [count, text] : totals) {
+      buffer.append(start).append(" ").append(std::to_string(count)).append(" ")
+          .append(text).push_back('\n');
+    }
+    m_other.clear();
+    Write(buffer);
+  }
+
+  void Write(std::string_view data) {
+    while (!data.empty()) {
+      const auto written = ::write(m_fd, data.data(), data.size());
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Unable to write aggregate file.");
+      }
+      data.remove_prefix(static_cast<size_t>(written));
+    }
+  }
+
+  const AggregateOptions m_options;
+  const std::shared_ptr<const CommandTable> m_table;
+  const std::chrono::system_clock::duration m_interval;
+  std::mutex m_mutex;
+  int m_fd = -1;
+  std::chrono::system_clock::duration m_intervalStart{0};
+  std::chrono::system_clock::time_point m_intervalEnd;
+  // по номеру в таблице интернирования
+  std::vector<uint64_t> m_counts;
+  std::vector<uint32_t> m_touched;
+  std::unordered_map<std::string, uint64_t> m_other;
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "BatchQueue.h"
+#include "CommandProcessor.h"
+#include "Placement.h"
+
+/**
+ * @brief асинхронный вывод: пакеты обрабатываются пулом рабочих потоков
+ *
+ * Оборачивает синхронного подписчика; с несколькими потоками подписчик
+ * должен допускать параллельные вызовы update(). Рабочий поток i
+ * закрепляется за ядром cpus[firstCpu + i] (по кругу), если список задан.
+ */
+class AsyncOutput : public Output { // subscriber
+public:
+  AsyncOutput(BatchCommandProcessor *processor,
+              std::unique_ptr<Output> sink, size_t threadCount,
+              const QueueOptions& queueOptions = QueueOptions(),
+              std::vector<int> cpus = {}, size_t firstCpu = 0)
+    : m_sink(std::move(sink)), m_cpus(std::move(cpus)) {
+    threadCount = std::max<size_t>(threadCount, 1);
+    m_queue = MakeBatchQueue(threadCount, queueOptions);
+    m_workers.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i) {
+      m_workers.emplace_back(&AsyncOutput::Run, this, i + 1, firstCpu + i);
+    }
+    if (processor) {
+      processor->subscribe(this);
+    }
+  }
+
+  ~AsyncOutput() override {
+    // потоки дорабатывают оставшиеся в очереди пакеты и завершаются
+    m_queue->Close();
+    for (auto& worker : m_workers) {
+      worker.join();
+    }
+  }
+
+  void update(const BatchPtr& batch) override {
+    // ожидание места в очереди при backpressure=block
+    TraceSpan span("enqueue", batch->TraceId(), batch->Size());
+    m_queue->Push(batch);
+  }
+
+  const BatchQueue& Queue() const noexcept {
+    return *m_queue;
+  }
+
+private:
+  void Run(size_t writerId, size_t cpu) {
+    PinCurrentThread(m_cpus, cpu);
+    CurrentWriterId() = writerId;
+    BatchPtr batch;
+    while (m_queue->Pop(batch)) {
+      m_sink->update(batch);
+      batch.reset();
+    }
+  }
+
+  std::unique_ptr<Output> m_sink;
+  const std::vector<int> m_cpus;
+  std::unique_ptr<BatchQueue> m_queue;
+  std::vector<std::thread> m_workers;
+};
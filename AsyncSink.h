@@ -0,0 +1,423 @@
+#pragma once
+
+#include "CommandProcessor.h"
+#include "Placement.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <latch>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct SinkOptions {
+  // потоки общего исполнителя сопрограммных выводов; 0 — выводы не
+  // сопрограммные
+  size_t threads = 0;
+  // пакетов в очереди одного вывода; заполненная очередь останавливает
+  // обработчик, заполненная наполовину — подаёт ему сигнал Congested()
+  size_t inflight = 64;
+  // сколько при завершении ждать записи принятых пакетов, после чего
+  // вывод отменяется; 0 — ждать без ограничения
+  std::chrono::milliseconds drain{0};
+};
+
+/**
+ * @brief общий исполнитель сопрограмм выводов
+ *
+ * Пул потоков возобновляет поставленные в очередь сопрограммы по мере
+ * готовности. Сопрограмма переходит на поток исполнителя через
+ * co_await executor.Schedule(). Деструктор дорабатывает очередь; все
+ * сопрограммы к этому моменту должны завершиться или ждать в очереди.
+ */
+class SinkExecutor {
+public:
+  explicit SinkExecutor(size_t threads, std::vector<int> cpus = {}, size_t firstCpu = 0)
+    : m_cpus(std::move(cpus)) {
+    threads = std::max<size_t>(threads, 1);
+    m_threads.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+      m_threads.emplace_back(&SinkExecutor::Run, this, i + 1, firstCpu + i);
+    }
+  }
+
+  ~SinkExecutor() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_ready.notify_all();
+    for (auto& thread : m_threads) {
+      thread.join();
+    }
+  }
+
+  SinkExecutor(const SinkExecutor&) = delete;
+  SinkExecutor& operator=(const SinkExecutor&) = delete;
+
+  void Post(std::coroutine_handle<> handle) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(handle);
+    }
+    m_ready.notify_one();
+  }
+
+  /**
+   * @brief ожидание, продолжающее сопрограмму на потоке исполнителя
+   */
+  auto Schedule() noexcept {
+    struct Awaiter {
+      SinkExecutor* executor;
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle) const {
+        executor->Post(handle);
+      }
+
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{this};
+  }
+
+private:
+  void Run(size_t writerId, size_t cpu) {
+    PinCurrentThread(m_cpus, cpu);
+    CurrentWriterId() = writerId;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+      m_ready.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+      if (m_queue.empty()) {
+        return;
+      }
+      const auto handle = m_queue.front();
+      m_queue.pop_front();
+      lock.unlock();
+      handle.resume();
+      lock.lock();
+    }
+  }
+
+  const std::vector<int> m_cpus;
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::deque<std::coroutine_handle<>> m_queue;
+  bool m_stop = false;
+  std::vector<std::thread> m_threads;
+};
+
+/**
+ * @brief ленивая сопрограмма записи
+ *
+ * Начинает работу при co_await и по завершении передаёт управление
+ * ожидающему без участия исполнителя; исключение сопрограммы
+ * пробрасывается из co_await.
+ */
+class SinkTask {
+public:
+  struct promise_type {
+    std::coroutine_handle<> continuation;
+    std::latch* finished = nullptr;
+    std::exception_ptr error;
+
+    SinkTask get_return_object() noexcept {
+      return SinkTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    auto final_suspend() noexcept {
+      struct Awaiter {
+        bool await_ready() const noexcept {
+          return false;
+        }
+
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<promise_type> handle) const noexcept {
+          auto& promise = handle.promise();
+          if (promise.continuation) {
+            return promise.continuation;
+          }
+          // после отметки владелец вправе уничтожить кадр
+          if (auto* finished = promise.finished) {
+            finished->count_down();
+          }
+          return std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+      };
+      return Awaiter{};
+    }
+
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept {
+      error = std::current_exception();
+    }
+  };
+
+  SinkTask(SinkTask&& other) noexcept
+    : m_handle(std::exchange(other.m_handle, {})) {}
+
+  SinkTask& operator=(SinkTask&& other) noexcept {
+    if (this != &other) {
+      Destroy();
+      m_handle = std::exchange(other.m_handle, {});
+    }
+    return *this;
+  }
+
+  ~SinkTask() {
+    Destroy();
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept {
+    m_handle.promise().continuation = continuation;
+    return m_handle;
+  }
+
+  void await_resume() const {
+    if (m_handle.promise().error) {
+      std::rethrow_exception(m_handle.promise().error);
+    }
+  }
+
+  /**
+   * @brief запускает сопрограмму без ожидающего на потоке executor;
+   * завершение отмечается в finished
+   */
+  void Start(SinkExecutor& executor, std::latch& finished) {
+    m_handle.promise().finished = &finished;
+    executor.Post(m_handle);
+  }
+
+private:
+  explicit SinkTask(std::coroutine_handle<promise_type> handle) noexcept
+    : m_handle(handle) {}
+
+  void Destroy() noexcept {
+    if (m_handle) {
+      m_handle.destroy();
+      m_handle = {};
+    }
+  }
+
+  std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+ * @brief асинхронный вывод пакетов
+ *
+ * write() — сопрограмма: вывод приостанавливает её на время ожидания
+ * (диска, сети, собственного пула) и возобновляет по готовности, так что
+ * поток исполнителя в это время обслуживает другие выводы. Записи одного
+ * вывода идут по очереди в порядке пакетов. Запрошенная через stop отмена
+ * разрешает бросить запись незавершённой; вывод, который stop не
+ * проверяет, отменяется только между пакетами.
+ */
+class AsyncSink {
+public:
+  virtual ~AsyncSink() = default;
+
+  virtual SinkTask write(BatchPtr batch, std::stop_token stop = {}) = 0;
+};
+
+/**
+ * @brief сопрограммный вывод поверх синхронного подписчика
+ *
+ * update() подписчика выполняется на потоке исполнителя, поэтому
+ * ConsoleOutput, ReportWriter и остальные выводы подключаются без
+ * изменений; блокирующая запись занимает поток исполнителя на своё время.
+ * Отмена проверяется только перед записью пакета: начатый update() она
+ * не прерывает.
+ */
+class OutputSink : public AsyncSink {
+public:
+  explicit OutputSink(std::unique_ptr<Output> output)
+    : m_output(std::move(output)) {}
+
+  SinkTask write(BatchPtr batch, std::stop_token stop) override {
+    if (!stop.stop_requested()) {
+      m_output->update(batch);
+    }
+    co_return;
+  }
+
+private:
+  std::unique_ptr<Output> m_output;
+};
+
+/**
+ * @brief подписчик обработчика, передающий пакеты сопрограммному выводу
+ *
+ * update() ставит пакет в очередь вывода и сразу возвращается; сопрограмма
+ * на исполнителе выбирает пакеты и ждёт co_await sink->write(batch).
+ * Очередь ограничена inflight пакетами: заполненная очередь задерживает
+ * update(), то есть обработчик и поток чтения, а заполненная наполовину
+ * подаёт обработчику сигнал Congested(). Деструктор дожидается записи
+ * всех принятых пакетов, но не дольше drain, если он задан; затем, как и
+ * Cancel(), отбрасывает очередь и просит текущую запись остановиться.
+ */
+class AsyncSinkOutput : public Output { // subscriber
+public:
+  AsyncSinkOutput(BatchCommandProcessor *processor, std::unique_ptr<AsyncSink> sink,
+                  SinkExecutor& executor, size_t inflight = SinkOptions().inflight,
+                  std::chrono::milliseconds drain = SinkOptions().drain)
+    : m_sink(std::move(sink)), m_executor(executor),
+      m_inflight(std::max<size_t>(inflight, 1)), m_drain(drain), m_driver(Drive()) {
+    m_driver.Start(m_executor, m_finished);
+    if (processor) {
+      processor->subscribe(this);
+    }
+  }
+
+  ~AsyncSinkOutput() override {
+    Close();
+    if (m_drain.count() > 0) {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (!m_space.wait_for(lock, m_drain, [this] { return m_drained; })) {
+        lock.unlock();
+        std::cerr << "Sink did not drain in time, dropping " << m_depth.load()
+                  << " batches." << std::endl;
+        Cancel();
+      }
+    }
+    m_finished.wait();
+  }
+
+  void update(const BatchPtr& batch) override {
+    std::coroutine_handle<> waiting;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_space.wait(lock, [this] { return m_queue.size() < m_inflight || m_closed; });
+      if (m_closed) {
+        return;
+      }
+      m_queue.push_back(batch);
+      m_depth.store(m_queue.size(), std::memory_order_relaxed);
+      waiting = std::exchange(m_waiting, {});
+    }
+    if (waiting) {
+      m_executor.Post(waiting);
+    }
+  }
+
+  bool Congested() const noexcept override {
+    return m_depth.load(std::memory_order_relaxed) * 2 >= m_inflight;
+  }
+
+  /**
+   * @brief отменяет вывод: пакеты в очереди и последующие отбрасываются
+   */
+  void Cancel() {
+    m_stop.request_stop();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.clear();
+      m_depth.store(0, std::memory_order_relaxed);
+    }
+    Close();
+  }
+
+private:
+  /**
+   * @brief ожидание очередного пакета; пустой пакет — вывод закрыт
+   */
+  auto Next() noexcept {
+    struct Awaiter {
+      AsyncSinkOutput* output;
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      bool await_suspend(std::coroutine_handle<> handle) const {
+        std::lock_guard<std::mutex> lock(output->m_mutex);
+        if (!output->m_queue.empty() || output->m_closed) {
+          return false;
+        }
+        output->m_waiting = handle;
+        return true;
+      }
+
+      BatchPtr await_resume() const {
+        BatchPtr batch;
+        {
+          std::lock_guard<std::mutex> lock(output->m_mutex);
+          if (!output->m_queue.empty()) {
+            batch = std::move(output->m_queue.front());
+            output->m_queue.pop_front();
+            output->m_depth.store(output->m_queue.size(), std::memory_order_relaxed);
+          }
+        }
+        output->m_space.notify_one();
+        return batch;
+      }
+    };
+    return Awaiter{this};
+  }
+
+  SinkTask Drive() {
+    for (;;) {
+      auto batch = co_await Next();
+      if (!batch) {
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_drained = true;
+        }
+        m_space.notify_all();
+        co_return;
+      }
+      try {
+        co_await m_sink->write(std::move(batch), m_stop.get_token());
+      }
+      catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  void Close() {
+    std::coroutine_handle<> waiting;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+      waiting = std::exchange(m_waiting, {});
+    }
+    m_space.notify_all();
+    if (waiting) {
+      m_executor.Post(waiting);
+    }
+  }
+
+  std::unique_ptr<AsyncSink> m_sink;
+  SinkExecutor& m_executor;
+  const size_t m_inflight;
+  const std::chrono::milliseconds m_drain;
+  std::stop_source m_stop;
+  std::mutex m_mutex;
+  std::condition_variable m_space;
+  std::deque<BatchPtr> m_queue;
+  std::atomic<size_t> m_depth{0};
+  std::coroutine_handle<> m_waiting;
+  bool m_closed = false;
+  // очередь выбрана после закрытия
+  bool m_drained = false;
+  std::latch m_finished{1};
+  SinkTask m_driver;
+};
@@ -0,0 +1,659 @@
+#pragma once
+
+#include "CommandTable.h"
+#include "LockFreeRing.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <vector>
+
+#include <unistd.h>
+
+static const std::string BULK = "bulk: ";
+
+struct Command {
+  std::string text;
+  std::chrono::system_clock::time_point timeStamp;
+};
+
+/**
+ * @brief команда внутри пакета: текст указывает в память пакета
+ */
+struct CommandView {
+  std::string_view text;
+  std::chrono::system_clock::time_point timeStamp;
+};
+
+/**
+ * @brief пакет команд
+ *
+ * Тексты команд хранятся подряд в одном буфере пакета, а сами команды —
+ * смещениями и длинами в нём, поэтому добавление команды не выделяет
+ * память, пока хватает уже занятой ёмкости. Пакет заполняет только
+ * обработчик; после запечатывания он не изменяется, поэтому один и тот же
+ * экземпляр без копирования раздаётся всем подписчикам через BatchPtr.
+ * Текст записи форматируется один раз, при первом обращении, и
+ * разделяется всеми подписчиками.
+ *
+ * Большой динамический блок обработчик может вынести на диск (Spill()):
+ * уже накопленные команды дописываются во временный файл и освобождают
+ * память. У такого пакета в памяти остаются только первая команда
+ * (Front()) и счётчики; подписчики читают команды через ForEachCommand(),
+ * а запись — по частям через ForEachTextChunk().
+ *
+ * Пакет с таблицей интернирования (SetCommandTable()) хранит для
+ * найденной в таблице команды только её номер: текст и готовый фрагмент
+ * записи берутся из таблицы, а в свой буфер копируются лишь остальные
+ * команды.
+ */
+class Batch {
+public:
+  enum class Kind {
+    Static,  // пакет фиксированного размера
+    Dynamic  // пакет, ограниченный скобками { }
+  };
+
+  class const_iterator {
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = CommandView;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = CommandView;
+
+    const_iterator(const Batch* batch, size_t index)
+      : m_batch(batch), m_index(index) {}
+
+    CommandView operator*() const { return (*m_batch)[m_index]; }
+    const_iterator& operator++() { ++m_index; return *this; }
+    bool operator==(const const_iterator& other) const { return m_index == other.m_index; }
+    bool operator!=(const const_iterator& other) const { return m_index != other.m_index; }
+
+  private:
+    const Batch* m_batch;
+    size_t m_index;
+  };
+
+  /**
+   * @brief команды пакета во временном файле: длина текста (u32), отметка
+   * времени (i64) и текст каждой команды
+   */
+  class CommandSpill {
+  public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    static constexpr size_t HEADER_SIZE = sizeof(uint32_t) + sizeof(int64_t);
+
+    CommandSpill() : m_file(std::tmpfile()) {
+      if (!m_file) {
+        throw std::runtime_error("Unable to create block spill file.");
+      }
+    }
+
+    ~CommandSpill() {
+      std::fclose(m_file);
+    }
+
+    CommandSpill(const CommandSpill&) = delete;
+    CommandSpill& operator=(const CommandSpill&) = delete;
+
+    void Append(std::string_view data) {
+      while (!data.empty()) {
+        const auto written = ::pwrite(fileno(m_file), data.data(), data.size(),
+                                      static_cast<off_t>(m_size));
+        if (written <= 0) {
+          throw std::runtime_error("Unable to write block spill file.");
+        }
+        m_size += static_cast<size_t>(written);
+        data.remove_prefix(static_cast<size_t>(written));
+      }
+    }
+
+    /**
+     * @brief читает команды кусками по CHUNK_SIZE; текст действителен
+     * только на время вызова handler
+     */
+    template <typename Handler>
+    void ForEachCommand(Handler&& handler) const {
+      std::vector<char> buffer(CHUNK_SIZE);
+      size_t used = 0;
+      for (size_t offset = 0; offset < m_size || used != 0;) {
+        if (offset < m_size && used < buffer.size()) {
+          const auto read = ::pread(fileno(m_file), buffer.data() + used,
+                                    std::min(buffer.size() - used, m_size - offset),
+                                    static_cast<off_t>(offset));
+          if (read <= 0) {
+            throw std::runtime_error("Unable to read block spill file.");
+          }
+          offset += static_cast<size_t>(read);
+          used += static_cast<size_t>(read);
+        }
+        size_t position = 0;
+        while (used - position >= HEADER_SIZE) {
+          uint32_t length = 0;
+          int64_t ticks = 0;
+          std::memcpy(&length, buffer.data() + position, sizeof(length));
+          std::memcpy(&ticks, buffer.data() + position + sizeof(length), sizeof(ticks));
+          if (used - position - HEADER_SIZE < length) {
+            break;
+          }
+          handler(CommandView{
+                    std::string_view(buffer.data() + position + HEADER_SIZE, length),
+                    std::chrono::system_clock::time_point(
+                      std::chrono::system_clock::duration(ticks))});
+          position += HEADER_SIZE + length;
+        }
+        if (position == 0) {
+          if (offset == m_size) {
+            throw std::runtime_error("Corrupted block spill file.");
+          }
+          if (used == buffer.size()) {
+            // команда длиннее буфера
+            buffer.resize(buffer.size() * 2);
+          }
+          continue;
+        }
+        std::memmove(buffer.data(), buffer.data() + position, used - position);
+        used -= position;
+      }
+    }
+
+  private:
+    std::FILE* m_file;
+    size_t m_size = 0;
+  };
+
+  Batch() = default;
+
+  Batch(const Batch&) = delete;
+  Batch& operator=(const Batch&) = delete;
+
+  void Append(std::string_view text,
+              std::chrono::system_clock::time_point timeStamp) {
+    m_textBytes += text.size();
+    const auto id = m_table ? m_table->Intern(text) : CommandTable::NO_ID;
+    if (id != CommandTable::NO_ID) {
+      m_entries.push_back(Entry{0, static_cast<uint32_t>(text.size()), id, timeStamp});
+      return;
+    }
+    m_entries.push_back(Entry{m_bytes.size(), static_cast<uint32_t>(text.size()),
+                              CommandTable::NO_ID, timeStamp});
+    m_bytes.append(text);
+  }
+
+  /**
+   * @brief подключает таблицу интернирования к пустому пакету; nullptr —
+   * все команды копируются в пакет
+   */
+  void SetCommandTable(std::shared_ptr<CommandTable> table) noexcept {
+    m_table = std::move(table);
+  }
+
+  const CommandTable* GetCommandTable() const noexcept {
+    return m_table.get();
+  }
+
+  void Reserve(size_t commands) {
+    m_entries.reserve(commands);
+  }
+
+  void SetKind(Kind kind) noexcept {
+    m_kind = kind;
+  }
+
+  /**
+   * @brief включает пакет в выборку трассировки (Tracer::Sample()) и
+   * отмечает начало его наполнения; вызывается при первой команде
+   */
+  void SampleTrace() noexcept {
+    if (Tracer::Enabled()) {
+      m_traceId = Tracer::Sample();
+      if (m_traceId != 0) {
+        m_traceStart = Tracer::Now();
+      }
+    }
+  }
+
+  /**
+   * @brief номер трассировки; 0 — пакет не трассируется
+   */
+  uint64_t TraceId() const noexcept {
+    return m_traceId;
+  }
+
+  int64_t TraceStart() const noexcept {
+    return m_traceStart;
+  }
+
+  /**
+   * @brief переносит накопленные команды во временный файл пакета; первая
+   * команда остаётся доступной через Front()
+   */
+  void Spill() {
+    if (m_entries.empty()) {
+      return;
+    }
+    if (!m_spill) {
+      m_spill = std::make_unique<CommandSpill>();
+      const auto front = (*this)[0];
+      m_spilledFront = Command{std::string(front.text), front.timeStamp};
+    }
+    // команды упаковываются и пишутся кусками, без копии всего блока
+    std::string packed;
+    packed.reserve(CommandSpill::CHUNK_SIZE * 2);
+    for (const auto command : *this) {
+      const auto length = static_cast<uint32_t>(command.text.size());
+      const auto ticks = static_cast<int64_t>(command.timeStamp.time_since_epoch().count());
+      packed.append(reinterpret_cast<const char*>(&length), sizeof(length));
+      packed.append(reinterpret_cast<const char*>(&ticks), sizeof(ticks));
+      packed.append(command.text);
+      if (packed.size() >= CommandSpill::CHUNK_SIZE) {
+        m_spill->Append(packed);
+        packed.clear();
+      }
+    }
+    m_spill->Append(packed);
+    m_spilledCommands += m_entries.size();
+    m_spilledBytes += m_textBytes;
+    m_entries.clear();
+    m_bytes.clear();
+    m_textBytes = 0;
+  }
+
+  /**
+   * @brief часть команд вынесена в файл: итераторы и operator[] видят
+   * только команды в памяти, все команды доступны через ForEachCommand()
+   */
+  bool Spilled() const noexcept {
+    return m_spill != nullptr;
+  }
+
+  /**
+   * @brief очищает пакет, сохраняя выделенную память
+   */
+  void Clear() noexcept {
+    m_entries.clear();
+    m_bytes.clear();
+    m_textBytes = 0;
+    m_table.reset();
+    m_text.clear();
+    m_textReady.store(false, std::memory_order_relaxed);
+    m_kind = Kind::Static;
+    m_spill.reset();
+    m_spilledCommands = 0;
+    m_spilledBytes = 0;
+    m_traceId = 0;
+  }
+
+  /**
+   * @brief объём занятой пакетом памяти
+   */
+  size_t Capacity() const noexcept {
+    return m_bytes.capacity() + m_text.capacity() +
+        m_entries.capacity() * sizeof(Entry);
+  }
+
+  size_t Size() const noexcept {
+    return m_spilledCommands + m_entries.size();
+  }
+
+  bool Empty() const noexcept {
+    return Size() == 0;
+  }
+
+  /**
+   * @brief суммарная длина текстов команд, находящихся в памяти
+   */
+  size_t Bytes() const noexcept {
+    return m_textBytes;
+  }
+
+  CommandView operator[](size_t index) const noexcept {
+    const auto& entry = m_entries[index];
+    if (entry.id != CommandTable::NO_ID) {
+      return CommandView{m_table->Text(entry.id), entry.timeStamp};
+    }
+    return CommandView{std::string_view(m_bytes).substr(entry.offset, entry.length),
+                       entry.timeStamp};
+  }
+
+  /**
+   * @brief номер команды в таблице интернирования или CommandTable::NO_ID
+   */
+  uint32_t CommandId(size_t index) const noexcept {
+    return m_entries[index].id;
+  }
+
+  CommandView Front() const noexcept {
+    if (m_spill) {
+      return CommandView{m_spilledFront.text, m_spilledFront.timeStamp};
+    }
+    return (*this)[0];
+  }
+
+  const_iterator begin() const noexcept {
+    return const_iterator(this, 0);
+  }
+
+  const_iterator end() const noexcept {
+    return const_iterator(this, m_entries.size());
+  }
+
+  Kind GetKind() const noexcept {
+    return m_kind;
+  }
+
+  /**
+   * @brief запись "bulk: a, b, c" без перевода строки; запись вынесенного
+   * на диск пакета при этом целиком читается в память
+   */
+  std::string_view Text() const;
+
+  /**
+   * @brief длина записи Text()
+   */
+  size_t TextSize() const noexcept;
+
+  /**
+   * @brief передаёт handler'у все команды пакета по порядку, включая
+   * вынесенные на диск
+   */
+  template <typename Handler>
+  void ForEachCommand(Handler&& handler) const {
+    if (m_spill) {
+      m_spill->ForEachCommand(handler);
+    }
+    for (const auto command : *this) {
+      handler(command);
+    }
+  }
+
+  /**
+   * @brief передаёт запись handler'у частями: пакет в памяти — одной
+   * частью Text(), вынесенный на диск — кусками около CHUNK_SIZE
+   */
+  template <typename Handler>
+  void ForEachTextChunk(Handler&& handler) const;
+
+  /**
+   * @brief как ForEachCommand(), но handler(id, command) получает и номер
+   * команды в таблице; у вынесенных на диск команд номера нет (NO_ID)
+   */
+  template <typename Handler>
+  void ForEachCommandId(Handler&& handler) const {
+    if (m_spill) {
+      m_spill->ForEachCommand([&handler](const CommandView& command) {
+        handler(CommandTable::NO_ID, command);
+      });
+    }
+    for (size_t i = 0; i < m_entries.size(); ++i) {
+      handler(m_entries[i].id, (*this)[i]);
+    }
+  }
+
+private:
+  // команда длиннее 4 ГиБ не помещается и в запись вынесенного блока
+  struct Entry {
+    size_t offset;
+    uint32_t length;
+    uint32_t id;
+    std::chrono::system_clock::time_point timeStamp;
+  };
+
+  std::vector<Entry> m_entries;
+  std::string m_bytes;
+  size_t m_textBytes = 0;
+  std::shared_ptr<CommandTable> m_table;
+  Kind m_kind = Kind::Static;
+  std::unique_ptr<CommandSpill> m_spill;
+  size_t m_spilledCommands = 0;
+  size_t m_spilledBytes = 0;
+  Command m_spilledFront;
+  uint64_t m_traceId = 0;
+  int64_t m_traceStart = 0;
+  mutable std::mutex m_textMutex;
+  mutable std::atomic<bool> m_textReady{false};
+  mutable std::string m_text;
+};
+
+using BatchPtr = std::shared_ptr<const Batch>;
+
+/**
+ * @brief форматирование пакета в запись вида "bulk: a, b, c"
+ *
+ * Размер записи вычисляется заранее, поэтому она пишется в буфер за один
+ * проход без промежуточных строк и перевыделений. Работает с пакетами,
+ * целиком находящимися в памяти (не Spilled()).
+ */
+class BatchFormatter {
+public:
+  static constexpr std::string_view SEPARATOR = ", ";
+
+  static size_t FormattedSize(const Batch& batch) noexcept {
+    size_t size = BULK.size() + batch.Bytes();
+    if (!batch.Empty()) {
+      size += SEPARATOR.size() * (batch.Size() - 1);
+    }
+    return size;
+  }
+
+  /**
+   * @brief пишет запись в out, где должно быть FormattedSize() байт
+   * @return указатель за последним записанным байтом
+   */
+  static char* FormatTo(const Batch& batch, char* out) noexcept {
+    out = Copy(out, BULK);
+    const auto* table = batch.GetCommandTable();
+    for (size_t i = 0; i < batch.Size(); ++i) {
+      const auto id = batch.CommandId(i);
+      if (i != 0 && id != CommandTable::NO_ID) {
+        // разделитель уже входит во фрагмент таблицы
+        out = Copy(out, table->Fragment(id));
+        continue;
+      }
+      if (i != 0) {
+        out = Copy(out, SEPARATOR);
+      }
+      out = Copy(out, batch[i].text);
+    }
+    return out;
+  }
+
+private:
+  static char* Copy(char* out, std::string_view text) noexcept {
+    std::memcpy(out, text.data(), text.size());
+    return out + text.size();
+  }
+};
+
+inline std::string_view Batch::Text() const {
+  if (!m_textReady.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(m_textMutex);
+    if (!m_textReady.load(std::memory_order_relaxed)) {
+      TraceSpan span("format", m_traceId, Size());
+      if (m_spill) {
+        m_text.reserve(TextSize());
+        ForEachTextChunk([this](std::string_view chunk) { m_text.append(chunk); });
+      }
+      else {
+        m_text.resize(BatchFormatter::FormattedSize(*this));
+        BatchFormatter::FormatTo(*this, m_text.data());
+      }
+      m_textReady.store(true, std::memory_order_release);
+    }
+  }
+  return m_text;
+}
+
+inline size_t Batch::TextSize() const noexcept {
+  if (!m_spill) {
+    return BatchFormatter::FormattedSize(*this);
+  }
+  return BULK.size() + m_spilledBytes + m_textBytes +
+      BatchFormatter::SEPARATOR.size() * (Size() - 1);
+}
+
+template <typename Handler>
+void Batch::ForEachTextChunk(Handler&& handler) const {
+  if (!m_spill) {
+    handler(Text());
+    return;
+  }
+  std::string chunk = BULK;
+  chunk.reserve(CommandSpill::CHUNK_SIZE * 2);
+  bool first = true;
+  ForEachCommand([&](const CommandView& command) {
+    if (!first) {
+      chunk.append(BatchFormatter::SEPARATOR);
+    }
+    first = false;
+    chunk.append(command.text);
+    if (chunk.size() >= CommandSpill::CHUNK_SIZE) {
+      handler(std::string_view(chunk));
+      chunk.clear();
+    }
+  });
+  if (!chunk.empty()) {
+    handler(std::string_view(chunk));
+  }
+}
+
+/**
+ * @brief пул пакетов
+ *
+ * Когда последний подписчик отпускает пакет, тот очищается и
+ * возвращается в пул вместе с блоком счётчика ссылок shared_ptr, так что
+ * в установившемся режиме пакеты не выделяют память. Пул живёт, пока жив
+ * хотя бы один выданный им пакет.
+ */
+class BatchPool : public std::enable_shared_from_this<BatchPool> {
+public:
+  static constexpr size_t DEFAULT_CAPACITY = 1024;
+  // пакеты, разросшиеся сверх этого объёма, не кэшируются
+  static constexpr size_t MAX_CACHED_BYTES = 1 << 20;
+
+  static std::shared_ptr<BatchPool> Create(size_t capacity = DEFAULT_CAPACITY) {
+    return std::shared_ptr<BatchPool>(new BatchPool(capacity));
+  }
+
+  ~BatchPool() {
+    Batch* batch = nullptr;
+    while (m_batches.TryPop(batch)) {
+      delete batch;
+    }
+    void* block = nullptr;
+    while (m_blocks.TryPop(block)) {
+      ::operator delete(block);
+    }
+  }
+
+  /**
+   * @brief выдаёт пустой пакет для заполнения
+   */
+  std::unique_ptr<Batch> Acquire() {
+    Batch* batch = nullptr;
+    if (m_batches.TryPop(batch)) {
+      return std::unique_ptr<Batch>(batch);
+    }
+    return std::make_unique<Batch>();
+  }
+
+  /**
+   * @brief запечатывает заполненный пакет для раздачи подписчикам
+   */
+  BatchPtr Seal(std::unique_ptr<Batch> batch) {
+    return BatchPtr(batch.release(), Recycler{this},
+                    BlockAllocator<Batch>(shared_from_this()));
+  }
+
+private:
+  explicit BatchPool(size_t capacity)
+    : m_batches(capacity), m_blocks(capacity) {}
+
+  struct Recycler {
+    BatchPool* pool;
+
+    void operator()(const Batch* batch) const {
+      pool->Release(const_cast<Batch*>(batch));
+    }
+  };
+
+  /**
+   * @brief распределитель блоков счётчика ссылок из кэша пула
+   *
+   * Держит пул живым: shared_ptr освобождает блок последним, уже после
+   * удаления пакета.
+   */
+  template <typename T>
+  struct BlockAllocator {
+    using value_type = T;
+
+    explicit BlockAllocator(std::shared_ptr<BatchPool> owner) noexcept
+      : pool(std::move(owner)) {}
+
+    template <typename U>
+    BlockAllocator(const BlockAllocator<U>& other) noexcept
+      : pool(other.pool) {}
+
+    T* allocate(size_t n) {
+      return static_cast<T*>(pool->AllocateBlock(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+      pool->DeallocateBlock(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const BlockAllocator<U>& other) const noexcept {
+      return pool == other.pool;
+    }
+
+    template <typename U>
+    bool operator!=(const BlockAllocator<U>& other) const noexcept {
+      return pool != other.pool;
+    }
+
+    std::shared_ptr<BatchPool> pool;
+  };
+
+  void Release(Batch* batch) {
+    if (batch->Capacity() > MAX_CACHED_BYTES) {
+      delete batch;
+      return;
+    }
+    batch->Clear();
+    if (!m_batches.TryPush(batch)) {
+      delete batch;
+    }
+  }
+
+  // все блоки одного размера: их запрашивает только Seal()
+  void* AllocateBlock(size_t size) {
+    void* block = nullptr;
+    if (size <= BLOCK_SIZE && m_blocks.TryPop(block)) {
+      return block;
+    }
+    return ::operator new(std::max(size, BLOCK_SIZE));
+  }
+
+  void DeallocateBlock(void* block, size_t size) noexcept {
+    if (size > BLOCK_SIZE || !m_blocks.TryPush(block)) {
+      ::operator delete(block);
+    }
+  }
+
+  static constexpr size_t BLOCK_SIZE = 128;
+
+  MpmcRing<Batch*> m_batches;
+  MpmcRing<void*> m_blocks;
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "AggregateOutput.h"
+#include "AsyncOutput.h"
+#include "AsyncSink.h"
+#include "BinaryFileOutput.h"
+#include "BlockContext.h"
+#include "CompressedFileOutput.h"
+#include "CommandProcessor.h"
+#include "FileInput.h"
+#include "MetricsReporter.h"
+#include "NetworkServer.h"
+#include "RollingFileOutput.h"
+#include "ShardedProcessor.h"
+#include "UringReportWriter.h"
+#include "WriteAheadLog.h"
+
+/**
+ * @brief способ записи пакетов на диск
+ */
+enum class FileSink {
+  PerBatch,   // файл на каждый пакет (ReportWriter)
+  Rolling,    // общий сегмент с ротацией (RollingFileOutput)
+  Compressed, // сжатые сегменты с ротацией (CompressedFileOutput)
+  Binary      // двоичные сегменты с индексом (BinaryFileOutput)
+};
+
+/**
+ * @brief параметры запуска
+ */
+struct BulkOptions {
+  int bulkSize = 3;
+  ConsoleOptions console;
+  FlushOptions flush;
+  TimestampPolicy timestamps = TimestampPolicy::PerCommand;
+  FileSink fileSink = FileSink::PerBatch;
+  RollingOptions rolling;
+  CompressOptions compress;
+  BinaryOptions binary;
+  UringOptions uring;
+  // число потоков записи файлов; 0 — синхронный вывод в потоке чтения,
+  // иначе консоль обслуживает отдельный поток log, а файлы — пул потоков
+  size_t fileThreads = 0;
+  // ядра потоков вывода по кругу: сначала пул файлов, затем консоль и
+  // итоги --aggregate; пусто — без закрепления
+  std::vector<int> sinkCpus;
+  QueueOptions queue;
+  // выводы — сопрограммы на общем исполнителе (вместо fileThreads)
+  SinkOptions sinks;
+  ServerOptions server;
+  ShardOptions shards;
+  MetricsOptions metrics;
+  FileInputOptions input;
+  WalOptions wal;
+  TraceOptions trace;
+  InternOptions intern;
+  AggregateOptions aggregate;
+};
+
+/**
+ * @brief класс работы с командами из консоли
+ */
+class BatchConsoleInput {
+public:
+  explicit BatchConsoleInput(int bulkSize)
+    : BatchConsoleInput(DefaultOptions(bulkSize)) {}
+
+  explicit BatchConsoleInput(const BulkOptions& options) {
+    m_commandProcessor = std::make_unique<BatchCommandProcessor>(options.bulkSize,
+                                                                 options.timestamps,
+                                                                 options.flush);
+    m_context = std::make_unique<StreamContext>(*m_commandProcessor);
+    std::shared_ptr<CommandTable> table;
+    if (options.intern.enabled || options.aggregate.interval.count() > 0) {
+      table = std::make_shared<CommandTable>(options.intern);
+      m_commandProcessor->SetCommandTable(table);
+    }
+    if (options.sinks.threads > 0) {
+      // каждый вывод пишет пакеты по порядку, а разные выводы — параллельно
+      // на потоках исполнителя
+      m_executor = std::make_unique<SinkExecutor>(options.sinks.threads, options.sinkCpus);
+      if (options.fileSink == FileSink::PerBatch && options.uring.enabled) {
+        // кольцо само держит файлы в полёте, запись ждёт только слота
+        AddSink(UringSink::Create(options.uring, *m_executor), options.sinks);
+      }
+      else {
+        AddSink(std::make_unique<OutputSink>(MakeFileOutput(options, nullptr)), options.sinks);
+      }
+      AddSink(std::make_unique<OutputSink>(
+                std::make_unique<ConsoleOutput>(nullptr, options.console)),
+              options.sinks);
+      if (options.aggregate.interval.count() > 0) {
+        AddSink(std::make_unique<OutputSink>(
+                  std::make_unique<AggregateOutput>(nullptr, options.aggregate, table)),
+                options.sinks);
+      }
+    }
+    else if (options.fileThreads == 0) {
+      m_output.push_back(MakeFileOutput(options, m_commandProcessor.get()));
+      m_output.push_back(std::make_unique<ConsoleOutput>(m_commandProcessor.get(),
+                                                         options.console));
+      if (options.aggregate.interval.count() > 0) {
+        m_output.push_back(std::make_unique<AggregateOutput>(m_commandProcessor.get(),
+                                                             options.aggregate, table));
+      }
+    }
+    else {
+      // сегмент пишется последовательно, пул потоков ему не нужен; сжатые
+      // сегменты сжимает собственный пул, а файлы io_uring держит в полёте
+      // одно кольцо
+      const auto fileThreads =
+          options.fileSink == FileSink::PerBatch && !options.uring.enabled
+          ? options.fileThreads : 1;
+      m_output.push_back(std::make_unique<AsyncOutput>(
+                           m_commandProcessor.get(),
+                           MakeFileOutput(options, nullptr),
+                           fileThreads, options.queue, options.sinkCpus));
+      m_output.push_back(std::make_unique<AsyncOutput>(
+                           m_commandProcessor.get(),
+                           std::make_unique<ConsoleOutput>(nullptr, options.console),
+                           1, options.queue, options.sinkCpus, fileThreads));
+      if (options.aggregate.interval.count() > 0) {
+        m_output.push_back(std::make_unique<AsyncOutput>(
+                             m_commandProcessor.get(),
+                             std::make_unique<AggregateOutput>(nullptr, options.aggregate,
+                                                               table),
+                             1, options.queue, options.sinkCpus, fileThreads + 1));
+      }
+    }
+    if (!options.wal.path.empty()) {
+      // ввод, не разосланный до сбоя, возвращается в обработчик и заново
+      // попадает в журнал
+      m_wal = std::make_unique<WriteAheadLog>(options.wal);
+      m_commandProcessor->SetJournal(m_wal.get());
+      if (const auto recovered = m_wal->Recovered()) {
+        std::cerr << "Recovered " << recovered << " records from "
+                  << options.wal.path << std::endl;
+      }
+      m_wal->Replay([this](std::string_view text,
+                           std::chrono::system_clock::time_point timeStamp) {
+        m_context->ProcessCommand(text, timeStamp);
+      });
+    }
+  }
+
+  ~BatchConsoleInput() {
+    // остаток пакета сбрасывается, пока подписчики ещё живы;
+    // затем асинхронные выводы дорабатывают очереди и останавливают потоки
+    m_context.reset();
+    m_commandProcessor.reset();
+    // последняя отметка: незакрытый блок отбрасывается
+    m_wal.reset();
+  }
+
+  void ProcessCommand(const Command& command) {
+    m_context->ProcessCommand(command.text, command.timeStamp);
+  }
+
+  /**
+   * @brief обрабатывает команду, заданную представлением строки ввода;
+   * текст копируется сразу в буфер пакета
+   */
+  void ProcessCommand(std::string_view text,
+                      std::chrono::system_clock::time_point timeStamp) {
+    m_context->ProcessCommand(text, timeStamp);
+  }
+
+  /**
+   * @brief обрабатывает команду; отметку времени ставит обработчик
+   * согласно TimestampPolicy
+   */
+  void ProcessCommand(std::string_view text) {
+    m_context->ProcessCommand(text);
+  }
+
+  /**
+   * @brief серия команд без скобок блока (LineReader::ForEachCommand())
+   */
+  void ProcessCommands(const std::string_view* texts, size_t count) {
+    m_context->ProcessCommands(texts, count);
+  }
+
+  void ProcessBlockMarker(CommandKind kind) {
+    m_context->ProcessBlockMarker(kind);
+  }
+
+  BatchCommandProcessor& Processor() noexcept {
+    return *m_commandProcessor;
+  }
+
+  /**
+   * @brief приёмник, передающий команды контексту консоли, а не новому:
+   * блок, открытый восстановленным из журнала вводом, закрывается
+   * командами файла
+   */
+  std::unique_ptr<CommandReceiver> CreateReceiver() {
+    return std::make_unique<ContextReceiver>(*m_context);
+  }
+
+private:
+  static BulkOptions DefaultOptions(int bulkSize) {
+    BulkOptions options;
+    options.bulkSize = bulkSize;
+    return options;
+  }
+
+  /**
+   * @brief приёмник поверх чужого контекста; контекст им не владеет
+   */
+  class ContextReceiver : public CommandReceiver {
+  public:
+    explicit ContextReceiver(StreamContext& context) : m_context(context) {}
+
+    void ProcessCommand(std::string_view text) override {
+      m_context.ProcessCommand(text);
+    }
+
+    void ProcessCommands(const std::string_view* texts, size_t count) override {
+      m_context.ProcessCommands(texts, count);
+    }
+
+    void ProcessBlockMarker(CommandKind kind) override {
+      m_context.ProcessBlockMarker(kind);
+    }
+
+  private:
+    StreamContext& m_context;
+  };
+
+  void AddSink(std::unique_ptr<AsyncSink> sink, const SinkOptions& options) {
+    m_output.push_back(std::make_unique<AsyncSinkOutput>(
+                         m_commandProcessor.get(), std::move(sink),
+                         *m_executor, options.inflight, options.drain));
+  }
+
+  static std::unique_ptr<Output> MakeFileOutput(const BulkOptions& options,
+                                                BatchCommandProcessor *processor) {
+    if (options.fileSink == FileSink::Rolling) {
+      return std::make_unique<RollingFileOutput>(processor, options.rolling);
+    }
+    if (options.fileSink == FileSink::Compressed) {
+      return std::make_unique<CompressedFileOutput>(processor, options.rolling,
+                                                    options.compress);
+    }
+    if (options.fileSink == FileSink::Binary) {
+      return std::make_unique<BinaryFileOutput>(processor, options.rolling, options.binary);
+    }
+    if (options.uring.enabled) {
+      return UringReportWriter::Create(processor, options.uring);
+    }
+    return std::make_unique<ReportWriter>(processor);
+  }
+
+  std::unique_ptr<BatchCommandProcessor> m_commandProcessor;
+  std::unique_ptr<StreamContext> m_context;
+  std::unique_ptr<WriteAheadLog> m_wal;
+  // переживает выводы: их сопрограммы завершаются на его потоках
+  std::unique_ptr<SinkExecutor> m_executor;
+  std::vector<std::unique_ptr<Output>> m_output;
+};
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "CommandProcessor.h"
+#include "LockFreeRing.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+
+#include <unistd.h>
+
+/**
+ * @brief поведение очереди при заполнении
+ */
+enum class Backpressure {
+  Block,       // писатель ждёт освобождения места
+  DropOldest,  // самый старый пакет вытесняется
+  Spill        // пакет сбрасывается во временный файл
+};
+
+struct QueueOptions {
+  size_t capacity = 1024;
+  Backpressure backpressure = Backpressure::Block;
+};
+
+/**
+ * @brief счётчики очереди
+ *
+ * Счётчики писателя и читателя лежат в разных кэш-линиях: иначе каждый
+ * Push() и Pop() отбирал бы линию у другой стороны.
+ */
+struct QueueStats {
+  alignas(CACHE_LINE) std::atomic<uint64_t> pushed{0};
+  std::atomic<uint64_t> stalls{0};    // писатель застал очередь заполненной
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<uint64_t> spilled{0};
+  std::atomic<uint64_t> maxDepth{0};
+  alignas(CACHE_LINE) std::atomic<uint64_t> popped{0};
+
+  void Increment(std::atomic<uint64_t>& counter) noexcept {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void UpdateDepth(uint64_t depth) noexcept {
+    auto current = maxDepth.load(std::memory_order_relaxed);
+    while (depth > current &&
+           !maxDepth.compare_exchange_weak(current, depth,
+                                           std::memory_order_relaxed)) {
+    }
+  }
+};
+
+/**
+ * @brief временный файл для пакетов, не поместившихся в очередь
+ *
+ * Пакеты читаются в порядке записи; когда файл опустошается, он
+ * обрезается до нуля. Пакет, чья запись уже вынесена на диск
+ * (Batch::Spilled()), не копируется: в файл пишется только метка, а сам
+ * пакет ждёт своей очереди в памяти.
+ */
+class SpillFile {
+public:
+  SpillFile() : m_file(std::tmpfile()) {
+    if (!m_file) {
+      throw std::runtime_error("Unable to create spill file.");
+    }
+  }
+
+  ~SpillFile() {
+    std::fclose(m_file);
+  }
+
+  SpillFile(const SpillFile&) = delete;
+  SpillFile& operator=(const SpillFile&) = delete;
+
+  void Write(const BatchPtr& batch) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string record;
+    if (batch->Spilled()) {
+      AppendValue(record, PINNED);
+      m_pinned.push_back(batch);
+      WriteRecord(record);
+      return;
+    }
+    AppendValue(record, static_cast<uint8_t>(batch->GetKind()));
+    AppendValue(record, static_cast<uint32_t>(batch->Size()));
+    for (const auto command : *batch) {
+      AppendValue(record, static_cast<int64_t>(
+                    command.timeStamp.time_since_epoch().count()));
+      AppendValue(record, static_cast<uint32_t>(command.text.size()));
+      record.append(command.text);
+    }
+    WriteRecord(record);
+  }
+
+  bool Read(BatchPtr& batch) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_count.load(std::memory_order_acquire) == 0) {
+      return false;
+    }
+    uint8_t kind = 0;
+    uint32_t count = 0;
+    ReadValue(kind);
+    if (kind == PINNED) {
+      batch = std::move(m_pinned.front());
+      m_pinned.pop_front();
+      Consumed();
+      return true;
+    }
+    ReadValue(count);
+    auto restored = std::make_shared<Batch>();
+    restored->Reserve(count);
+    restored->SetKind(static_cast<Batch::Kind>(kind));
+    std::string text;
+    for (uint32_t i = 0; i < count; ++i) {
+      int64_t ticks = 0;
+      uint32_t size = 0;
+      ReadValue(ticks);
+      ReadValue(size);
+      text.resize(size);
+      ReadBytes(text.data(), size);
+      restored->Append(text, std::chrono::system_clock::time_point(
+                         std::chrono::system_clock::duration(ticks)));
+    }
+    batch = std::move(restored);
+    Consumed();
+    return true;
+  }
+
+  bool Empty() const noexcept {
+    return m_count.load(std::memory_order_acquire) == 0;
+  }
+
+private:
+  static constexpr uint8_t PINNED = 0xff;
+
+  void WriteRecord(const std::string& record) {
+    if (::pwrite(fileno(m_file), record.data(), record.size(),
+                 static_cast<off_t>(m_writeOffset)) !=
+        static_cast<ssize_t>(record.size())) {
+      throw std::runtime_error("Unable to write spill file.");
+    }
+    m_writeOffset += record.size();
+    m_count.fetch_add(1, std::memory_order_release);
+  }
+
+  void Consumed() {
+    if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      m_readOffset = m_writeOffset = 0;
+      if (::ftruncate(fileno(m_file), 0) != 0) {
+        throw std::runtime_error("Unable to truncate spill file.");
+      }
+    }
+  }
+
+  template <typename T>
+  static void AppendValue(std::string& record, T value) {
+    record.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  template <typename T>
+  void ReadValue(T& value) {
+    ReadBytes(reinterpret_cast<char*>(&value), sizeof(value));
+  }
+
+  void ReadBytes(char* data, size_t size) {
+    if (::pread(fileno(m_file), data, size, static_cast<off_t>(m_readOffset)) !=
+        static_cast<ssize_t>(size)) {
+      throw std::runtime_error("Unable to read spill file.");
+    }
+    m_readOffset += size;
+  }
+
+  std::FILE* m_file;
+  std::mutex m_mutex;
+  size_t m_writeOffset = 0;
+  size_t m_readOffset = 0;
+  std::atomic<size_t> m_count{0};
+  std::deque<BatchPtr> m_pinned;
+};
+
+/**
+ * @brief ожидание событий очереди
+ *
+ * Ждущая сторона сначала крутится, затем засыпает на условной переменной;
+ * будящая сторона захватывает мьютекс, только если кто-то действительно спит.
+ * Счётчик спящих, который будящая сторона читает при каждом Notify(),
+ * занимает отдельную кэш-линию, чтобы соседние объекты её не делили.
+ */
+class Parker {
+public:
+  template <typename Predicate>
+  void Wait(Predicate ready) {
+    for (int i = 0; i < SPIN_COUNT; ++i) {
+      if (ready()) {
+        return;
+      }
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+    while (!ready()) {
+      // тайм-аут страхует от пропущенного пробуждения
+      m_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+    m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_seq_cst) != 0) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_cv.notify_all();
+    }
+  }
+
+private:
+  static constexpr int SPIN_COUNT = 64;
+
+  alignas(CACHE_LINE) std::atomic<int> m_sleepers{0};
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+};
+
+/**
+ * @brief очередь запечатанных пакетов между читателем и потоками вывода
+ */
+class BatchQueue {
+public:
+  virtual ~BatchQueue() = default;
+
+  virtual void Push(BatchPtr batch) = 0;
+
+  /**
+   * @brief извлекает пакет, ожидая его появления
+   * @return false, если очередь закрыта и пуста
+   */
+  virtual bool Pop(BatchPtr& batch) = 0;
+
+  virtual void Close() = 0;
+
+  virtual size_t Depth() const noexcept = 0;
+
+  const QueueStats& Stats() const noexcept {
+    return m_stats;
+  }
+
+protected:
+  QueueStats m_stats;
+};
+
+/**
+ * @brief очередь поверх кольца без блокировок с заданной политикой
+ * заполнения
+ *
+ * Ring — SpscRing или MpmcRing. Вытеснение старых пакетов означает, что
+ * писатель сам извлекает элемент, поэтому DropOldest требует MpmcRing.
+ */
+template <typename Ring>
+class RingBatchQueue : public BatchQueue {
+public:
+  explicit RingBatchQueue(const QueueOptions& options)
+    : m_ring(options.capacity), m_backpressure(options.backpressure) {
+    if (m_backpressure == Backpressure::Spill) {
+      m_spill = std::make_unique<SpillFile>();
+    }
+  }
+
+  void Push(BatchPtr batch) override {
+    m_stats.Increment(m_stats.pushed);
+    // пока в файле есть пакеты, новые пишутся туда же, чтобы не нарушить
+    // порядок
+    if (m_spill && !m_spill->Empty()) {
+      SpillBatch(batch);
+      return;
+    }
+    if (!m_ring.TryPush(batch)) {
+      m_stats.Increment(m_stats.stalls);
+      switch (m_backpressure) {
+      case Backpressure::Block:
+        m_notFull.Wait([&] { return m_ring.TryPush(batch); });
+        break;
+      case Backpressure::DropOldest: {
+        BatchPtr oldest;
+        while (!m_ring.TryPush(batch)) {
+          if (m_ring.TryPop(oldest)) {
+            m_stats.Increment(m_stats.dropped);
+          }
+        }
+        break;
+      }
+      case Backpressure::Spill:
+        SpillBatch(batch);
+        return;
+      }
+    }
+    const auto depth = m_ring.Size();
+    m_stats.UpdateDepth(depth);
+    Metrics::Record(MetricHistogram::QueueDepth, depth);
+    m_notEmpty.Notify();
+  }
+
+  bool Pop(BatchPtr& batch) override {
+    batch.reset();
+    m_notEmpty.Wait([&] {
+      return TryPop(batch) || m_closed.load(std::memory_order_acquire);
+    });
+    if (!batch && !TryPop(batch)) {
+      return false;
+    }
+    m_stats.Increment(m_stats.popped);
+    m_notFull.Notify();
+    return true;
+  }
+
+  void Close() override {
+    m_closed.store(true, std::memory_order_release);
+    m_notEmpty.Notify();
+  }
+
+  size_t Depth() const noexcept override {
+    return m_ring.Size();
+  }
+
+private:
+  bool TryPop(BatchPtr& batch) {
+    return m_ring.TryPop(batch) || (m_spill && m_spill->Read(batch));
+  }
+
+  void SpillBatch(const BatchPtr& batch) {
+    m_spill->Write(batch);
+    m_stats.Increment(m_stats.spilled);
+    m_notEmpty.Notify();
+  }
+
+  Ring m_ring;
+  const Backpressure m_backpressure;
+  std::unique_ptr<SpillFile> m_spill;
+  std::atomic<bool> m_closed{false};
+  Parker m_notEmpty;
+  Parker m_notFull;
+};
+
+/**
+ * @brief создаёт очередь под заданное число читателей
+ */
+inline std::unique_ptr<BatchQueue> MakeBatchQueue(size_t consumers,
+                                                  const QueueOptions& options) {
+  if (consumers == 1 && options.backpressure != Backpressure::DropOldest) {
+    return std::make_unique<RingBatchQueue<SpscRing<BatchPtr>>>(options);
+  }
+  return std::make_unique<RingBatchQueue<MpmcRing<BatchPtr>>>(options);
+}
@@ -0,0 +1,480 @@
+#pragma once
+
+#include "RollingFileOutput.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/**
+ * @brief двоичный формат сегмента
+ *
+ * Сегмент начинается с "BLKB", версии (1 байт) и 3 байт нулей. Далее
+ * записи пакетов: заголовок (размер всей записи u64, номер пакета u64,
+ * отметка времени первой команды i64, число команд u32, crc32 данных u32,
+ * вид пакета u8, 7 байт нулей) и данные — команды подряд: смещение
+ * отметки времени от первой команды (i64), длина текста (u32) и текст.
+ * Отметки времени — тики system_clock. Числа записаны в порядке байт
+ * машины.
+ *
+ * Рядом с сегментом пишется индекс <сегмент>.idx: "BLKI", версия, 3 байта
+ * нулей и записи по 24 байта (номер пакета u64, отметка времени i64,
+ * смещение записи в сегменте u64). Индекс разреженный: запись появляется
+ * не чаще чем раз в BinaryOptions::indexInterval байт сегмента, первая
+ * запись сегмента индексируется всегда. Номера и смещения в индексе
+ * возрастают, поэтому поиск по ним двоичный.
+ */
+struct BinaryFormat {
+  static constexpr char MAGIC[4] = {'B', 'L', 'K', 'B'};
+  static constexpr char INDEX_MAGIC[4] = {'B', 'L', 'K', 'I'};
+  static constexpr uint8_t VERSION = 1;
+  static constexpr size_t HEADER_SIZE = 8;
+  static constexpr size_t RECORD_HEADER_SIZE = 40;
+  static constexpr size_t COMMAND_HEADER_SIZE = 12;
+  static constexpr size_t INDEX_ENTRY_SIZE = 24;
+  static constexpr const char* EXTENSION = ".blk";
+  static constexpr const char* INDEX_EXTENSION = ".idx";
+
+  struct RecordHeader {
+    uint64_t size;
+    uint64_t id;
+    int64_t firstTimeStamp;
+    uint32_t count;
+    uint32_t crc;
+    uint8_t kind;
+    uint8_t reserved[7];
+  };
+
+  struct IndexEntry {
+    uint64_t id;
+    int64_t firstTimeStamp;
+    uint64_t offset;
+  };
+
+  static std::string IndexPath(const std::string& segment) {
+    const auto dot = segment.rfind('.');
+    const auto slash = segment.rfind('/');
+    const auto stem = dot != std::string::npos && (slash == std::string::npos || dot > slash)
+        ? segment.substr(0, dot) : segment;
+    return stem + INDEX_EXTENSION;
+  }
+};
+
+static_assert(sizeof(BinaryFormat::RecordHeader) == BinaryFormat::RECORD_HEADER_SIZE,
+              "unexpected record header layout");
+static_assert(sizeof(BinaryFormat::IndexEntry) == BinaryFormat::INDEX_ENTRY_SIZE,
+              "unexpected index entry layout");
+
+struct BinaryOptions {
+  // не чаще чем раз в столько байт сегмента запись попадает в индекс
+  size_t indexInterval = 64 * 1024;
+};
+
+/**
+ * @brief вывод пакетов в двоичные сегменты с индексом
+ *
+ * Команды пакета пишутся без форматирования, вместе с отметками времени,
+ * поэтому архив можно воспроизвести с исходным темпом. Вынесенный на диск
+ * блок проходит через буфер по частям: заголовок записи дописывается,
+ * когда известны её размер и контрольная сумма. Сегменты ротируются, как
+ * у RollingFileOutput, и называются <prefix><микросекунды>-<номер>.blk.
+ * Номер пакета — порядковый номер в выводе, сквозной для всех сегментов.
+ */
+class BinaryFileOutput : public Output { // subscriber
+public:
+  BinaryFileOutput(BatchCommandProcessor *processor,
+                   const RollingOptions& rolling = RollingOptions(),
+                   const BinaryOptions& options = BinaryOptions())
+    : m_rolling(rolling), m_options(options) {
+    m_buffer.reserve(m_rolling.bufferSize);
+    if (processor) {
+      processor->subscribe(this);
+    }
+  }
+
+  ~BinaryFileOutput() override {
+    CloseSegment();
+  }
+
+  void update(const BatchPtr& batch) override {
+    MetricTimer timer(MetricHistogram::BinaryWriteNs);
+    TraceSpan span("write binary", batch->TraceId(), batch->Size());
+    if (batch->Size() == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd >= 0 && NeedRotate()) {
+      CloseSegment();
+    }
+    if (m_fd < 0) {
+      OpenSegment();
+    }
+
+    BinaryFormat::RecordHeader header{};
+    header.id = m_nextId++;
+    header.firstTimeStamp = batch->Front().timeStamp.time_since_epoch().count();
+    header.count = static_cast<uint32_t>(batch->Size());
+    header.kind = static_cast<uint8_t>(batch->GetKind());
+    const uint64_t start = m_flushed + m_buffer.size();
+    if (m_indexed == 0 || start - m_lastIndexed >= m_options.indexInterval) {
+      const BinaryFormat::IndexEntry entry{header.id, header.firstTimeStamp, start};
+      m_index.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+      m_lastIndexed = start;
+      ++m_indexed;
+    }
+
+    m_buffer.append(BinaryFormat::RECORD_HEADER_SIZE, '\0');
+    // данные, ещё не учтённые в контрольной сумме, начинаются с checked
+    uLong crc = crc32(0, nullptr, 0);
+    size_t checked = m_buffer.size();
+    auto flush = [this, &crc, &checked] {
+      crc = crc32_z(crc, reinterpret_cast<const Bytef*>(m_buffer.data() + checked),
+                    m_buffer.size() - checked);
+      FlushBuffer();
+      checked = 0;
+    };
+    const auto first = batch->Front().timeStamp;
+    batch->ForEachCommand([this, &first, &flush](const CommandView& command) {
+      const auto delta = static_cast<int64_t>((command.timeStamp - first).count());
+      const auto length = static_cast<uint32_t>(command.text.size());
+      char prefix[BinaryFormat::COMMAND_HEADER_SIZE];
+      std::memcpy(prefix, &delta, sizeof(delta));
+      std::memcpy(prefix + sizeof(delta), &length, sizeof(length));
+      m_buffer.append(prefix, sizeof(prefix)).append(command.text);
+      if (m_buffer.size() >= m_rolling.bufferSize) {
+        flush();
+      }
+    });
+    crc = crc32_z(crc, reinterpret_cast<const Bytef*>(m_buffer.data() + checked),
+                  m_buffer.size() - checked);
+    header.crc = static_cast<uint32_t>(crc);
+    header.size = m_flushed + m_buffer.size() - start;
+    WriteHeader(start, header);
+    Metrics::Add(MetricCounter::BinaryBytes, header.size);
+
+    if (m_buffer.size() >= m_rolling.bufferSize ||
+        m_rolling.fsync == FsyncPolicy::EveryBatch) {
+      FlushBuffer();
+    }
+    if (m_rolling.fsync == FsyncPolicy::EveryBatch) {
+      ::fdatasync(m_fd);
+    }
+  }
+
+private:
+  bool NeedRotate() const {
+    return m_flushed + m_buffer.size() >= m_rolling.maxSegmentBytes ||
+        std::chrono::steady_clock::now() - m_segmentStart >= m_rolling.maxSegmentAge;
+  }
+
+  /**
+   * @brief заголовок ещё в буфере копируется туда, уже записанный —
+   * переписывается на месте
+   */
+  void WriteHeader(uint64_t offset, const BinaryFormat::RecordHeader& header) {
+    if (offset >= m_flushed) {
+      std::memcpy(m_buffer.data() + (offset - m_flushed), &header, sizeof(header));
+      return;
+    }
+    if (::pwrite(m_fd, &header, sizeof(header), static_cast<off_t>(offset)) !=
+        static_cast<ssize_t>(sizeof(header))) {
+      throw std::runtime_error("Unable to write segment.");
+    }
+  }
+
+  void OpenSegment() {
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    const auto filename = m_rolling.prefix + std::to_string(micros) + "-" +
+        std::to_string(m_segmentIndex++) + BinaryFormat::EXTENSION;
+    // без O_APPEND: заголовки записей дописываются pwrite
+    m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Unable to open segment " + filename);
+    }
+    const auto indexName = BinaryFormat::IndexPath(filename);
+    m_indexFd = ::open(indexName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_indexFd < 0) {
+      ::close(m_fd);
+      m_fd = -1;
+      throw std::runtime_error("Unable to open segment index " + indexName);
+    }
+    m_flushed = 0;
+    m_indexed = 0;
+    m_lastIndexed = 0;
+    m_segmentStart = std::chrono::steady_clock::now();
+
+    char header[BinaryFormat::HEADER_SIZE] = {};
+    header[4] = static_cast<char>(BinaryFormat::VERSION);
+    std::memcpy(header, BinaryFormat::MAGIC, sizeof(BinaryFormat::MAGIC));
+    m_buffer.append(header, sizeof(header));
+    std::memcpy(header, BinaryFormat::INDEX_MAGIC, sizeof(BinaryFormat::INDEX_MAGIC));
+    m_index.append(header, sizeof(header));
+  }
+
+  void CloseSegment() {
+    if (m_fd < 0) {
+      return;
+    }
+    FlushBuffer();
+    if (m_rolling.fsync != FsyncPolicy::Never) {
+      ::fdatasync(m_fd);
+      ::fdatasync(m_indexFd);
+    }
+    ::close(m_fd);
+    ::close(m_indexFd);
+    m_fd = m_indexFd = -1;
+  }
+
+  /**
+   * @brief индекс пишется после данных: его записи не опережают сегмент
+   */
+  void FlushBuffer() {
+    WriteAll(m_fd, m_buffer);
+    m_flushed += m_buffer.size();
+    m_buffer.clear();
+    WriteAll(m_indexFd, m_index);
+    m_index.clear();
+  }
+
+  static void WriteAll(int fd, const std::string& data) {
+    const char* begin = data.data();
+    size_t size = data.size();
+    while (size > 0) {
+      const auto written = ::write(fd, begin, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Unable to write segment.");
+      }
+      begin += written;
+      size -= static_cast<size_t>(written);
+    }
+  }
+
+  const RollingOptions m_rolling;
+  const BinaryOptions m_options;
+  std::mutex m_mutex;
+  std::string m_buffer;
+  std::string m_index;
+  int m_fd = -1;
+  int m_indexFd = -1;
+  uint64_t m_nextId = 0;
+  // смещение начала m_buffer в сегменте
+  uint64_t m_flushed = 0;
+  uint64_t m_lastIndexed = 0;
+  size_t m_indexed = 0;
+  size_t m_segmentIndex = 0;
+  std::chrono::steady_clock::time_point m_segmentStart;
+};
+
+/**
+ * @brief запись пакета в отображённом сегменте
+ */
+struct BinaryRecord {
+  uint64_t id;
+  std::chrono::system_clock::time_point firstTimeStamp;
+  Batch::Kind kind;
+  uint32_t count;
+  // команды в формате сегмента, без заголовка
+  std::string_view payload;
+
+  /**
+   * @brief передаёт handler'у команды записи; текст указывает в
+   * отображение сегмента
+   */
+  template <typename Handler>
+  void ForEachCommand(Handler&& handler) const {
+    const char* data = payload.data();
+    const char* const end = data + payload.size();
+    for (uint32_t i = 0; i < count; ++i) {
+      if (static_cast<size_t>(end - data) < BinaryFormat::COMMAND_HEADER_SIZE) {
+        throw std::runtime_error("Corrupted segment record " + std::to_string(id));
+      }
+      int64_t delta = 0;
+      uint32_t length = 0;
+      std::memcpy(&delta, data, sizeof(delta));
+      std::memcpy(&length, data + sizeof(delta), sizeof(length));
+      data += BinaryFormat::COMMAND_HEADER_SIZE;
+      if (static_cast<size_t>(end - data) < length) {
+        throw std::runtime_error("Corrupted segment record " + std::to_string(id));
+      }
+      handler(CommandView{std::string_view(data, length),
+                          firstTimeStamp + std::chrono::system_clock::duration(delta)});
+      data += length;
+    }
+  }
+};
+
+/**
+ * @brief чтение двоичного сегмента и его индекса
+ *
+ * Сегмент отображается в память целиком; записи разбираются на месте,
+ * без копирования. Индекс позволяет начать чтение с нужного пакета или
+ * момента времени и поделить сегмент на части для параллельного чтения:
+ * границы частей — смещения записей из индекса. Если индекса нет, он
+ * заменяется единственной записью о начале сегмента.
+ */
+class BinarySegmentReader {
+public:
+  /**
+   * @param populate заранее прочитать весь сегмент в память (MAP_POPULATE)
+   */
+  explicit BinarySegmentReader(const std::string& path, bool populate = false) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to open " + path);
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0 ||
+        static_cast<size_t>(info.st_size) < BinaryFormat::HEADER_SIZE) {
+      ::close(fd);
+      throw std::runtime_error("Not a binary bulk segment: " + path);
+    }
+    m_size = static_cast<size_t>(info.st_size);
+    void* data = ::mmap(nullptr, m_size, PROT_READ,
+                        MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Unable to map " + path);
+    }
+    m_data = static_cast<const char*>(data);
+    if (std::memcmp(m_data, BinaryFormat::MAGIC, sizeof(BinaryFormat::MAGIC)) != 0 ||
+        static_cast<uint8_t>(m_data[4]) != BinaryFormat::VERSION) {
+      ::munmap(data, m_size);
+      throw std::runtime_error("Not a binary bulk segment: " + path);
+    }
+    LoadIndex(BinaryFormat::IndexPath(path));
+  }
+
+  ~BinarySegmentReader() {
+    ::munmap(const_cast<char*>(m_data), m_size);
+  }
+
+  BinarySegmentReader(const BinarySegmentReader&) = delete;
+  BinarySegmentReader& operator=(const BinarySegmentReader&) = delete;
+
+  static bool IsSegment(std::string_view header) noexcept {
+    return header.size() >= sizeof(BinaryFormat::MAGIC) &&
+        std::memcmp(header.data(), BinaryFormat::MAGIC, sizeof(BinaryFormat::MAGIC)) == 0;
+  }
+
+  size_t Size() const noexcept {
+    return m_size;
+  }
+
+  const std::vector<BinaryFormat::IndexEntry>& Index() const noexcept {
+    return m_index;
+  }
+
+  /**
+   * @brief смещение, с которого достаточно читать, чтобы встретить пакет
+   * с номером id
+   */
+  uint64_t FindBatch(uint64_t id) const noexcept {
+    auto it = std::upper_bound(m_index.begin(), m_index.end(), id,
+                               [](uint64_t value, const BinaryFormat::IndexEntry& entry) {
+      return value < entry.id;
+    });
+    return it == m_index.begin() ? BinaryFormat::HEADER_SIZE : std::prev(it)->offset;
+  }
+
+  /**
+   * @brief смещение, с которого достаточно читать, чтобы встретить
+   * пакеты не старше timeStamp; отметки пакетов считаются возрастающими
+   * в порядке записи
+   */
+  uint64_t FindTime(std::chrono::system_clock::time_point timeStamp) const noexcept {
+    const int64_t ticks = timeStamp.time_since_epoch().count();
+    auto it = std::lower_bound(m_index.begin(), m_index.end(), ticks,
+                               [](const BinaryFormat::IndexEntry& entry, int64_t value) {
+      return entry.firstTimeStamp < value;
+    });
+    return it == m_index.begin() ? BinaryFormat::HEADER_SIZE : std::prev(it)->offset;
+  }
+
+  /**
+   * @brief делит сегмент не более чем на parts частей по границам записей
+   * @return возрастающие смещения: часть i — от result[i] до result[i + 1]
+   */
+  std::vector<uint64_t> Split(size_t parts) const {
+    std::vector<uint64_t> bounds{BinaryFormat::HEADER_SIZE};
+    const size_t step = m_size / std::max<size_t>(parts, 1);
+    for (const auto& entry : m_index) {
+      if (entry.offset >= bounds.back() + std::max<size_t>(step, 1) && entry.offset < m_size) {
+        bounds.push_back(entry.offset);
+      }
+    }
+    bounds.push_back(m_size);
+    return bounds;
+  }
+
+  /**
+   * @brief передаёт handler'у записи, начинающиеся в [begin, end);
+   * оборванная последняя запись (сегмент не был закрыт) пропускается
+   */
+  template <typename Handler>
+  void ForEachRecord(Handler&& handler, uint64_t begin = BinaryFormat::HEADER_SIZE,
+                     uint64_t end = UINT64_MAX) const {
+    end = std::min<uint64_t>(end, m_size);
+    for (uint64_t offset = begin; offset < end;) {
+      if (m_size - offset < BinaryFormat::RECORD_HEADER_SIZE) {
+        return;
+      }
+      BinaryFormat::RecordHeader header;
+      std::memcpy(&header, m_data + offset, sizeof(header));
+      if (header.size < BinaryFormat::RECORD_HEADER_SIZE || header.size > m_size - offset) {
+        return;
+      }
+      const std::string_view payload(m_data + offset + BinaryFormat::RECORD_HEADER_SIZE,
+                                     header.size - BinaryFormat::RECORD_HEADER_SIZE);
+      if (crc32_z(crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(payload.data()),
+                  payload.size()) != header.crc) {
+        throw std::runtime_error("Corrupted segment record " + std::to_string(header.id));
+      }
+      handler(BinaryRecord{header.id,
+                           std::chrono::system_clock::time_point(
+                             std::chrono::system_clock::duration(header.firstTimeStamp)),
+                           static_cast<Batch::Kind>(header.kind), header.count, payload});
+      offset += header.size;
+    }
+  }
+
+private:
+  void LoadIndex(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      struct stat info {};
+      char header[BinaryFormat::HEADER_SIZE];
+      if (::fstat(fd, &info) == 0 &&
+          static_cast<size_t>(info.st_size) >= sizeof(header) &&
+          ::read(fd, header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+          std::memcmp(header, BinaryFormat::INDEX_MAGIC, sizeof(BinaryFormat::INDEX_MAGIC)) == 0) {
+        m_index.resize((static_cast<size_t>(info.st_size) - sizeof(header)) /
+                       BinaryFormat::INDEX_ENTRY_SIZE);
+        const auto bytes = m_index.size() * BinaryFormat::INDEX_ENTRY_SIZE;
+        if (::pread(fd, m_index.data(), bytes, sizeof(header)) != static_cast<ssize_t>(bytes)) {
+          m_index.clear();
+        }
+      }
+      ::close(fd);
+    }
+    // запись индекса может опережать оборванный сегмент
+    while (!m_index.empty() && m_index.back().offset >= m_size) {
+      m_index.pop_back();
+    }
+    if (m_index.empty()) {
+      m_index.push_back(BinaryFormat::IndexEntry{0, INT64_MIN, BinaryFormat::HEADER_SIZE});
+    }
+  }
+
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+  std::vector<BinaryFormat::IndexEntry> m_index;
+};
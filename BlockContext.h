@@ -0,0 +1,173 @@
+#pragma once
+
+#include "CommandProcessor.h"
+
+/**
+ * @brief приёмник команд одного источника (соединения, файла)
+ */
+class CommandReceiver {
+public:
+  virtual ~CommandReceiver() = default;
+
+  virtual void ProcessCommand(std::string_view text) = 0;
+
+  /**
+   * @brief серия команд без скобок блока, разобранная
+   * LineReader::ScanCommands()
+   */
+  virtual void ProcessCommands(const std::string_view* texts, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      ProcessCommand(texts[i]);
+    }
+  }
+
+  virtual void ProcessBlockMarker(CommandKind kind) {
+    ProcessCommand(kind == CommandKind::StartBlock ? START_BLOCK : END_BLOCK);
+  }
+
+  /**
+   * @brief источник прочитал всё, что было доступно
+   */
+  virtual void Flush() {}
+};
+
+/**
+ * @brief разбор команд единственного источника
+ *
+ * Блоки ведёт сам обработчик: открытие внешнего блока сбрасывает
+ * накопленный статический пакет, закрытие — публикует динамический.
+ * Лишняя закрывающая скобка игнорируется. Processor —
+ * BatchCommandProcessor или BasicBatchProcessor.
+ */
+template <typename Processor>
+class BasicStreamContext final : public CommandReceiver {
+public:
+  explicit BasicStreamContext(Processor& processor)
+    : m_processor(processor) {}
+
+  /**
+   * @brief команда с отметкой времени согласно TimestampPolicy
+   */
+  void ProcessCommand(std::string_view text) override {
+    if (!ProcessBlockMarker(text)) {
+      m_processor.ProcessCommand(text);
+    }
+  }
+
+  void ProcessCommand(std::string_view text,
+                      std::chrono::system_clock::time_point timeStamp) {
+    if (!ProcessBlockMarker(text)) {
+      m_processor.ProcessCommand(text, timeStamp);
+    }
+  }
+
+  /**
+   * @brief серия уже распознанных команд уходит обработчику целиком
+   */
+  void ProcessCommands(const std::string_view* texts, size_t count) override {
+    m_processor.ProcessCommands(texts, count);
+  }
+
+  void ProcessBlockMarker(CommandKind kind) override {
+    if (kind == CommandKind::StartBlock) {
+      if (m_blockDepth++ == 0) {
+        m_processor.StartBlock();
+      }
+    }
+    else if (m_blockDepth > 0 && --m_blockDepth == 0) {
+      m_processor.FinishBlock();
+    }
+  }
+
+private:
+  /**
+   * @return true, если text — скобка блока
+   */
+  bool ProcessBlockMarker(std::string_view text) {
+    const auto kind = Classify(text);
+    if (kind == CommandKind::Command) {
+      return false;
+    }
+    ProcessBlockMarker(kind);
+    return true;
+  }
+
+  Processor& m_processor;
+  int m_blockDepth = 0;
+};
+
+using StreamContext = BasicStreamContext<BatchCommandProcessor>;
+
+/**
+ * @brief разбор команд одного источника при общем статическом пакете
+ *
+ * Команды вне блоков всех источников попадают в общий статический пакет
+ * обработчика. Динамический блок принадлежит источнику: его команды
+ * копятся в собственном пакете контекста и публикуются целиком по
+ * закрывающей скобке. Открытие блока не сбрасывает общий пакет — его
+ * продолжают наполнять другие источники. Незакрытый при отключении блок
+ * отбрасывается, как и в конце ввода консоли.
+ */
+class BlockContext : public CommandReceiver {
+public:
+  explicit BlockContext(BatchCommandProcessor& processor)
+    : m_processor(processor) {}
+
+  void ProcessCommand(std::string_view text) override {
+    const auto kind = Classify(text);
+    if (kind == CommandKind::Command) {
+      ProcessCommands(&text, 1);
+    }
+    else {
+      ProcessBlockMarker(kind);
+    }
+  }
+
+  /**
+   * @brief команда с отметкой времени, поставленной источником
+   */
+  void ProcessCommand(std::string_view text,
+                      std::chrono::system_clock::time_point timeStamp) {
+    const auto kind = Classify(text);
+    if (kind != CommandKind::Command) {
+      ProcessBlockMarker(kind);
+    }
+    else if (m_blockDepth == 0) {
+      m_processor.ProcessCommand(text, timeStamp);
+    }
+    else {
+      Metrics::Add(MetricCounter::CommandsIn);
+      m_block->Append(text, timeStamp);
+      m_processor.LimitBlock(*m_block);
+    }
+  }
+
+  void ProcessCommands(const std::string_view* texts, size_t count) override {
+    if (m_blockDepth == 0) {
+      m_processor.ProcessCommands(texts, count);
+      return;
+    }
+    Metrics::Add(MetricCounter::CommandsIn, count);
+    for (size_t i = 0; i < count; ++i) {
+      m_block->Append(texts[i], m_processor.TimeStamp(*m_block));
+      m_processor.LimitBlock(*m_block);
+    }
+  }
+
+  void ProcessBlockMarker(CommandKind kind) override {
+    if (kind == CommandKind::StartBlock) {
+      if (m_blockDepth++ == 0) {
+        m_block = m_processor.AcquireBatch();
+        m_block->SampleTrace();
+      }
+    }
+    else if (m_blockDepth > 0 && --m_blockDepth == 0) {
+      m_processor.PublishBatch(std::move(m_block), Batch::Kind::Dynamic);
+    }
+  }
+
+private:
+  BatchCommandProcessor& m_processor;
+  int m_blockDepth = 0;
+  std::unique_ptr<Batch> m_block;
+};
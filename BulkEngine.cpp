@@ -0,0 +1,98 @@
+#include "BulkEngine.h"
+#include "BlockContext.h"
+
+namespace {
+
+/**
+ * @brief подписчик, передающий пакеты обратному вызову
+ */
+class CallbackOutput { // subscriber
+public:
+  explicit CallbackOutput(BulkEngine::BatchCallback callback)
+    : m_callback(std::move(callback)) {}
+
+  void update(const BatchPtr& batch) {
+    m_callback(batch);
+  }
+
+private:
+  BulkEngine::BatchCallback m_callback;
+};
+
+using EngineProcessor = BasicBatchProcessor<CallbackOutput>;
+
+} // namespace
+
+class BulkEngine::Impl {
+public:
+  Impl(const EngineOptions& options, BatchCallback callback)
+    : m_output(std::move(callback)),
+      m_processor(std::make_unique<EngineProcessor>(options.bulkSize,
+                                                    options.timestamps,
+                                                    options.flush, m_output)),
+      m_context(*m_processor) {}
+
+  ~Impl() {
+    // остаток пакета публикуется, пока обратный вызов ещё жив
+    m_processor.reset();
+  }
+
+  BasicStreamContext<EngineProcessor>& Context() noexcept {
+    return m_context;
+  }
+
+private:
+  CallbackOutput m_output;
+  std::unique_ptr<EngineProcessor> m_processor;
+  BasicStreamContext<EngineProcessor> m_context;
+};
+
+BulkEngine::BulkEngine(const EngineOptions& options, BatchCallback callback)
+  : m_impl(std::make_unique<Impl>(options, std::move(callback))) {}
+
+BulkEngine::~BulkEngine() = default;
+
+void BulkEngine::Process(std::string_view text) {
+  m_impl->Context().ProcessCommand(text);
+}
+
+void BulkEngine::Process(const Command& command) {
+  m_impl->Context().ProcessCommand(command.text, command.timeStamp);
+}
+
+void BulkEngine::Process(Command&& command) {
+  // текст всё равно копируется в буфер пакета, поэтому перемещённая
+  // команда обрабатывается так же, как константная
+  Process(static_cast<const Command&>(command));
+}
+
+void BulkEngine::Process(const Command* commands, size_t count) {
+  auto& context = m_impl->Context();
+  for (size_t i = 0; i < count; ++i) {
+    context.ProcessCommand(commands[i].text, commands[i].timeStamp);
+  }
+}
+
+void BulkEngine::Process(const std::string_view* texts, size_t count) {
+  // команды между скобками уходят обработчику одной серией
+  auto& context = m_impl->Context();
+  size_t begin = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const auto kind = Classify(texts[i]);
+    if (kind != CommandKind::Command) {
+      if (i != begin) {
+        context.ProcessCommands(texts + begin, i - begin);
+      }
+      context.ProcessBlockMarker(kind);
+      begin = i + 1;
+    }
+  }
+  if (count != begin) {
+    context.ProcessCommands(texts + begin, count - begin);
+  }
+}
+
+void BulkEngine::Process(std::vector<Command>&& commands) {
+  Process(commands.data(), commands.size());
+  commands.clear();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "CommandProcessor.h"
+
+#include <functional>
+
+/**
+ * @brief параметры встраиваемого обработчика
+ */
+struct EngineOptions {
+  int bulkSize = 3;
+  TimestampPolicy timestamps = TimestampPolicy::PerCommand;
+  FlushOptions flush;
+};
+
+/**
+ * @brief пакетный обработчик команд для встраивания в приложение
+ *
+ * Принимает команды по одной, массивами или перемещением и отдаёт
+ * запечатанные пакеты обратному вызову. Со скобками { } работает так же,
+ * как консольный bulk. Текст каждой команды копируется один раз — в буфер
+ * пакета. Экземпляр не потокобезопасен; обратный вызов выполняется в
+ * потоке, подающем команды, а при FlushOptions::timeout — также в потоке
+ * сброса по тайм-ауту (но не одновременно). Деструктор публикует
+ * незавершённый статический пакет, незакрытый блок отбрасывается.
+ */
+class BulkEngine {
+public:
+  using BatchCallback = std::function<void(const BatchPtr&)>;
+
+  BulkEngine(const EngineOptions& options, BatchCallback callback);
+  ~BulkEngine();
+
+  BulkEngine(const BulkEngine&) = delete;
+  BulkEngine& operator=(const BulkEngine&) = delete;
+
+  /**
+   * @brief команда с отметкой времени согласно EngineOptions::timestamps
+   */
+  void Process(std::string_view text);
+
+  void Process(const Command& command);
+
+  void Process(Command&& command);
+
+  void Process(const Command* commands, size_t count);
+
+  void Process(const std::string_view* texts, size_t count);
+
+  void Process(std::vector<Command>&& commands);
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> m_impl;
+};
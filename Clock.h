@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BULK_HAS_TSC 1
+#endif
+
+/**
+ * @brief как ставить отметки времени командам
+ */
+enum class TimestampPolicy {
+  PerCommand,    // system_clock::now() для каждой команды
+  FirstInBatch,  // только первая команда пакета, остальные получают её время
+  Coarse,        // время, обновляемое раз в миллисекунду отдельным потоком
+  Tsc            // счётчик тактов процессора, откалиброванный по system_clock
+};
+
+/**
+ * @brief грубые часы: поток-тикер раз в миллисекунду обновляет
+ * кэшированное время, чтение — одна атомарная загрузка
+ */
+class CoarseClock {
+public:
+  static constexpr std::chrono::milliseconds RESOLUTION{1};
+
+  CoarseClock() : m_now(Ticks(std::chrono::system_clock::now())) {
+    m_ticker = std::thread([this] {
+      while (!m_stop.load(std::memory_order_relaxed)) {
+        std::this_thread::sleep_for(RESOLUTION);
+        m_now.store(Ticks(std::chrono::system_clock::now()),
+                    std::memory_order_relaxed);
+      }
+    });
+  }
+
+  ~CoarseClock() {
+    m_stop.store(true, std::memory_order_relaxed);
+    m_ticker.join();
+  }
+
+  std::chrono::system_clock::time_point Now() const noexcept {
+    return std::chrono::system_clock::time_point(
+          std::chrono::system_clock::duration(m_now.load(std::memory_order_relaxed)));
+  }
+
+private:
+  static int64_t Ticks(std::chrono::system_clock::time_point time) noexcept {
+    return time.time_since_epoch().count();
+  }
+
+  std::atomic<int64_t> m_now;
+  std::atomic<bool> m_stop{false};
+  std::thread m_ticker;
+};
+
+/**
+ * @brief часы по счётчику тактов
+ *
+ * При создании за CALIBRATION измеряется частота счётчика относительно
+ * steady_clock; дальше время вычисляется от точки отсчёта без системных
+ * вызовов. Там, где счётчика нет, используется system_clock.
+ */
+class TscClock {
+public:
+  static constexpr std::chrono::milliseconds CALIBRATION{2};
+
+  TscClock() {
+#ifdef BULK_HAS_TSC
+    const auto steadyStart = std::chrono::steady_clock::now();
+    const auto tscStart = __rdtsc();
+    std::this_thread::sleep_for(CALIBRATION);
+    const auto tscEnd = __rdtsc();
+    const auto elapsed = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - steadyStart).count();
+
+    m_ticksPerTsc = elapsed * std::chrono::system_clock::period::den /
+        std::chrono::system_clock::period::num / static_cast<double>(tscEnd - tscStart);
+    m_base = std::chrono::system_clock::now();
+    m_tscBase = __rdtsc();
+#endif
+  }
+
+  std::chrono::system_clock::time_point Now() const noexcept {
+#ifdef BULK_HAS_TSC
+    const auto delta = static_cast<double>(__rdtsc() - m_tscBase) * m_ticksPerTsc;
+    return m_base + std::chrono::system_clock::duration(
+          static_cast<std::chrono::system_clock::rep>(delta));
+#else
+    return std::chrono::system_clock::now();
+#endif
+  }
+
+private:
+  std::chrono::system_clock::time_point m_base;
+  uint64_t m_tscBase = 0;
+  double m_ticksPerTsc = 0.0;
+};
+
+/**
+ * @brief источник отметок времени для обработчика команд
+ */
+class Timestamper {
+public:
+  explicit Timestamper(TimestampPolicy policy = TimestampPolicy::PerCommand)
+    : m_policy(policy) {
+    if (m_policy == TimestampPolicy::Coarse) {
+      m_coarse = std::make_unique<CoarseClock>();
+    }
+    else if (m_policy == TimestampPolicy::Tsc) {
+      m_tsc = std::make_unique<TscClock>();
+    }
+  }
+
+  /**
+   * @brief нужна ли отметка команде, которая не открывает пакет
+   */
+  bool EveryCommand() const noexcept {
+    return m_policy != TimestampPolicy::FirstInBatch;
+  }
+
+  std::chrono::system_clock::time_point Now() const noexcept {
+    switch (m_policy) {
+    case TimestampPolicy::Coarse:
+      return m_coarse->Now();
+    case TimestampPolicy::Tsc:
+      return m_tsc->Now();
+    default:
+      return std::chrono::system_clock::now();
+    }
+  }
+
+private:
+  const TimestampPolicy m_policy;
+  std::unique_ptr<CoarseClock> m_coarse;
+  std::unique_ptr<TscClock> m_tsc;
+};
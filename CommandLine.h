@@ -0,0 +1,305 @@
+#pragma once
+
+#include "BatchConsoleInput.h"
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#include <unistd.h>
+
+/**
+ * @brief разбирает аргументы командной строки:
+ * bulk [N] [FILE...] [--input-threads=K] [--file-threads=K] [--queue-size=Q] [--backpressure=block|drop|spill]
+ *      [--sink=files|rolling|compressed|binary] [--segment-size=BYTES] [--segment-age=SECONDS]
+ *      [--compress-level=L] [--compress-threads=K] [--no-dictionary] [--index-interval=BYTES]
+ *      [--fsync=never|rotate|batch] [--console=auto|line|buffered]
+ *      [--timestamps=command|batch|coarse|tsc] [--flush-timeout=MS]
+ *      [--adaptive] [--min-bulk=N] [--max-bulk=N] [--block-spill=BYTES]
+ *      [--listen=tcp:PORT|unix:PATH] [--server-threads=K]
+ *      [--shards=N] [--shard-key=source|command] [--no-pin]
+ *      [--metrics] [--metrics-listen=tcp:PORT|unix:PATH]
+ *      [--wal=PATH] [--wal-sync=MS] [--wal-size=BYTES]
+ *      [--file-io=sync|uring] [--uring-depth=N]
+ *      [--trace=PATH] [--trace-sample=N]
+ *      [--intern[=N]] [--aggregate=SECONDS]
+ *      [--sink-threads=K] [--sink-inflight=N] [--sink-drain=MS]
+ *      [--reader-cpus=LIST] [--shard-cpus=LIST] [--sink-cpus=LIST]
+ *
+ * @param extra разбирает собственные аргументы программы; вызывается
+ * первым и возвращает true, если аргумент принят
+ */
+inline bool ParseOptions(int argc, char const** argv, BulkOptions& options,
+                         const std::function<bool(const char*)>& extra = {}) {
+  // по умолчанию терминал получает каждый пакет сразу, а канал — блоками
+  options.console.mode = ::isatty(STDOUT_FILENO) ? ConsoleMode::LineFlushed
+                                                 : ConsoleMode::Buffered;
+  bool bulkSizeSet = false;
+  auto parseCpus = [](const char* list, std::vector<int>& cpus) {
+    if (ParseCpuList(list, cpus)) {
+      return true;
+    }
+    std::cerr << "Invalid cpu list: " << list << std::endl;
+    return false;
+  };
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    if (extra && extra(arg)) {
+      continue;
+    }
+    if (std::strncmp(arg, "--file-threads=", 15) == 0) {
+      options.fileThreads = std::strtoul(arg + 15, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--queue-size=", 13) == 0) {
+      options.queue.capacity = std::strtoul(arg + 13, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--backpressure=", 15) == 0) {
+      const std::string policy = arg + 15;
+      if (policy == "block") {
+        options.queue.backpressure = Backpressure::Block;
+      }
+      else if (policy == "drop") {
+        options.queue.backpressure = Backpressure::DropOldest;
+      }
+      else if (policy == "spill") {
+        options.queue.backpressure = Backpressure::Spill;
+      }
+      else {
+        std::cerr << "Unknown backpressure policy: " << policy << std::endl;
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--sink=", 7) == 0) {
+      const std::string sink = arg + 7;
+      if (sink == "files") {
+        options.fileSink = FileSink::PerBatch;
+      }
+      else if (sink == "rolling") {
+        options.fileSink = FileSink::Rolling;
+      }
+      else if (sink == "compressed") {
+        options.fileSink = FileSink::Compressed;
+      }
+      else if (sink == "binary") {
+        options.fileSink = FileSink::Binary;
+      }
+      else {
+        std::cerr << "Unknown sink: " << sink << std::endl;
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--segment-size=", 15) == 0) {
+      options.rolling.maxSegmentBytes = std::strtoull(arg + 15, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--compress-level=", 17) == 0) {
+      options.compress.level = atoi(arg + 17);
+    }
+    else if (std::strncmp(arg, "--compress-threads=", 19) == 0) {
+      options.compress.threads = std::strtoul(arg + 19, nullptr, 10);
+    }
+    else if (std::strcmp(arg, "--no-dictionary") == 0) {
+      options.compress.trainDictionary = false;
+    }
+    else if (std::strncmp(arg, "--index-interval=", 17) == 0) {
+      options.binary.indexInterval = std::strtoull(arg + 17, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--segment-age=", 14) == 0) {
+      options.rolling.maxSegmentAge =
+          std::chrono::seconds(std::strtoll(arg + 14, nullptr, 10));
+    }
+    else if (std::strncmp(arg, "--fsync=", 8) == 0) {
+      const std::string policy = arg + 8;
+      if (policy == "never") {
+        options.rolling.fsync = FsyncPolicy::Never;
+      }
+      else if (policy == "rotate") {
+        options.rolling.fsync = FsyncPolicy::OnRotate;
+      }
+      else if (policy == "batch") {
+        options.rolling.fsync = FsyncPolicy::EveryBatch;
+      }
+      else {
+        std::cerr << "Unknown fsync policy: " << policy << std::endl;
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--console=", 10) == 0) {
+      const std::string mode = arg + 10;
+      if (mode == "line") {
+        options.console.mode = ConsoleMode::LineFlushed;
+      }
+      else if (mode == "buffered") {
+        options.console.mode = ConsoleMode::Buffered;
+      }
+      else if (mode != "auto") {
+        std::cerr << "Unknown console mode: " << mode << std::endl;
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--timestamps=", 13) == 0) {
+      const std::string policy = arg + 13;
+      if (policy == "command") {
+        options.timestamps = TimestampPolicy::PerCommand;
+      }
+      else if (policy == "batch") {
+        options.timestamps = TimestampPolicy::FirstInBatch;
+      }
+      else if (policy == "coarse") {
+        options.timestamps = TimestampPolicy::Coarse;
+      }
+      else if (policy == "tsc") {
+        options.timestamps = TimestampPolicy::Tsc;
+      }
+      else {
+        std::cerr << "Unknown timestamp policy: " << policy << std::endl;
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--flush-timeout=", 16) == 0) {
+      options.flush.timeout = std::chrono::milliseconds(std::strtoll(arg + 16, nullptr, 10));
+    }
+    else if (std::strcmp(arg, "--adaptive") == 0) {
+      options.flush.adaptive = true;
+    }
+    else if (std::strncmp(arg, "--min-bulk=", 11) == 0) {
+      options.flush.minBulkSize = atoi(arg + 11);
+    }
+    else if (std::strncmp(arg, "--max-bulk=", 11) == 0) {
+      options.flush.maxBulkSize = atoi(arg + 11);
+    }
+    else if (std::strncmp(arg, "--block-spill=", 14) == 0) {
+      options.flush.blockSpillBytes = std::strtoull(arg + 14, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--listen=", 9) == 0) {
+      options.server.listen = arg + 9;
+    }
+    else if (std::strncmp(arg, "--server-threads=", 17) == 0) {
+      options.server.threads = std::strtoul(arg + 17, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--shards=", 9) == 0) {
+      options.shards.count = std::strtoul(arg + 9, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--shard-key=", 12) == 0) {
+      const std::string key = arg + 12;
+      if (key == "source") {
+        options.shards.key = ShardKey::Source;
+      }
+      else if (key == "command") {
+        options.shards.key = ShardKey::CommandHash;
+      }
+      else {
+        std::cerr << "Unknown shard key: " << key << std::endl;
+        return false;
+      }
+    }
+    else if (std::strcmp(arg, "--no-pin") == 0) {
+      options.shards.pin = false;
+    }
+    else if (std::strcmp(arg, "--metrics") == 0) {
+      options.metrics.dumpOnExit = true;
+    }
+    else if (std::strncmp(arg, "--metrics-listen=", 17) == 0) {
+      options.metrics.listen = arg + 17;
+    }
+    else if (std::strncmp(arg, "--file-io=", 10) == 0) {
+      const std::string mode = arg + 10;
+      if (mode == "uring") {
+        options.uring.enabled = true;
+      }
+      else if (mode != "sync") {
+        std::cerr << "Unknown file io mode: " << mode << std::endl;
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--uring-depth=", 14) == 0) {
+      options.uring.depth = static_cast<unsigned>(std::strtoul(arg + 14, nullptr, 10));
+    }
+    else if (std::strncmp(arg, "--wal=", 6) == 0) {
+      options.wal.path = arg + 6;
+    }
+    else if (std::strncmp(arg, "--wal-sync=", 11) == 0) {
+      options.wal.syncInterval = std::chrono::milliseconds(std::strtoll(arg + 11, nullptr, 10));
+    }
+    else if (std::strncmp(arg, "--wal-size=", 11) == 0) {
+      options.wal.preallocate = std::strtoull(arg + 11, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--trace=", 8) == 0) {
+      options.trace.path = arg + 8;
+    }
+    else if (std::strncmp(arg, "--trace-sample=", 15) == 0) {
+      options.trace.sampleEvery = static_cast<uint32_t>(std::strtoul(arg + 15, nullptr, 10));
+    }
+    else if (std::strcmp(arg, "--intern") == 0) {
+      options.intern.enabled = true;
+    }
+    else if (std::strncmp(arg, "--intern=", 9) == 0) {
+      options.intern.enabled = true;
+      options.intern.maxCommands = std::strtoul(arg + 9, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--aggregate=", 12) == 0) {
+      options.aggregate.interval = std::chrono::seconds(std::strtoll(arg + 12, nullptr, 10));
+    }
+    else if (std::strncmp(arg, "--sink-threads=", 15) == 0) {
+      options.sinks.threads = std::strtoul(arg + 15, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--sink-inflight=", 16) == 0) {
+      options.sinks.inflight = std::strtoul(arg + 16, nullptr, 10);
+    }
+    else if (std::strncmp(arg, "--sink-drain=", 13) == 0) {
+      options.sinks.drain = std::chrono::milliseconds(std::strtoll(arg + 13, nullptr, 10));
+    }
+    else if (std::strncmp(arg, "--reader-cpus=", 14) == 0) {
+      // stdin, файлы и соединения
+      if (!parseCpus(arg + 14, options.input.cpus)) {
+        return false;
+      }
+      options.server.cpus = options.input.cpus;
+    }
+    else if (std::strncmp(arg, "--shard-cpus=", 13) == 0) {
+      if (!parseCpus(arg + 13, options.shards.cpus)) {
+        return false;
+      }
+    }
+    else if (std::strncmp(arg, "--sink-cpus=", 12) == 0) {
+      if (!parseCpus(arg + 12, options.sinkCpus)) {
+        return false;
+      }
+      options.compress.cpus = options.sinkCpus;
+    }
+    else if (std::strncmp(arg, "--input-threads=", 16) == 0) {
+      options.input.threads = std::strtoul(arg + 16, nullptr, 10);
+    }
+    else if (arg[0] != '-' && !bulkSizeSet && options.input.paths.empty() &&
+             std::strspn(arg, "0123456789") == std::strlen(arg)) {
+      options.bulkSize = atoi(arg);
+      bulkSizeSet = true;
+      if (options.bulkSize <= 0) {
+        std::cerr << "Invalid bulk size." << std::endl;
+        return false;
+      }
+    }
+    else if (arg[0] != '-') {
+      options.input.paths.emplace_back(arg);
+    }
+    else {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      return false;
+    }
+  }
+  if (!options.server.listen.empty() && !options.input.paths.empty()) {
+    std::cerr << "Input files cannot be combined with --listen." << std::endl;
+    return false;
+  }
+  if (options.sinks.threads > 0 && options.fileThreads > 0) {
+    std::cerr << "--sink-threads cannot be combined with --file-threads." << std::endl;
+    return false;
+  }
+  if (!options.wal.path.empty() &&
+      (!options.server.listen.empty() || options.shards.count > 0 ||
+       options.input.paths.size() > 1)) {
+    // блоки соединений, шардов и файлов собираются вне обработчика
+    std::cerr << "--wal requires a single input stream." << std::endl;
+    return false;
+  }
+  return true;
+}
@@ -1,80 +1,505 @@
 #pragma once
 
+#include "Batch.h"
+#include "Clock.h"
+#include "LineReader.h"
+#include "Metrics.h"
+
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
 #include <chrono>
-#include <fstream>
+#include <cstring>
 #include <iostream>
-#include <numeric>
-#include <sstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <tuple>
 #include <vector>
 
-static const std::string BULK = "bulk: ";
-static const std::string START_BLOCK = "{";
-static const std::string END_BLOCK = "}";
-
-struct Command {
-  std::string text;
-  std::chrono::system_clock::time_point timeStamp;
-};
+#include <fcntl.h>
+#include <unistd.h>
 
 /**
  * @brief базовый класс для вывода
+ *
+ * Подписчик получает каждый пакет ровно один раз — в момент его сброса.
  */
 class Output {
 public:
-  virtual void update(const std::vector<Command>& command) = 0;
-  virtual void ProcessCommand() = 0;
+  virtual void update(const BatchPtr& batch) = 0;
   virtual ~Output() = default;
 
-protected:
-  std::string Join(const std::vector<Command>& v) const {
-    return std::accumulate(v.begin(), v.end(), std::string(),
-                           [](std::string &s, const Command &com) {
-      return s.empty() ? s.append(com.text)
-                       : s.append(", ").append(com.text);
-    });
+  /**
+   * @brief подписчик не успевает за обработчиком: его очередь заполнена
+   * больше чем наполовину
+   */
+  virtual bool Congested() const noexcept {
+    return false;
   }
 };
 
 /**
- * @brief класс обработчика команд
+ * @brief журнал ввода обработчика
+ *
+ * Получает каждую команду с её отметкой времени и начало каждого блока
+ * до того, как они попадут в пакет, и отметку Checkpoint(), когда всё
+ * полученное уже разослано подписчикам и обработчик пуст. Вызывается под
+ * защитой обработчика, то есть не одновременно.
  */
-class BatchCommandProcessor { // publisher
+class CommandJournal {
 public:
-  BatchCommandProcessor(int bulkSize)
-    : m_bulkSize(bulkSize) {}
+  virtual ~CommandJournal() = default;
 
-  ~BatchCommandProcessor() {
-    if (!m_blockForced) {
-      DumpBatch();
+  virtual void Command(std::string_view text,
+                       std::chrono::system_clock::time_point timeStamp) = 0;
+
+  virtual void StartBlock() = 0;
+
+  virtual void Checkpoint() = 0;
+};
+
+/**
+ * @brief условия сброса статического пакета, кроме заполнения
+ */
+struct FlushOptions {
+  // сбросить пакет, если с его первой команды прошло столько времени;
+  // 0 — ждать заполнения
+  std::chrono::milliseconds timeout{0};
+  // подстраивать размер пакета под темп ввода и задержку подписчиков
+  bool adaptive = false;
+  int minBulkSize = 1;
+  int maxBulkSize = 1 << 16;
+  // выносить динамический блок во временный файл, когда тексты его команд
+  // в памяти достигают стольких байт; 0 — держать блок в памяти целиком
+  size_t blockSpillBytes = 0;
+};
+
+/**
+ * @brief накопление команд в пакеты
+ *
+ * Общая часть обработчиков: Derived получает каждый запечатанный пакет
+ * через Publish(const BatchPtr&). Derived обязан вызвать Shutdown() в
+ * своём деструкторе, пока его подписчики ещё живы.
+ *
+ * С FlushOptions::timeout отдельный поток сбрасывает статический пакет,
+ * не дождавшийся заполнения; тогда состояние обработчика защищается
+ * мьютексом и подписчики вызываются то из потока чтения, то из этого
+ * потока, но не одновременно.
+ *
+ * В адаптивном режиме размер пакета удваивается, если рассылка пакета
+ * подписчикам заняла больше четверти времени его наполнения или
+ * кто-то из подписчиков не успевает (Derived::Congested()), и
+ * уменьшается вдвое, если пакет наполнялся дольше половины целевой
+ * задержки (timeout или 100 мс).
+ */
+template <typename Derived>
+class BatchProcessorBase {
+public:
+  BatchProcessorBase(const BatchProcessorBase&) = delete;
+  BatchProcessorBase& operator=(const BatchProcessorBase&) = delete;
+
+protected:
+  BatchProcessorBase(int bulkSize, TimestampPolicy timestamps,
+                     const FlushOptions& flush)
+    : m_effectiveBulkSize(static_cast<size_t>(bulkSize)), m_flush(flush),
+      m_pool(BatchPool::Create()), m_clock(timestamps) {
+    if (m_flush.adaptive) {
+      m_flush.minBulkSize = std::max(1, std::min(m_flush.minBulkSize, bulkSize));
+      m_flush.maxBulkSize = std::max(m_flush.maxBulkSize, bulkSize);
+    }
+    m_batch = AcquireBatch();
+    if (m_flush.timeout.count() > 0) {
+      m_concurrent = true;
+      m_flusher = std::thread(&BatchProcessorBase::RunFlusher, this);
+    }
+  }
+
+  ~BatchProcessorBase() = default;
+
+  /**
+   * @brief останавливает поток сброса и публикует незавершённый
+   * статический пакет; незакрытый блок отбрасывается
+   */
+  void Shutdown() {
+    if (m_flusher.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopFlusher = true;
+      }
+      m_flusherCv.notify_one();
+      m_flusher.join();
     }
-    for (auto subscrube : m_subscribers) {
-      unSubscribe(subscrube);
+    if (!m_blockForced) {
+      DumpBatch(Batch::Kind::Static);
     }
   }
 
+public:
   void StartBlock() {
+    auto lock = Lock();
+    DumpBatch(Batch::Kind::Static);
     m_blockForced = true;
-    DumpBatch();
+    if (m_journal) {
+      m_journal->StartBlock();
+    }
   }
 
   void FinishBlock() {
+    auto lock = Lock();
+    DumpBatch(Batch::Kind::Dynamic);
     m_blockForced = false;
-    DumpBatch();
+    if (m_journal) {
+      m_journal->Checkpoint();
+    }
+  }
+
+  /**
+   * @brief подключает журнал ввода; вызывается до подачи команд
+   *
+   * Журналируется только ввод через ProcessCommand(), StartBlock() и
+   * FinishBlock(): блоки, собранные источниками вне обработчика
+   * (PublishBatch()), в журнал не попадают.
+   */
+  void SetJournal(CommandJournal* journal) noexcept {
+    m_journal = journal;
+  }
+
+  /**
+   * @brief подключает таблицу интернирования ко всем пакетам обработчика;
+   * вызывается до подачи команд
+   */
+  void SetCommandTable(std::shared_ptr<CommandTable> table) {
+    auto lock = Lock();
+    m_table = std::move(table);
+    m_batch->SetCommandTable(m_table);
+  }
+
+  const std::shared_ptr<CommandTable>& GetCommandTable() const noexcept {
+    return m_table;
   }
 
   void ProcessCommand(const Command& command) {
-    m_commands.push_back(command);
-    notify();
+    ProcessCommand(command.text, command.timeStamp);
+  }
+
+  void ProcessCommand(std::string_view text,
+                      std::chrono::system_clock::time_point timeStamp) {
+    auto lock = Lock();
+    AppendCommand(text, timeStamp);
+  }
 
+  /**
+   * @brief добавляет команду с отметкой времени согласно политике
+   */
+  void ProcessCommand(std::string_view text) {
+    auto lock = Lock();
+    if (m_batch->Empty() || m_clock.EveryCommand()) {
+      m_lastTimeStamp = m_clock.Now();
+    }
+    AppendCommand(text, m_lastTimeStamp);
+  }
+
+  /**
+   * @brief добавляет серию команд без скобок блока
+   *
+   * Обработчик захватывается один раз на серию, статический пакет
+   * наполняется отрезками до его размера, а отметка времени без
+   * TimestampPolicy::PerCommand берётся раз на пакет.
+   */
+  void ProcessCommands(const std::string_view* texts, size_t count) {
+    auto lock = Lock();
+    Metrics::Add(MetricCounter::CommandsIn, count);
+    while (count != 0) {
+      const bool first = m_batch->Empty();
+      size_t part = count;
+      if (!m_blockForced) {
+        // до заполнения пакета
+        const auto size = EffectiveBulkSize();
+        part = std::min(part, size > m_batch->Size() ? size - m_batch->Size() : 1);
+      }
+      const bool everyCommand = m_clock.EveryCommand();
+      if (first) {
+        StartFilling();
+        if (!everyCommand) {
+          m_lastTimeStamp = m_clock.Now();
+        }
+      }
+      for (size_t i = 0; i < part; ++i) {
+        if (everyCommand) {
+          m_lastTimeStamp = m_clock.Now();
+        }
+        if (m_journal) {
+          m_journal->Command(texts[i], m_lastTimeStamp);
+        }
+        m_batch->Append(texts[i], m_lastTimeStamp);
+        if (m_blockForced) {
+          LimitBlock(*m_batch);
+        }
+      }
+      texts += part;
+      count -= part;
+      CheckBatchSize();
+    }
+  }
+
+  /**
+   * @brief разрешает вызывать обработчик из нескольких потоков
+   *
+   * Вызывается до того, как потоки-источники начнут подавать команды.
+   */
+  void EnableConcurrentAccess() noexcept {
+    m_concurrent = true;
+  }
+
+  /**
+   * @brief выдаёт пустой пакет из пула обработчика для источника, который
+   * собирает собственный динамический блок
+   */
+  std::unique_ptr<Batch> AcquireBatch() {
+    auto batch = m_pool->Acquire();
+    batch->Reserve(EffectiveBulkSize());
+    if (m_table) {
+      batch->SetCommandTable(m_table);
+    }
+    return batch;
+  }
+
+  /**
+   * @brief запечатывает и рассылает пакет, собранный вне обработчика
+   */
+  void PublishBatch(std::unique_ptr<Batch> batch, Batch::Kind kind) {
+    if (batch->Empty()) {
+      return;
+    }
+    batch->SetKind(kind);
+    CountBatch(*batch);
+    if (batch->Spilled()) {
+      batch->Spill();
+    }
+    auto sealed = m_pool->Seal(std::move(batch));
+    auto lock = Lock();
+    Publish(sealed);
+  }
+
+  /**
+   * @brief отметка времени для очередной команды пакета batch
+   */
+  std::chrono::system_clock::time_point TimeStamp(const Batch& batch) const noexcept {
+    if (batch.Empty() || m_clock.EveryCommand()) {
+      return m_clock.Now();
+    }
+    return batch.Front().timeStamp;
+  }
+
+  /**
+   * @brief выносит на диск команды динамического блока batch, если они
+   * заняли больше FlushOptions::blockSpillBytes
+   */
+  void LimitBlock(Batch& batch) const {
+    if (m_flush.blockSpillBytes != 0 && batch.Bytes() >= m_flush.blockSpillBytes) {
+      batch.Spill();
+    }
+  }
+
+  /**
+   * @brief текущий размер статического пакета
+   */
+  int BulkSize() const noexcept {
+    return static_cast<int>(EffectiveBulkSize());
+  }
+
+private:
+  size_t EffectiveBulkSize() const noexcept {
+    return m_effectiveBulkSize.load(std::memory_order_relaxed);
+  }
+
+  void Publish(const BatchPtr& batch) {
+    TraceSpan span("publish", batch->TraceId(), batch->Size());
+    static_cast<Derived*>(this)->Publish(batch);
+  }
+
+  std::unique_lock<std::mutex> Lock() {
+    if (m_concurrent) {
+      return std::unique_lock<std::mutex>(m_mutex);
+    }
+    return std::unique_lock<std::mutex>();
+  }
+
+  void AppendCommand(std::string_view text,
+                     std::chrono::system_clock::time_point timeStamp) {
+    Metrics::Add(MetricCounter::CommandsIn);
+    if (m_journal) {
+      m_journal->Command(text, timeStamp);
+    }
+    const bool first = m_batch->Empty();
+    m_batch->Append(text, timeStamp);
+    if (first) {
+      StartFilling();
+    }
+    if (m_blockForced) {
+      LimitBlock(*m_batch);
+    }
+    CheckBatchSize();
+  }
+
+  /**
+   * @brief в пустой пакет попадает первая команда: отсюда отсчитываются
+   * тайм-аут и время наполнения
+   */
+  void StartFilling() {
+    m_batch->SampleTrace();
+    if (m_flush.timeout.count() > 0 || m_flush.adaptive) {
+      m_batchStart = std::chrono::steady_clock::now();
+      if (m_flusher.joinable() && !m_blockForced) {
+        m_flusherCv.notify_one();
+      }
+    }
+  }
+
+  void CheckBatchSize() {
     if (!m_blockForced &&
-        (m_commands.size() >= static_cast<size_t>(m_bulkSize))) {
-      DumpBatch();
+        (m_batch->Size() >= EffectiveBulkSize())) {
+      const auto fillTime = std::chrono::steady_clock::now() - m_batchStart;
+      const auto publishTime = DumpBatch(Batch::Kind::Static);
+      if (m_flush.adaptive) {
+        Adapt(fillTime, publishTime);
+      }
     }
   }
 
+  /**
+   * @brief сбрасывает по тайм-ауту статические пакеты
+   */
+  void RunFlusher() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopFlusher) {
+      if (m_batch->Empty() || m_blockForced) {
+        m_flusherCv.wait(lock);
+        continue;
+      }
+      const auto deadline = m_batchStart + m_flush.timeout;
+      if (std::chrono::steady_clock::now() < deadline) {
+        m_flusherCv.wait_until(lock, deadline);
+        continue;
+      }
+      DumpBatch(Batch::Kind::Static);
+      if (m_flush.adaptive) {
+        // пакет не заполнился за отведённое время
+        Shrink();
+      }
+    }
+  }
+
+  void Adapt(std::chrono::steady_clock::duration fillTime,
+             std::chrono::steady_clock::duration publishTime) {
+    const auto target = m_flush.timeout.count() > 0 ? m_flush.timeout
+                                                    : ADAPTIVE_TARGET;
+    if (publishTime * 4 > fillTime || static_cast<Derived*>(this)->Congested()) {
+      m_effectiveBulkSize.store(std::min(EffectiveBulkSize() * 2,
+                                         static_cast<size_t>(m_flush.maxBulkSize)),
+                                std::memory_order_relaxed);
+    }
+    else if (fillTime * 2 > target) {
+      Shrink();
+    }
+  }
+
+  void Shrink() {
+    m_effectiveBulkSize.store(std::max(EffectiveBulkSize() / 2,
+                                       static_cast<size_t>(m_flush.minBulkSize)),
+                              std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief запечатывает накопленные команды в пакет и публикует его
+   * @return время рассылки пакета подписчикам
+   */
+  std::chrono::steady_clock::duration DumpBatch(Batch::Kind kind) {
+    if (m_batch->Empty()) {
+      return {};
+    }
+    m_batch->SetKind(kind);
+    CountBatch(*m_batch);
+    if (m_batch->Spilled()) {
+      // вся запись — в файле
+      m_batch->Spill();
+    }
+    auto batch = m_pool->Seal(std::move(m_batch));
+    m_batch = AcquireBatch();
+    if (!m_flush.adaptive) {
+      Publish(batch);
+      Checkpoint(kind);
+      return {};
+    }
+    const auto start = std::chrono::steady_clock::now();
+    Publish(batch);
+    const auto publishTime = std::chrono::steady_clock::now() - start;
+    Checkpoint(kind);
+    return publishTime;
+  }
+
+  /**
+   * @brief статический пакет вне блока разослан — обработчик пуст; о
+   * закрытии блока журнал узнаёт из FinishBlock()
+   */
+  void Checkpoint(Batch::Kind kind) {
+    if (m_journal && kind == Batch::Kind::Static && !m_blockForced) {
+      m_journal->Checkpoint();
+    }
+  }
+
+  static void CountBatch(const Batch& batch) noexcept {
+    Metrics::Add(batch.GetKind() == Batch::Kind::Dynamic ? MetricCounter::DynamicBatches
+                                                         : MetricCounter::StaticBatches);
+    Metrics::Record(MetricHistogram::BatchCommands, batch.Size());
+    if (batch.TraceId() != 0) {
+      // наполнение заканчивается запечатыванием
+      Tracer::Record("fill", batch.TraceId(), batch.TraceStart(), batch.Size());
+    }
+  }
+
+  static constexpr std::chrono::milliseconds ADAPTIVE_TARGET{100};
+
+  // меняется под m_mutex, а AcquireBatch() читает его без блокировки
+  std::atomic<size_t> m_effectiveBulkSize;
+  FlushOptions m_flush;
+  bool m_blockForced = false;
+  CommandJournal* m_journal = nullptr;
+  std::shared_ptr<CommandTable> m_table;
+  std::shared_ptr<BatchPool> m_pool;
+  std::unique_ptr<Batch> m_batch;
+  Timestamper m_clock;
+  std::chrono::system_clock::time_point m_lastTimeStamp;
+  std::chrono::steady_clock::time_point m_batchStart;
+
+  bool m_concurrent = false;
+  std::mutex m_mutex;
+  std::condition_variable m_flusherCv;
+  bool m_stopFlusher = false;
+  std::thread m_flusher;
+};
+
+/**
+ * @brief класс обработчика команд с подписчиками, подключаемыми во время
+ * работы
+ */
+class BatchCommandProcessor : public BatchProcessorBase<BatchCommandProcessor> { // publisher
+public:
+  BatchCommandProcessor(int bulkSize,
+                        TimestampPolicy timestamps = TimestampPolicy::PerCommand,
+                        const FlushOptions& flush = FlushOptions())
+    : BatchProcessorBase(bulkSize, timestamps, flush) {}
+
+  ~BatchCommandProcessor() {
+    Shutdown();
+    m_subscribers.clear();
+  }
+
   void subscribe(Output *o) noexcept {
     if (o) {
       m_subscribers.push_back(o);
@@ -85,65 +510,195 @@ public:
     if (o) {
       m_subscribers.erase(
             std::remove(
-              m_subscribers.begin(), m_subscribers.end(), o));
+              m_subscribers.begin(), m_subscribers.end(), o),
+            m_subscribers.end());
     }
   }
 
-  void notify() noexcept {
+  void notify(const BatchPtr& batch) noexcept {
     for (auto subscriber : m_subscribers) {
       if (subscriber) {
-        subscriber->update(m_commands);
+        subscriber->update(batch);
       }
     }
   }
 
+  /**
+   * @brief сигнал обратного давления: хотя бы один подписчик не успевает
+   */
+  bool Congested() const noexcept {
+    return std::any_of(m_subscribers.begin(), m_subscribers.end(),
+                       [](const Output* subscriber) { return subscriber->Congested(); });
+  }
+
 private:
-  void ClearBatch() {
-    m_commands.clear();
-    notify();
+  friend class BatchProcessorBase<BatchCommandProcessor>;
+
+  void Publish(const BatchPtr& batch) {
+    notify(batch);
   }
 
-  void DumpBatch() {
-    if (!m_commands.empty()) {
-      for (auto o : m_subscribers) {
-        o->ProcessCommand();
-      }
+  std::vector<Output*> m_subscribers;
+};
+
+/**
+ * @brief обработчик с набором подписчиков, заданным на этапе компиляции
+ *
+ * Пакет доставляется невиртуальным вызовом Sink::update() каждого
+ * подписчика по порядку, без списка указателей и проверок на nullptr.
+ * Подписчики передаются ссылками и должны пережить обработчик; от Output
+ * их наследовать не обязательно.
+ */
+template <typename... Sinks>
+class BasicBatchProcessor : public BatchProcessorBase<BasicBatchProcessor<Sinks...>> { // publisher
+  using Base = BatchProcessorBase<BasicBatchProcessor<Sinks...>>;
+
+public:
+  explicit BasicBatchProcessor(int bulkSize, Sinks&... sinks)
+    : BasicBatchProcessor(bulkSize, TimestampPolicy::PerCommand, FlushOptions(),
+                          sinks...) {}
+
+  BasicBatchProcessor(int bulkSize, TimestampPolicy timestamps,
+                      const FlushOptions& flush, Sinks&... sinks)
+    : Base(bulkSize, timestamps, flush), m_sinks(sinks...) {}
+
+  ~BasicBatchProcessor() {
+    Base::Shutdown();
+  }
+
+private:
+  friend Base;
+
+  void Publish(const BatchPtr& batch) {
+    std::apply([&batch](auto&... sinks) {
+      (Deliver(sinks, batch), ...);
+    }, m_sinks);
+  }
+
+  template <typename Sink>
+  static void Deliver(Sink& sink, const BatchPtr& batch) {
+    sink.Sink::update(batch);
+  }
+
+  bool Congested() const noexcept {
+    return std::apply([](const auto&... sinks) {
+      return (IsCongested(sinks) || ...);
+    }, m_sinks);
+  }
+
+  // подписчик без Congested() сигнала не подаёт
+  template <typename Sink>
+  static bool IsCongested(const Sink& sink) noexcept {
+    if constexpr (requires { sink.Congested(); }) {
+      return sink.Sink::Congested();
+    }
+    else {
+      return false;
     }
-    ClearBatch();
   }
 
-  int m_bulkSize;
-  bool m_blockForced = false;
-  std::vector<Command> m_commands;
-  std::vector<Output*> m_subscribers;
+  std::tuple<Sinks&...> m_sinks;
+};
+
+/**
+ * @brief режим вывода в консоль
+ */
+enum class ConsoleMode {
+  LineFlushed,  // сброс после каждого пакета, для интерактивной работы
+  Buffered      // сброс по размеру буфера, по времени и в конце ввода
+};
+
+struct ConsoleOptions {
+  ConsoleMode mode = ConsoleMode::LineFlushed;
+  size_t bufferSize = 64 * 1024;
+  std::chrono::milliseconds flushInterval{100};
 };
 
 /**
  * @brief класс вывода команд в консоль
+ *
+ * В буферизованном режиме интервал сброса проверяется при поступлении
+ * очередного пакета; остаток буфера выводится в деструкторе.
  */
 class ConsoleOutput : public Output { // subscriber
 public:
-  explicit ConsoleOutput(BatchCommandProcessor *processor) {
+  explicit ConsoleOutput(BatchCommandProcessor *processor,
+                         const ConsoleOptions& options = ConsoleOptions(),
+                         std::ostream& out = std::cout)
+    : m_options(options), m_out(out),
+      m_lastFlush(std::chrono::steady_clock::now()) {
+    if (m_options.mode == ConsoleMode::Buffered) {
+      m_buffer.reserve(m_options.bufferSize);
+    }
     if (processor) {
       processor->subscribe(this);
     }
   }
 
-  void update(const std::vector<Command>& commands) override {
-    m_commands = commands;
+  ~ConsoleOutput() override {
+    Flush();
   }
 
-  void ProcessCommand() override {
-    auto output = BULK + Join(m_commands);
-    std::cout << output << std::endl;
+  void update(const BatchPtr& batch) override {
+    MetricTimer timer(MetricHistogram::ConsoleWriteNs);
+    TraceSpan span("write console", batch->TraceId(), batch->Size());
+    Metrics::Add(MetricCounter::ConsoleBytes, batch->TextSize() + 1);
+    if (m_options.mode == ConsoleMode::LineFlushed) {
+      batch->ForEachTextChunk([this](std::string_view chunk) {
+        m_out.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+      });
+      m_out << std::endl;
+      return;
+    }
+
+    // запись блока, вынесенного на диск, не собирается в буфере целиком
+    batch->ForEachTextChunk([this](std::string_view chunk) {
+      m_buffer.append(chunk);
+      if (m_buffer.size() >= m_options.bufferSize) {
+        m_out.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+        m_buffer.clear();
+      }
+    });
+    m_buffer.push_back('\n');
+    const auto now = std::chrono::steady_clock::now();
+    if (m_buffer.size() >= m_options.bufferSize ||
+        now - m_lastFlush >= m_options.flushInterval) {
+      Flush();
+      m_lastFlush = now;
+    }
   }
 
 private:
-  std::vector<Command> m_commands;
+  void Flush() {
+    if (!m_buffer.empty()) {
+      m_out.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+      m_buffer.clear();
+    }
+    m_out.flush();
+  }
+
+  const ConsoleOptions m_options;
+  std::ostream& m_out;
+  std::string m_buffer;
+  std::chrono::steady_clock::time_point m_lastFlush;
 };
 
+/**
+ * @brief номер потока записи: 0 — поток чтения, 1..K — потоки пула
+ * асинхронного вывода
+ */
+inline size_t& CurrentWriterId() noexcept {
+  thread_local size_t writerId = 0;
+  return writerId;
+}
+
 /**
  * @brief класс записи команд в файл
+ *
+ * Имя файла: bulk<секунды>.<микросекунды>-<номер>-<поток>.log, где время
+ * берётся у первой команды пакета, а номер монотонно растёт в пределах
+ * процесса, поэтому пакеты, закрытые в одну и ту же микросекунду разными
+ * потоками, не затирают друг друга.
  */
 class ReportWriter : public Output { // subscriber
 public:
@@ -153,59 +708,77 @@ public:
     }
   }
 
-  void update(const std::vector<Command>& commands) override {
-    m_commands = commands;
+  void update(const BatchPtr& batch) override {
+    MetricTimer timer(MetricHistogram::FileWriteNs);
+    TraceSpan span("write files", batch->TraceId(), batch->Size());
+    char filename[FILENAME_SIZE];
+    GetFilename(*batch, filename);
+    const int fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return;
+    }
+    batch->ForEachTextChunk([fd](std::string_view chunk) {
+      WriteAll(fd, chunk.data(), chunk.size());
+    });
+    Metrics::Add(MetricCounter::FileBytes, batch->TextSize());
+    ::close(fd);
   }
 
-  void ProcessCommand() override {
-    auto output = BULK + Join(m_commands);
-    std::ofstream file(GetFilename(), std::ofstream::out);
-    file << output;
-    // wait
-    using namespace std::chrono_literals;
-    std::this_thread::sleep_for(1ms);
-  }
+  static constexpr size_t FILENAME_SIZE = 96;
 
-private:
-  std::vector<Command> m_commands;
+  /**
+   * @brief имя файла очередного пакета; каждый вызов занимает новый номер
+   */
+  static void GetFilename(const Batch& batch, char (&filename)[FILENAME_SIZE]) {
+    static std::atomic<uint64_t> sequence{0};
 
-  std::string GetFilename() {
-    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(
-          m_commands[0].timeStamp.time_since_epoch()).count();
-    std::stringstream filename;
-    filename << "bulk" << seconds << ".log";
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          batch.Front().timeStamp.time_since_epoch()).count();
+    const auto number = sequence.fetch_add(1, std::memory_order_relaxed);
 
-    return filename.str();
+    char* pos = filename;
+    char* const end = filename + FILENAME_SIZE - 1;
+    pos = Append(pos, end, "bulk");
+    pos = std::to_chars(pos, end, micros / 1000000).ptr;
+    pos = Append(pos, end, ".");
+    pos = AppendPadded(pos, end, micros % 1000000, 6);
+    pos = Append(pos, end, "-");
+    pos = std::to_chars(pos, end, number).ptr;
+    pos = Append(pos, end, "-");
+    pos = std::to_chars(pos, end, CurrentWriterId()).ptr;
+    pos = Append(pos, end, ".log");
+    *pos = '\0';
   }
-};
 
-/**
- * @brief класс работы с командами из консоли
- */
-class BatchConsoleInput {
-public:
-  BatchConsoleInput(int bulkSize) {
-    m_commandProcessor = std::make_unique<BatchCommandProcessor>(bulkSize);
-    m_output.push_back(std::make_unique<ReportWriter>(m_commandProcessor.get()));
-    m_output.push_back(std::make_unique<ConsoleOutput>(m_commandProcessor.get()));
+private:
+  static void WriteAll(int fd, const char* data, size_t size) noexcept {
+    while (size > 0) {
+      const auto written = ::write(fd, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
   }
 
-  void ProcessCommand(const Command& command) {
-    if (m_commandProcessor) {
-      if (command.text == START_BLOCK) {
-        if (m_blockDepth++ == 0)
-          m_commandProcessor->StartBlock();
-      }
-      else if (command.text == END_BLOCK) {
-        if (--m_blockDepth == 0)
-          m_commandProcessor->FinishBlock();
-      }
-      else
-        m_commandProcessor->ProcessCommand(command);
+  static char* Append(char* pos, char* end, const char* text) noexcept {
+    const auto size = std::min(std::strlen(text), static_cast<size_t>(end - pos));
+    std::memcpy(pos, text, size);
+    return pos + size;
+  }
+
+  static char* AppendPadded(char* pos, char* end, long long value, int width) {
+    char digits[24];
+    auto last = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+    for (auto count = last - digits; count < width && pos != end; ++count) {
+      *pos++ = '0';
     }
+    return std::to_chars(pos, end, value).ptr;
   }
-private:
-  int m_blockDepth = 0;
-  std::unique_ptr<BatchCommandProcessor> m_commandProcessor;
-  std::vector<std::unique_ptr<Output>> m_output;
 };
+
+
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "LockFreeRing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+struct InternOptions {
+  // заменять повторяющиеся команды номерами общей таблицы
+  bool enabled = false;
+  // предел числа различных команд в таблице; остальные хранятся как есть
+  size_t maxCommands = 1 << 16;
+  // команды длиннее не интернируются: они редко повторяются
+  size_t maxLength = 256;
+};
+
+/**
+ * @brief таблица интернированных команд
+ *
+ * Сопоставляет тексту команды номер, под которым он хранится в таблице
+ * один раз. Пакет с таблицей держит для такой команды только номер, а
+ * форматирование копирует заранее подготовленный фрагмент ", текст"
+ * одним memcpy.
+ *
+ * Поиск идёт без блокировок по открытой адресации: ячейка — атомарное
+ * слово из старших 32 бит хеша и номера + 1, 0 — пустая ячейка. Новая
+ * команда добавляется под мьютексом: текст и фрагмент записываются до
+ * публикации ячейки (release), поэтому нашедший ячейку поток видит их
+ * готовыми. Номера и тексты живут, пока жива таблица, и никогда не
+ * удаляются; заполненная таблица перестаёт принимать новые команды.
+ */
+class CommandTable {
+public:
+  static constexpr uint32_t NO_ID = UINT32_MAX;
+
+  explicit CommandTable(const InternOptions& options = InternOptions())
+    : m_maxCommands(std::min<size_t>(std::max<size_t>(options.maxCommands, 1), NO_ID - 1)),
+      m_maxLength(options.maxLength),
+      m_capacity(RingCapacity(m_maxCommands * 2)), m_mask(m_capacity - 1),
+      m_slots(std::make_unique<std::atomic<uint64_t>[]>(m_capacity)),
+      m_fragments(std::make_unique<std::string_view[]>(m_maxCommands)),
+      m_chunkSize(std::max(CHUNK_SIZE, m_maxLength + SEPARATOR.size())) {
+    for (size_t i = 0; i < m_capacity; ++i) {
+      m_slots[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  CommandTable(const CommandTable&) = delete;
+  CommandTable& operator=(const CommandTable&) = delete;
+
+  /**
+   * @return номер команды, добавляя её при первой встрече; NO_ID, если
+   * команда слишком длинная или таблица заполнена
+   */
+  uint32_t Intern(std::string_view text) {
+    if (text.size() > m_maxLength) {
+      return NO_ID;
+    }
+    const auto hash = Hash(text);
+    const auto id = Find(text, hash);
+    if (id != NO_ID || m_full.load(std::memory_order_relaxed)) {
+      return id;
+    }
+    return Insert(text, hash);
+  }
+
+  /**
+   * @return номер уже интернированной команды или NO_ID
+   */
+  uint32_t Find(std::string_view text) const noexcept {
+    if (text.size() > m_maxLength) {
+      return NO_ID;
+    }
+    return Find(text, Hash(text));
+  }
+
+  std::string_view Text(uint32_t id) const noexcept {
+    return m_fragments[id].substr(SEPARATOR.size());
+  }
+
+  /**
+   * @brief текст команды с предшествующим разделителем ", "
+   */
+  std::string_view Fragment(uint32_t id) const noexcept {
+    return m_fragments[id];
+  }
+
+  /**
+   * @brief число интернированных команд; номера идут подряд с нуля
+   */
+  size_t Size() const noexcept {
+    return m_size.load(std::memory_order_acquire);
+  }
+
+private:
+  static constexpr std::string_view SEPARATOR = ", ";
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+  /**
+   * @brief хеш по словам из 8 байт: короткая команда хешируется за одно-два
+   * умножения, без вызова библиотечной функции
+   */
+  static uint64_t Hash(std::string_view text) noexcept {
+    constexpr uint64_t MULTIPLIER = 0xff51afd7ed558ccdULL;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ text.size();
+    const char* data = text.data();
+    size_t size = text.size();
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, data, sizeof(word));
+      hash = (hash ^ word) * MULTIPLIER;
+      hash ^= hash >> 32;
+    }
+    uint64_t word = 0;
+    for (size_t i = 0; i < size; ++i) {
+      word |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (i * 8);
+    }
+    hash = (hash ^ word) * MULTIPLIER;
+    return hash ^ (hash >> 29);
+  }
+
+  static uint64_t Tag(uint64_t hash) noexcept {
+    return hash >> 32 << 32;
+  }
+
+  uint32_t Find(std::string_view text, uint64_t hash) const noexcept {
+    const auto tag = Tag(hash);
+    for (size_t i = hash & m_mask;; i = (i + 1) & m_mask) {
+      const auto slot = m_slots[i].load(std::memory_order_acquire);
+      if (slot == 0) {
+        return NO_ID;
+      }
+      const auto id = static_cast<uint32_t>(slot) - 1;
+      if ((slot & ~uint64_t{UINT32_MAX}) == tag && Text(id) == text) {
+        return id;
+      }
+    }
+  }
+
+  uint32_t Insert(std::string_view text, uint64_t hash) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // команду могли добавить, пока поток ждал мьютекса
+    auto id = Find(text, hash);
+    if (id != NO_ID) {
+      return id;
+    }
+    id = static_cast<uint32_t>(m_size.load(std::memory_order_relaxed));
+    if (id == m_maxCommands) {
+      m_full.store(true, std::memory_order_relaxed);
+      return NO_ID;
+    }
+    m_fragments[id] = Store(text);
+    size_t i = hash & m_mask;
+    while (m_slots[i].load(std::memory_order_relaxed) != 0) {
+      i = (i + 1) & m_mask;
+    }
+    m_slots[i].store(Tag(hash) | (id + 1), std::memory_order_release);
+    m_size.store(id + 1, std::memory_order_release);
+    return id;
+  }
+
+  std::string_view Store(std::string_view text) {
+    const auto size = SEPARATOR.size() + text.size();
+    if (m_chunks.empty() || m_chunkUsed + size > m_chunkSize) {
+      m_chunks.push_back(std::make_unique<char[]>(m_chunkSize));
+      m_chunkUsed = 0;
+    }
+    char* fragment = m_chunks.back().get() + m_chunkUsed;
+    std::memcpy(fragment, SEPARATOR.data(), SEPARATOR.size());
+    std::memcpy(fragment + SEPARATOR.size(), text.data(), text.size());
+    m_chunkUsed += size;
+    return std::string_view(fragment, size);
+  }
+
+  const size_t m_maxCommands;
+  const size_t m_maxLength;
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<std::atomic<uint64_t>[]> m_slots;
+  std::unique_ptr<std::string_view[]> m_fragments;
+  std::atomic<size_t> m_size{0};
+  std::atomic<bool> m_full{false};
+
+  std::mutex m_mutex;
+  const size_t m_chunkSize;
+  std::vector<std::unique_ptr<char[]>> m_chunks;
+  size_t m_chunkUsed = 0;
+};
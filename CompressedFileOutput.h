@@ -0,0 +1,552 @@
+#pragma once
+
+#include "LineReader.h"
+#include "Placement.h"
+#include "RollingFileOutput.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <zlib.h>
+
+/**
+ * @brief формат сжатого сегмента
+ *
+ * Заголовок: "BLKZ", версия (1 байт), 3 байта нулей, длина словаря (u32)
+ * и сам словарь. Далее кадры: длина исходного текста (u32), длина сжатых
+ * данных (u32) и поток zlib со словарём заголовка. Исходный текст кадра —
+ * записи пакетов по строке, как у RollingFileOutput. Кадры независимы:
+ * их можно распаковывать параллельно. Числа записаны в порядке байт
+ * машины.
+ */
+struct CompressedFormat {
+  static constexpr char MAGIC[4] = {'B', 'L', 'K', 'Z'};
+  static constexpr uint8_t VERSION = 1;
+  static constexpr size_t HEADER_SIZE = 12;
+  static constexpr size_t FRAME_HEADER_SIZE = 8;
+  // zlib использует не более 32 КиБ словаря
+  static constexpr size_t MAX_DICTIONARY = 32 * 1024;
+  // длины кадра — u32, а сжатый кадр бывает чуть длиннее исходного
+  static constexpr size_t MAX_FRAME = size_t{1} << 30;
+  static constexpr const char* EXTENSION = ".logz";
+};
+
+struct CompressOptions {
+  int level = 3;
+  // потоки сжатия кадров
+  size_t threads = 2;
+  size_t frameSize = 256 * 1024;
+  // незаполненный кадр отправляется на сжатие, если ему столько лет
+  std::chrono::milliseconds frameAge{1000};
+  // обучать словарь на первом кадре
+  bool trainDictionary = true;
+  // ядра потоков сжатия по кругу; пусто — без закрепления
+  std::vector<int> cpus;
+};
+
+/**
+ * @brief словарь для записей "bulk: a, b, c"
+ *
+ * Команды образца считаются по частоте и упорядочиваются по выгоде
+ * (частота * длина): zlib дешевле кодирует совпадения ближе к концу
+ * словаря, поэтому самые выгодные команды идут последними. Если повторов
+ * нет, словарь пуст: он только занял бы место в заголовке сегмента.
+ */
+inline std::string TrainDictionary(std::string_view sample,
+                                   size_t maxSize = CompressedFormat::MAX_DICTIONARY) {
+  std::unordered_map<std::string_view, size_t> frequency;
+  auto handler = [&frequency](std::string_view line) {
+    if (line.substr(0, BULK.size()) == BULK) {
+      line.remove_prefix(BULK.size());
+    }
+    while (!line.empty()) {
+      const auto separator = line.find(BatchFormatter::SEPARATOR);
+      ++frequency[line.substr(0, separator)];
+      if (separator == std::string_view::npos) {
+        break;
+      }
+      line.remove_prefix(separator + BatchFormatter::SEPARATOR.size());
+    }
+  };
+  LineReader::ScanLines(sample.data(), sample.data() + sample.size(), handler);
+
+  std::vector<std::pair<size_t, std::string_view>> ranked;
+  for (const auto& [command, count] : frequency) {
+    if (count > 1) {
+      ranked.emplace_back(count * (command.size() + BatchFormatter::SEPARATOR.size()), command);
+    }
+  }
+  if (ranked.empty()) {
+    return std::string();
+  }
+  std::sort(ranked.begin(), ranked.end(), std::greater<>());
+  const std::string tail = "\n" + BULK;
+  size_t size = tail.size();
+  size_t count = 0;
+  while (count < ranked.size() &&
+         size + ranked[count].second.size() + BatchFormatter::SEPARATOR.size() <= maxSize) {
+    size += ranked[count].second.size() + BatchFormatter::SEPARATOR.size();
+    ++count;
+  }
+  std::string dictionary;
+  dictionary.reserve(size);
+  for (size_t i = count; i-- > 0;) {
+    dictionary.append(ranked[i].second).append(BatchFormatter::SEPARATOR);
+  }
+  return dictionary.append(tail);
+}
+
+/**
+ * @brief вывод пакетов в сжатые сегменты
+ *
+ * Записи копятся в кадре; заполненный кадр сжимает очередной поток пула,
+ * так что кадры разных пакетов сжимаются параллельно, а в сегмент они
+ * пишутся в исходном порядке. Сегменты ротируются по размеру и возрасту,
+ * как у RollingFileOutput, и называются <prefix><микросекунды>-<номер>.logz.
+ * Если потоки сжатия не успевают, update() ждёт, пока в работе не
+ * останется меньше 4 кадров на поток.
+ *
+ * Кадр закрывается на границе записей: запись, которая не помещается в
+ * начатый кадр, начинает следующий. Только запись длиннее frameSize
+ * (например, блок, вынесенный на диск) делится на кадры по frameSize,
+ * так что в памяти она целиком не собирается. Незаполненный кадр забирает
+ * на сжатие свободный поток пула, когда кадру исполнится frameAge, даже
+ * если новых пакетов нет. Ошибка сжатия или записи в потоке пула
+ * пробрасывается из следующего update(), а не принятая им — выводится
+ * деструктором; кадры после ошибки отбрасываются.
+ */
+class CompressedFileOutput : public Output { // subscriber
+public:
+  CompressedFileOutput(BatchCommandProcessor *processor,
+                       const RollingOptions& rolling = RollingOptions(),
+                       const CompressOptions& options = CompressOptions())
+    : m_rolling(rolling), m_options(options),
+      m_maxPending(std::max<size_t>(options.threads, 1) * 4),
+      m_frameLimit(std::clamp<size_t>(options.frameSize, 1, CompressedFormat::MAX_FRAME)) {
+    m_frame.reserve(m_frameLimit);
+    for (size_t i = 0; i < std::max<size_t>(m_options.threads, 1); ++i) {
+      m_workers.emplace_back(&CompressedFileOutput::RunWorker, this, i);
+    }
+    if (processor) {
+      processor->subscribe(this);
+    }
+  }
+
+  ~CompressedFileOutput() override {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      SubmitFrame(lock);
+      m_stop = true;
+    }
+    m_jobsCv.notify_all();
+    for (auto& worker : m_workers) {
+      worker.join();
+    }
+    CloseSegment();
+    if (m_error) {
+      try {
+        std::rethrow_exception(m_error);
+      }
+      catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  void update(const BatchPtr& batch) override {
+    // сжатие и запись кадра — в других потоках, отрезок — добавление в кадр
+    TraceSpan span("write compressed", batch->TraceId(), batch->Size());
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_error) {
+      std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+    // запись + перевод строки
+    const auto size = batch->TextSize() + 1;
+    if (!m_frame.empty() && m_frame.size() + size > m_frameLimit) {
+      SubmitFrame(lock);
+    }
+    batch->ForEachTextChunk([this, &lock](std::string_view chunk) {
+      AppendToFrame(chunk, lock);
+    });
+    AppendToFrame("\n", lock);
+    if (!m_frame.empty() &&
+        std::chrono::steady_clock::now() - m_frameStart >= m_options.frameAge) {
+      SubmitFrame(lock);
+    }
+  }
+
+private:
+  struct Job {
+    uint64_t sequence;
+    std::string raw;
+  };
+
+  /**
+   * @brief дописывает часть записи в кадр; заполненный кадр уходит на
+   * сжатие
+   */
+  void AppendToFrame(std::string_view data, std::unique_lock<std::mutex>& lock) {
+    while (!data.empty()) {
+      if (m_frame.empty()) {
+        m_frameStart = std::chrono::steady_clock::now();
+        // ожидающий без срока поток пула отсчитывает возраст нового кадра
+        m_jobsCv.notify_one();
+      }
+      const auto part = std::min(data.size(), m_frameLimit - m_frame.size());
+      m_frame.append(data.substr(0, part));
+      data.remove_prefix(part);
+      if (m_frame.size() >= m_frameLimit) {
+        SubmitFrame(lock);
+      }
+    }
+  }
+
+  /**
+   * @brief отдаёт накопленный кадр пулу сжатия
+   */
+  void SubmitFrame(std::unique_lock<std::mutex>& lock) {
+    if (m_frame.empty()) {
+      return;
+    }
+    m_notFull.wait(lock, [this] { return m_pending < m_maxPending || m_failed; });
+    if (m_failed) {
+      m_frame.clear();
+      return;
+    }
+    m_jobs.push_back(TakeFrame());
+    m_jobsCv.notify_one();
+  }
+
+  /**
+   * @brief забирает накопленный кадр в задание; первый кадр обучает
+   * словарь. Вызывается под m_mutex
+   */
+  Job TakeFrame() {
+    if (!m_dictionaryReady) {
+      if (m_options.trainDictionary) {
+        m_dictionary = TrainDictionary(m_frame);
+      }
+      m_dictionaryReady = true;
+    }
+    ++m_pending;
+    Job job{m_nextSequence++, std::move(m_frame)};
+    m_frame = std::string();
+    m_frame.reserve(m_frameLimit);
+    return job;
+  }
+
+  /**
+   * @brief ждёт задание из очереди; незаполненный кадр старше frameAge
+   * поток забирает сам
+   * @return false, если вывод закрыт и очередь пуста
+   */
+  bool NextJob(Job& job) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+      if (!m_jobs.empty()) {
+        job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        return true;
+      }
+      if (m_stop) {
+        return false;
+      }
+      if (m_frame.empty()) {
+        m_jobsCv.wait(lock);
+        continue;
+      }
+      const auto deadline = m_frameStart + m_options.frameAge;
+      if (std::chrono::steady_clock::now() >= deadline) {
+        job = TakeFrame();
+        return true;
+      }
+      m_jobsCv.wait_until(lock, deadline);
+    }
+  }
+
+  void RunWorker(size_t index) {
+    PinCurrentThread(m_options.cpus, index);
+    z_stream stream{};
+    if (deflateInit(&stream, m_options.level) != Z_OK) {
+      SetError(std::make_exception_ptr(std::runtime_error("Unable to initialize zlib.")));
+      return;
+    }
+    std::string compressed;
+    Job job;
+    while (NextJob(job)) {
+      try {
+        if (!Failed()) {
+          Compress(stream, job.raw, compressed);
+          Commit(job.sequence, job.raw.size(), compressed);
+        }
+      }
+      catch (...) {
+        SetError(std::current_exception());
+      }
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_pending;
+      }
+      m_notFull.notify_one();
+    }
+    deflateEnd(&stream);
+  }
+
+  /**
+   * @brief запоминает первую ошибку потока пула для update(); ждущий
+   * места update() больше не ждёт
+   */
+  void SetError(std::exception_ptr error) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_failed) {
+        m_error = std::move(error);
+        m_failed = true;
+      }
+    }
+    m_notFull.notify_all();
+  }
+
+  bool Failed() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_failed;
+  }
+
+  void Compress(z_stream& stream, const std::string& raw, std::string& compressed) {
+    deflateReset(&stream);
+    if (!m_dictionary.empty()) {
+      deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(m_dictionary.data()),
+                           static_cast<uInt>(m_dictionary.size()));
+    }
+    compressed.resize(deflateBound(&stream, static_cast<uLong>(raw.size())));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(raw.data()));
+    stream.avail_in = static_cast<uInt>(raw.size());
+    stream.next_out = reinterpret_cast<Bytef*>(compressed.data());
+    stream.avail_out = static_cast<uInt>(compressed.size());
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+      throw std::runtime_error("Unable to compress frame.");
+    }
+    compressed.resize(stream.total_out);
+  }
+
+  /**
+   * @brief пишет сжатый кадр и все следующие за ним готовые кадры в
+   * порядке номеров
+   */
+  void Commit(uint64_t sequence, size_t rawSize, const std::string& compressed) {
+    std::lock_guard<std::mutex> lock(m_writeMutex);
+    if (sequence != m_nextWrite) {
+      m_ready.emplace(sequence, std::make_pair(rawSize, compressed));
+      return;
+    }
+    WriteFrame(rawSize, compressed);
+    for (auto it = m_ready.find(++m_nextWrite); it != m_ready.end();
+         it = m_ready.find(++m_nextWrite)) {
+      WriteFrame(it->second.first, it->second.second);
+      m_ready.erase(it);
+    }
+  }
+
+  void WriteFrame(size_t rawSize, const std::string& compressed) {
+    if (m_fd >= 0 &&
+        (m_segmentBytes >= m_rolling.maxSegmentBytes ||
+         std::chrono::steady_clock::now() - m_segmentStart >= m_rolling.maxSegmentAge)) {
+      CloseSegment();
+    }
+    if (m_fd < 0) {
+      OpenSegment();
+    }
+    char header[CompressedFormat::FRAME_HEADER_SIZE];
+    const auto raw32 = static_cast<uint32_t>(rawSize);
+    const auto compressed32 = static_cast<uint32_t>(compressed.size());
+    std::memcpy(header, &raw32, sizeof(raw32));
+    std::memcpy(header + 4, &compressed32, sizeof(compressed32));
+    Write(header, sizeof(header));
+    Write(compressed.data(), compressed.size());
+    Metrics::Add(MetricCounter::CompressedBytes, sizeof(header) + compressed.size());
+    if (m_rolling.fsync == FsyncPolicy::EveryBatch) {
+      ::fdatasync(m_fd);
+    }
+  }
+
+  void OpenSegment() {
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    const auto filename = m_rolling.prefix + std::to_string(micros) + "-" +
+        std::to_string(m_segmentIndex++) + CompressedFormat::EXTENSION;
+    m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Unable to open segment " + filename);
+    }
+    m_segmentBytes = 0;
+    m_segmentStart = std::chrono::steady_clock::now();
+
+    char header[CompressedFormat::HEADER_SIZE] = {};
+    std::memcpy(header, CompressedFormat::MAGIC, sizeof(CompressedFormat::MAGIC));
+    header[4] = static_cast<char>(CompressedFormat::VERSION);
+    const auto dictionarySize = static_cast<uint32_t>(m_dictionary.size());
+    std::memcpy(header + 8, &dictionarySize, sizeof(dictionarySize));
+    Write(header, sizeof(header));
+    Write(m_dictionary.data(), m_dictionary.size());
+  }
+
+  void CloseSegment() {
+    if (m_fd < 0) {
+      return;
+    }
+    if (m_rolling.fsync != FsyncPolicy::Never) {
+      ::fdatasync(m_fd);
+    }
+    ::close(m_fd);
+    m_fd = -1;
+  }
+
+  void Write(const char* data, size_t size) {
+    while (size > 0) {
+      const auto written = ::write(m_fd, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Unable to write segment.");
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+      m_segmentBytes += static_cast<size_t>(written);
+    }
+  }
+
+  const RollingOptions m_rolling;
+  const CompressOptions m_options;
+  const size_t m_maxPending;
+  // frameSize, но не больше MAX_FRAME
+  const size_t m_frameLimit;
+
+  // накопление кадров и очередь сжатия
+  std::mutex m_mutex;
+  std::string m_frame;
+  std::chrono::steady_clock::time_point m_frameStart;
+  std::string m_dictionary;
+  bool m_dictionaryReady = false;
+  std::deque<Job> m_jobs;
+  std::condition_variable m_jobsCv;
+  std::condition_variable m_notFull;
+  size_t m_pending = 0;
+  uint64_t m_nextSequence = 0;
+  bool m_stop = false;
+  // первая ошибка потока пула, ещё не проброшенная из update()
+  std::exception_ptr m_error;
+  bool m_failed = false;
+  std::vector<std::thread> m_workers;
+
+  // запись кадров по порядку
+  std::mutex m_writeMutex;
+  uint64_t m_nextWrite = 0;
+  std::map<uint64_t, std::pair<size_t, std::string>> m_ready;
+  int m_fd = -1;
+  size_t m_segmentIndex = 0;
+  size_t m_segmentBytes = 0;
+  std::chrono::steady_clock::time_point m_segmentStart;
+};
+
+/**
+ * @brief чтение сжатого сегмента
+ */
+class CompressedSegmentReader {
+public:
+  explicit CompressedSegmentReader(int fd) : m_fd(fd) {
+    char header[CompressedFormat::HEADER_SIZE];
+    if (!ReadExactly(header, sizeof(header)) ||
+        std::memcmp(header, CompressedFormat::MAGIC, sizeof(CompressedFormat::MAGIC)) != 0 ||
+        static_cast<uint8_t>(header[4]) != CompressedFormat::VERSION) {
+      throw std::runtime_error("Not a compressed bulk segment.");
+    }
+    uint32_t dictionarySize = 0;
+    std::memcpy(&dictionarySize, header + 8, sizeof(dictionarySize));
+    if (dictionarySize > CompressedFormat::MAX_DICTIONARY) {
+      throw std::runtime_error("Corrupted segment dictionary.");
+    }
+    m_dictionary.resize(dictionarySize);
+    if (!ReadExactly(m_dictionary.data(), m_dictionary.size())) {
+      throw std::runtime_error("Truncated segment dictionary.");
+    }
+    if (inflateInit(&m_stream) != Z_OK) {
+      throw std::runtime_error("Unable to initialize zlib.");
+    }
+  }
+
+  ~CompressedSegmentReader() {
+    inflateEnd(&m_stream);
+  }
+
+  CompressedSegmentReader(const CompressedSegmentReader&) = delete;
+  CompressedSegmentReader& operator=(const CompressedSegmentReader&) = delete;
+
+  /**
+   * @brief передаёт handler'у исходный текст каждого кадра; оборванный
+   * последний кадр (сегмент не был закрыт) пропускается
+   */
+  template <typename Handler>
+  void ForEachFrame(Handler&& handler) {
+    std::string compressed;
+    std::string raw;
+    char header[CompressedFormat::FRAME_HEADER_SIZE];
+    while (ReadExactly(header, sizeof(header))) {
+      uint32_t rawSize = 0;
+      uint32_t compressedSize = 0;
+      std::memcpy(&rawSize, header, sizeof(rawSize));
+      std::memcpy(&compressedSize, header + 4, sizeof(compressedSize));
+      compressed.resize(compressedSize);
+      if (!ReadExactly(compressed.data(), compressed.size())) {
+        return;
+      }
+      raw.resize(rawSize);
+      Inflate(compressed, raw);
+      handler(std::string_view(raw));
+    }
+  }
+
+private:
+  void Inflate(const std::string& compressed, std::string& raw) {
+    inflateReset(&m_stream);
+    m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+    m_stream.avail_in = static_cast<uInt>(compressed.size());
+    m_stream.next_out = reinterpret_cast<Bytef*>(raw.data());
+    m_stream.avail_out = static_cast<uInt>(raw.size());
+    auto result = inflate(&m_stream, Z_FINISH);
+    if (result == Z_NEED_DICT) {
+      inflateSetDictionary(&m_stream, reinterpret_cast<const Bytef*>(m_dictionary.data()),
+                           static_cast<uInt>(m_dictionary.size()));
+      result = inflate(&m_stream, Z_FINISH);
+    }
+    if (result != Z_STREAM_END || m_stream.total_out != raw.size()) {
+      throw std::runtime_error("Corrupted segment frame.");
+    }
+  }
+
+  bool ReadExactly(char* data, size_t size) {
+    while (size > 0) {
+      const auto count = ::read(m_fd, data, size);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        return false;
+      }
+      data += count;
+      size -= static_cast<size_t>(count);
+    }
+    return true;
+  }
+
+  int m_fd;
+  std::string m_dictionary;
+  z_stream m_stream{};
+};
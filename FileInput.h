@@ -0,0 +1,111 @@
+#pragma once
+
+#include "BlockContext.h"
+#include "LineReader.h"
+#include "Placement.h"
+
+#include <exception>
+#include <functional>
+
+#include <fcntl.h>
+
+struct FileInputOptions {
+  std::vector<std::string> paths;
+  // число потоков чтения; 0 — по потоку на файл, но не больше числа ядер
+  size_t threads = 0;
+  // ядра потоков чтения (и потока stdin) по кругу; пусто — без закрепления
+  std::vector<int> cpus;
+};
+
+/**
+ * @brief параллельное чтение файлов команд
+ *
+ * Каждый файл — независимый источник со своим приёмником команд, как
+ * соединение BulkServer: порядок команд сохраняется внутри файла, а файлы
+ * разбираются одновременно пулом потоков. Файлы отображаются в память
+ * LineReader, команды попадают в пакеты прямо из отображения.
+ */
+class FileInput {
+public:
+  using ReceiverFactory = std::function<std::unique_ptr<CommandReceiver>()>;
+
+  /**
+   * @param factory создаёт приёмник для очередного файла; вызывается из
+   * потоков чтения
+   */
+  FileInput(ReceiverFactory factory, const FileInputOptions& options)
+    : m_factory(std::move(factory)), m_threads(options.threads), m_cpus(options.cpus) {
+    // файлы открываются заранее, чтобы ошибка дошла до вызывающего
+    for (const auto& path : options.paths) {
+      const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        CloseAll();
+        throw std::runtime_error("Unable to open " + path);
+      }
+      m_fds.push_back(fd);
+    }
+  }
+
+  ~FileInput() {
+    CloseAll();
+  }
+
+  FileInput(const FileInput&) = delete;
+  FileInput& operator=(const FileInput&) = delete;
+
+  /**
+   * @brief разбирает все файлы и возвращает управление после последнего;
+   * ошибка чтения любого файла пробрасывается вызывающему
+   */
+  void Run() {
+    auto threads = m_threads;
+    if (threads == 0) {
+      threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    threads = std::min(threads, m_fds.size());
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < threads; ++i) {
+      readers.emplace_back(&FileInput::ReadFiles, this, i);
+    }
+    for (auto& reader : readers) {
+      reader.join();
+    }
+    if (m_error) {
+      std::rethrow_exception(m_error);
+    }
+  }
+
+private:
+  void ReadFiles(size_t index) {
+    PinCurrentThread(m_cpus, index);
+    for (auto index = m_next.fetch_add(1); index < m_fds.size(); index = m_next.fetch_add(1)) {
+      try {
+        // незакрытый в файле блок отбрасывается вместе с приёмником
+        auto receiver = m_factory();
+        LineReader(m_fds[index]).ForEachCommand(*receiver);
+        receiver->Flush();
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(m_errorMutex);
+        if (!m_error) {
+          m_error = std::current_exception();
+        }
+      }
+    }
+  }
+
+  void CloseAll() noexcept {
+    for (const int fd : m_fds) {
+      ::close(fd);
+    }
+    m_fds.clear();
+  }
+
+  ReceiverFactory m_factory;
+  const size_t m_threads;
+  const std::vector<int> m_cpus;
+  std::vector<int> m_fds;
+  std::atomic<size_t> m_next{0};
+  std::mutex m_errorMutex;
+  std::exception_ptr m_error;
+};
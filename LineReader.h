@@ -0,0 +1,344 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+inline constexpr std::string_view START_BLOCK = "{";
+inline constexpr std::string_view END_BLOCK = "}";
+
+enum class CommandKind {
+  Command,
+  StartBlock,
+  EndBlock
+};
+
+/**
+ * @brief распознаёт скобки блока: одно сравнение длины на обычную команду
+ */
+inline CommandKind Classify(std::string_view text) noexcept {
+  if (text.size() == 1) {
+    if (text[0] == START_BLOCK[0]) {
+      return CommandKind::StartBlock;
+    }
+    if (text[0] == END_BLOCK[0]) {
+      return CommandKind::EndBlock;
+    }
+  }
+  return CommandKind::Command;
+}
+
+/**
+ * @brief построчное чтение дескриптора большими блоками
+ *
+ * Обычный файл отображается в память целиком и разбирается окнами по
+ * WINDOW_SIZE: разобранные страницы отпускаются MADV_DONTNEED, так что
+ * многогигабайтный файл не раздувает память процесса. Остальное (канал,
+ * терминал) читается read(2) в буфер. Строки ищутся memchr и передаются
+ * обработчику как std::string_view без копирования; представление
+ * действительно только на время вызова. Разделитель — '\n', последняя строка может быть
+ * без него, как у std::getline.
+ *
+ * ForEachCommand() вместо отдельных строк отдаёт приёмнику серии команд
+ * и скобки блоков, распознанные при том же проходе (см. ScanCommands()).
+ */
+class LineReader {
+public:
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+  static constexpr size_t WINDOW_SIZE = 64 << 20;
+
+  explicit LineReader(int fd) : m_fd(fd) {}
+
+  /**
+   * @brief разбирает ввод сериями команд
+   *
+   * receiver получает подряд идущие команды вызовом
+   * ProcessCommands(const std::string_view* texts, size_t count), а скобки
+   * блока — ProcessBlockMarker(CommandKind); порядок ввода сохраняется.
+   * Если у приёмника есть Flush(), он вызывается, когда канал или терминал
+   * прочитан до конца доступного и следующее чтение будет ждать ввода.
+   */
+  template <typename Receiver>
+  void ForEachCommand(Receiver& receiver) {
+    auto scan = [&receiver](const char* begin, const char* end) {
+      return ScanCommands(begin, end, receiver);
+    };
+    auto line = [&receiver](std::string_view text) {
+      DispatchCommand(receiver, text);
+    };
+    auto idle = [&receiver] {
+      if constexpr (requires { receiver.Flush(); }) {
+        receiver.Flush();
+      }
+    };
+    Read(scan, line, idle);
+  }
+
+  template <typename Handler>
+  void ForEachLine(Handler&& handler) {
+    auto scan = [&handler](const char* begin, const char* end) {
+      return ScanLines(begin, end, handler);
+    };
+    auto idle = [] {};
+    Read(scan, handler, idle);
+  }
+
+  /**
+   * @brief передаёт обработчику завершённые строки из [begin, end)
+   * @return начало незавершённой строки
+   */
+  template <typename Handler>
+  static const char* ScanLines(const char* begin, const char* end, Handler& handler) {
+    while (begin != end) {
+      const auto* newline = static_cast<const char*>(
+            std::memchr(begin, '\n', static_cast<size_t>(end - begin)));
+      if (!newline) {
+        break;
+      }
+      handler(std::string_view(begin, static_cast<size_t>(newline - begin)));
+      begin = newline + 1;
+    }
+    return begin;
+  }
+
+  /**
+   * @brief разбирает завершённые строки из [begin, end) на серии команд
+   * и скобки блоков; приёмник — как у ForEachCommand()
+   *
+   * Переводы строк ищутся по 16 байт за сравнение SSE2, и в том же
+   * проходе отмечаются байты '{' и '}'. Строку проверяет на скобку только
+   * перевод строки, перед которым стоит такой байт, так что обычная команда
+   * попадает в серию без сравнений. Серия передаётся приёмнику целиком —
+   * по заполнению, перед скобкой и в конце разбора; представления в ней
+   * действительны только на время вызова.
+   * @return начало незавершённой строки
+   */
+  template <typename Receiver>
+  static const char* ScanCommands(const char* begin, const char* end, Receiver& receiver) {
+    CommandRun<Receiver> run(receiver);
+    const char* line = begin;
+    const char* position = begin;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i open = _mm_set1_epi8(START_BLOCK[0]);
+    const __m128i close = _mm_set1_epi8(END_BLOCK[0]);
+    // скобка в последнем байте предыдущих 16
+    unsigned carry = 0;
+    for (; end - position >= 16; position += 16) {
+      const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(position));
+      auto newlines = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+      const auto braces = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, open), _mm_cmpeq_epi8(chunk, close))));
+      // бит i — перед байтом i стоит скобка
+      const unsigned afterBrace = (braces << 1) | carry;
+      carry = braces >> 15;
+      for (; newlines != 0; newlines &= newlines - 1) {
+        const auto offset = static_cast<unsigned>(__builtin_ctz(newlines));
+        const char* next = position + offset;
+        const std::string_view text(line, static_cast<size_t>(next - line));
+        const auto kind = (afterBrace >> offset & 1) ? Classify(text) : CommandKind::Command;
+        if (kind == CommandKind::Command) {
+          run.Add(text);
+        }
+        else {
+          run.Marker(kind);
+        }
+        line = next + 1;
+      }
+    }
+#endif
+    // хвост короче 16 байт или сборка без SSE2
+    while (position != end) {
+      const auto* next = static_cast<const char*>(
+            std::memchr(position, '\n', static_cast<size_t>(end - position)));
+      if (!next) {
+        break;
+      }
+      const std::string_view text(line, static_cast<size_t>(next - line));
+      const auto kind = Classify(text);
+      if (kind == CommandKind::Command) {
+        run.Add(text);
+      }
+      else {
+        run.Marker(kind);
+      }
+      line = position = next + 1;
+    }
+    run.Flush();
+    return line;
+  }
+
+  /**
+   * @brief передаёт приёмнику одну строку как команду или скобку блока
+   */
+  template <typename Receiver>
+  static void DispatchCommand(Receiver& receiver, std::string_view text) {
+    const auto kind = Classify(text);
+    if (kind == CommandKind::Command) {
+      receiver.ProcessCommands(&text, 1);
+    }
+    else {
+      receiver.ProcessBlockMarker(kind);
+    }
+  }
+
+private:
+  static constexpr size_t RUN_SIZE = 256;
+
+  /**
+   * @brief серия команд, накопленная для приёмника
+   */
+  template <typename Receiver>
+  class CommandRun {
+  public:
+    explicit CommandRun(Receiver& receiver) noexcept : m_receiver(receiver) {}
+
+    void Add(std::string_view text) {
+      m_texts[m_size++] = text;
+      if (m_size == m_texts.size()) {
+        Flush();
+      }
+    }
+
+    void Marker(CommandKind kind) {
+      Flush();
+      m_receiver.ProcessBlockMarker(kind);
+    }
+
+    void Flush() {
+      if (m_size != 0) {
+        m_receiver.ProcessCommands(m_texts.data(), m_size);
+        m_size = 0;
+      }
+    }
+
+  private:
+    Receiver& m_receiver;
+    std::array<std::string_view, RUN_SIZE> m_texts;
+    size_t m_size = 0;
+  };
+
+  /**
+   * @param scan разбирает завершённые строки диапазона и возвращает начало
+   * незавершённой
+   * @param line принимает одну строку: длиннее окна или последнюю без '\n'
+   * @param idle вызывается перед чтением, которое будет ждать ввода
+   */
+  template <typename Scan, typename Line, typename Idle>
+  void Read(Scan& scan, Line& line, Idle& idle) {
+    struct stat info {};
+    if (::fstat(m_fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      if (ReadMapped(static_cast<size_t>(info.st_size), scan, line)) {
+        return;
+      }
+    }
+    ReadBuffered(scan, line, idle);
+  }
+
+  template <typename Scan, typename Line>
+  bool ReadMapped(size_t size, Scan& scan, Line& line) {
+    const off_t offset = ::lseek(m_fd, 0, SEEK_CUR);
+    if (offset < 0 || static_cast<size_t>(offset) >= size) {
+      return false;
+    }
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    ::madvise(data, size, MADV_SEQUENTIAL);
+
+    const char* const base = static_cast<const char*>(data);
+    const char* const end = base + size;
+    const char* rest = base + offset;
+    const char* released = base;
+    while (static_cast<size_t>(end - rest) > WINDOW_SIZE) {
+      const char* next = scan(rest, rest + WINDOW_SIZE);
+      if (next == rest) {
+        // строка длиннее окна
+        const auto* newline = static_cast<const char*>(
+              std::memchr(rest + WINDOW_SIZE, '\n', static_cast<size_t>(end - rest) - WINDOW_SIZE));
+        if (!newline) {
+          break;
+        }
+        line(std::string_view(rest, static_cast<size_t>(newline - rest)));
+        next = newline + 1;
+      }
+      rest = next;
+      released = Release(base, released, rest);
+    }
+    rest = scan(rest, end);
+    if (rest != end) {
+      line(std::string_view(rest, static_cast<size_t>(end - rest)));
+    }
+    ::munmap(data, size);
+    return true;
+  }
+
+  /**
+   * @brief отпускает целые страницы отображения от released до position
+   * @return новая граница отпущенной части
+   */
+  static const char* Release(const char* base, const char* released, const char* position) {
+    static const auto pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    const char* boundary = base + (static_cast<size_t>(position - base) & ~(pageSize - 1));
+    if (boundary > released) {
+      ::madvise(const_cast<char*>(released), static_cast<size_t>(boundary - released),
+                MADV_DONTNEED);
+      return boundary;
+    }
+    return released;
+  }
+
+  template <typename Scan, typename Line, typename Idle>
+  void ReadBuffered(Scan& scan, Line& line, Idle& idle) {
+    std::vector<char> buffer(BUFFER_SIZE);
+    size_t used = 0;
+    pollfd ready{m_fd, POLLIN, 0};
+    bool drained = false;
+    for (;;) {
+      if (used == buffer.size()) {
+        // строка длиннее буфера
+        buffer.resize(buffer.size() * 2);
+      }
+      // проверка готовности нужна, только если прошлое чтение не заполнило
+      // буфер, то есть, скорее всего, выбрало весь доступный ввод
+      if (drained && ::poll(&ready, 1, 0) == 0) {
+        idle();
+      }
+      const auto count = ::read(m_fd, buffer.data() + used, buffer.size() - used);
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Unable to read input.");
+      }
+      if (count == 0) {
+        break;
+      }
+      drained = static_cast<size_t>(count) < buffer.size() - used;
+      const char* begin = buffer.data();
+      const char* end = begin + used + static_cast<size_t>(count);
+      const char* rest = scan(begin, end);
+      // незавершённая строка переносится в начало буфера
+      used = static_cast<size_t>(end - rest);
+      std::memmove(buffer.data(), rest, used);
+    }
+    if (used != 0) {
+      line(std::string_view(buffer.data(), used));
+    }
+  }
+
+  int m_fd;
+};
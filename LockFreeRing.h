@@ -0,0 +1,169 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+static constexpr size_t CACHE_LINE = 64;
+
+/**
+ * @brief округляет ёмкость кольца вверх до степени двойки
+ */
+inline size_t RingCapacity(size_t requested) {
+  size_t capacity = 2;
+  while (capacity < requested) {
+    capacity <<= 1;
+  }
+  return capacity;
+}
+
+/**
+ * @brief ограниченное кольцо без блокировок: один писатель, один читатель
+ *
+ * Индексы писателя и читателя разнесены по разным кэш-линиям; каждая
+ * сторона кэширует чужой индекс и перечитывает его только при
+ * заполнении/опустошении кольца.
+ */
+template <typename T>
+class SpscRing {
+public:
+  explicit SpscRing(size_t capacity)
+    : m_capacity(RingCapacity(capacity)), m_mask(m_capacity - 1),
+      m_slots(std::make_unique<T[]>(m_capacity)) {}
+
+  bool TryPush(T& value) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_headCache == m_capacity) {
+      m_headCache = m_head.load(std::memory_order_acquire);
+      if (tail - m_headCache == m_capacity) {
+        return false;
+      }
+    }
+    m_slots[tail & m_mask] = std::move(value);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T& value) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tailCache) {
+      m_tailCache = m_tail.load(std::memory_order_acquire);
+      if (head == m_tailCache) {
+        return false;
+      }
+    }
+    value = std::move(m_slots[head & m_mask]);
+    m_slots[head & m_mask] = T();
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t Size() const noexcept {
+    return m_tail.load(std::memory_order_acquire) -
+           m_head.load(std::memory_order_acquire);
+  }
+
+  size_t Capacity() const noexcept {
+    return m_capacity;
+  }
+
+private:
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<T[]> m_slots;
+
+  alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};
+  size_t m_headCache = 0;  // используется только писателем
+  alignas(CACHE_LINE) std::atomic<size_t> m_head{0};
+  size_t m_tailCache = 0;  // используется только читателем
+};
+
+/**
+ * @brief ограниченное кольцо без блокировок: много писателей и читателей
+ *
+ * Алгоритм Д. Вьюкова: каждая ячейка хранит номер последовательности,
+ * по которому писатели и читатели узнают, свободна ли она для них.
+ */
+template <typename T>
+class MpmcRing {
+public:
+  explicit MpmcRing(size_t capacity)
+    : m_capacity(RingCapacity(capacity)), m_mask(m_capacity - 1),
+      m_cells(std::make_unique<Cell[]>(m_capacity)) {
+    for (size_t i = 0; i < m_capacity; ++i) {
+      m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  bool TryPush(T& value) {
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = m_cells[pos & m_mask];
+      const size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0) {
+        if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+          cell.value = std::move(value);
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0) {
+        return false;
+      }
+      else {
+        pos = m_tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool TryPop(T& value) {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = m_cells[pos & m_mask];
+      const size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+      if (diff == 0) {
+        if (m_head.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+          value = std::move(cell.value);
+          cell.value = T();
+          cell.sequence.store(pos + m_capacity, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0) {
+        return false;
+      }
+      else {
+        pos = m_head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  size_t Size() const noexcept {
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t Capacity() const noexcept {
+    return m_capacity;
+  }
+
+private:
+  struct alignas(CACHE_LINE) Cell {
+    std::atomic<size_t> sequence{0};
+    T value{};
+  };
+
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<Cell[]> m_cells;
+
+  alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};
+  alignas(CACHE_LINE) std::atomic<size_t> m_head{0};
+};
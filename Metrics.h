@@ -0,0 +1,285 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief счётчики обработчика
+ */
+enum class MetricCounter : size_t {
+  CommandsIn,
+  StaticBatches,   // по размеру пакета, по тайм-ауту, по началу блока
+  DynamicBatches,  // блоки {}
+  ConsoleBytes,
+  FileBytes,       // ReportWriter
+  SegmentBytes,    // RollingFileOutput
+  CompressedBytes, // CompressedFileOutput, после сжатия
+  BinaryBytes,     // BinaryFileOutput
+  WalBytes,        // WriteAheadLog
+  FileRetries,     // UringReportWriter: файлы, переписанные после неполной записи
+  Count
+};
+
+/**
+ * @brief гистограммы обработчика
+ */
+enum class MetricHistogram : size_t {
+  BatchCommands,
+  ConsoleWriteNs,
+  FileWriteNs,
+  SegmentWriteNs,
+  BinaryWriteNs,
+  WalSyncNs,       // запись и fdatasync группы записей журнала
+  QueueDepth,
+  Count
+};
+
+/**
+ * @brief реестр метрик
+ *
+ * Каждый поток пишет в собственный набор счётчиков: приращение — это
+ * обращение к thread_local, relaxed-load и relaxed-store без блокировок и
+ * атомарных RMW. Читатель суммирует наборы всех живых потоков; набор
+ * завершившегося потока добавляется к итогам реестра. Гистограммы
+ * логарифмические: корзина b содержит значения от 2^(b-1) до 2^b - 1.
+ */
+class Metrics {
+public:
+  static constexpr size_t COUNTERS = static_cast<size_t>(MetricCounter::Count);
+  static constexpr size_t HISTOGRAMS = static_cast<size_t>(MetricHistogram::Count);
+  static constexpr size_t BUCKETS = 65;
+
+  struct HistogramValues {
+    std::array<uint64_t, BUCKETS> buckets{};
+    uint64_t sum = 0;
+    uint64_t count = 0;
+  };
+
+  struct Snapshot {
+    std::array<uint64_t, COUNTERS> counters{};
+    std::array<HistogramValues, HISTOGRAMS> histograms{};
+  };
+
+  static void Add(MetricCounter counter, uint64_t value = 1) noexcept {
+    Bump(Local().counters[static_cast<size_t>(counter)], value);
+  }
+
+  static void Record(MetricHistogram histogram, uint64_t value) noexcept {
+    auto& values = Local().histograms[static_cast<size_t>(histogram)];
+    Bump(values.buckets[Bucket(value)], 1);
+    Bump(values.sum, value);
+    Bump(values.count, 1);
+  }
+
+  /**
+   * @brief сумма по всем потокам на момент вызова
+   */
+  static Snapshot Collect() {
+    auto& registry = Instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto snapshot = registry.retired;
+    for (const auto* slot : registry.slots) {
+      Accumulate(snapshot, *slot);
+    }
+    return snapshot;
+  }
+
+  /**
+   * @brief метрики в текстовом формате Prometheus
+   */
+  static std::string FormatText() {
+    return FormatText(Collect());
+  }
+
+  static std::string FormatText(const Snapshot& snapshot) {
+    std::string text;
+    const char* family = nullptr;
+    for (size_t i = 0; i < COUNTERS; ++i) {
+      const auto& info = COUNTER_INFO[i];
+      AppendHeader(text, family, info, "counter");
+      AppendSample(text, info.name, "", info.labels, "", snapshot.counters[i]);
+    }
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+      const auto& info = HISTOGRAM_INFO[i];
+      AppendHeader(text, family, info, "histogram");
+      const auto& values = snapshot.histograms[i];
+      size_t last = BUCKETS;
+      while (last > 0 && values.buckets[last - 1] == 0) {
+        --last;
+      }
+      uint64_t cumulative = 0;
+      for (size_t b = 0; b < last; ++b) {
+        cumulative += values.buckets[b];
+        const auto bound = b == 64 ? UINT64_MAX : (uint64_t{1} << b) - 1;
+        AppendSample(text, info.name, "_bucket", info.labels,
+                     "le=\"" + std::to_string(bound) + '"', cumulative);
+      }
+      AppendSample(text, info.name, "_bucket", info.labels, "le=\"+Inf\"", values.count);
+      AppendSample(text, info.name, "_sum", info.labels, "", values.sum);
+      AppendSample(text, info.name, "_count", info.labels, "", values.count);
+    }
+    return text;
+  }
+
+private:
+  struct Slot {
+    std::array<std::atomic<uint64_t>, COUNTERS> counters{};
+    struct Histogram {
+      std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+      std::atomic<uint64_t> sum{0};
+      std::atomic<uint64_t> count{0};
+    };
+    std::array<Histogram, HISTOGRAMS> histograms{};
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<const Slot*> slots;
+    Snapshot retired;
+  };
+
+  /**
+   * @brief набор потока; регистрируется при первом обращении потока к
+   * метрикам
+   */
+  struct LocalSlot {
+    LocalSlot() {
+      auto& registry = Instance();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.slots.push_back(&slot);
+    }
+
+    ~LocalSlot() {
+      auto& registry = Instance();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      Accumulate(registry.retired, slot);
+      auto& slots = registry.slots;
+      for (auto it = slots.begin(); it != slots.end(); ++it) {
+        if (*it == &slot) {
+          slots.erase(it);
+          break;
+        }
+      }
+    }
+
+    Slot slot;
+  };
+
+  struct Info {
+    const char* name;
+    const char* labels;
+    const char* help;
+  };
+
+  static constexpr Info COUNTER_INFO[COUNTERS] = {
+    {"bulk_commands_total", "", "Commands received."},
+    {"bulk_batches_total", "kind=\"static\"", "Batches published."},
+    {"bulk_batches_total", "kind=\"dynamic\"", "Batches published."},
+    {"bulk_written_bytes_total", "sink=\"console\"", "Bytes written by sinks."},
+    {"bulk_written_bytes_total", "sink=\"files\"", "Bytes written by sinks."},
+    {"bulk_written_bytes_total", "sink=\"rolling\"", "Bytes written by sinks."},
+    {"bulk_written_bytes_total", "sink=\"compressed\"", "Bytes written by sinks."},
+    {"bulk_written_bytes_total", "sink=\"binary\"", "Bytes written by sinks."},
+    {"bulk_wal_bytes_total", "", "Bytes written to the write-ahead log."},
+    {"bulk_file_retries_total", "", "Batch files rewritten after an incomplete io_uring write."}
+  };
+
+  static constexpr Info HISTOGRAM_INFO[HISTOGRAMS] = {
+    {"bulk_batch_commands", "", "Commands per published batch."},
+    {"bulk_sink_write_nanoseconds", "sink=\"console\"", "Time to write one batch."},
+    {"bulk_sink_write_nanoseconds", "sink=\"files\"", "Time to write one batch."},
+    {"bulk_sink_write_nanoseconds", "sink=\"rolling\"", "Time to write one batch."},
+    {"bulk_sink_write_nanoseconds", "sink=\"binary\"", "Time to write one batch."},
+    {"bulk_wal_sync_nanoseconds", "", "Time to write and sync one write-ahead log group."},
+    {"bulk_queue_depth", "", "Async output queue depth after a push."}
+  };
+
+  static Registry& Instance() {
+    static Registry registry;
+    return registry;
+  }
+
+  static Slot& Local() noexcept {
+    thread_local LocalSlot local;
+    return local.slot;
+  }
+
+  /**
+   * @brief приращение счётчика, в который пишет только текущий поток
+   */
+  static void Bump(std::atomic<uint64_t>& value, uint64_t delta) noexcept {
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  static size_t Bucket(uint64_t value) noexcept {
+    return value == 0 ? 0 : 64 - static_cast<size_t>(__builtin_clzll(value));
+  }
+
+  static void Accumulate(Snapshot& snapshot, const Slot& slot) noexcept {
+    for (size_t i = 0; i < COUNTERS; ++i) {
+      snapshot.counters[i] += slot.counters[i].load(std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+      auto& values = snapshot.histograms[i];
+      const auto& histogram = slot.histograms[i];
+      for (size_t b = 0; b < BUCKETS; ++b) {
+        values.buckets[b] += histogram.buckets[b].load(std::memory_order_relaxed);
+      }
+      values.sum += histogram.sum.load(std::memory_order_relaxed);
+      values.count += histogram.count.load(std::memory_order_relaxed);
+    }
+  }
+
+  static void AppendHeader(std::string& text, const char*& family, const Info& info,
+                           const char* type) {
+    if (family && std::string_view(family) == info.name) {
+      return;
+    }
+    family = info.name;
+    text.append("# HELP ").append(info.name).append(" ").append(info.help).append("\n");
+    text.append("# TYPE ").append(info.name).append(" ").append(type).append("\n");
+  }
+
+  static void AppendSample(std::string& text, const char* name, const char* suffix,
+                           std::string_view labels, const std::string& extra,
+                           uint64_t value) {
+    text.append(name).append(suffix);
+    if (!labels.empty() || !extra.empty()) {
+      text.push_back('{');
+      text.append(labels);
+      if (!labels.empty() && !extra.empty()) {
+        text.push_back(',');
+      }
+      text.append(extra).push_back('}');
+    }
+    text.append(" ").append(std::to_string(value)).append("\n");
+  }
+};
+
+/**
+ * @brief записывает в гистограмму время жизни объекта в наносекундах
+ */
+class MetricTimer {
+public:
+  explicit MetricTimer(MetricHistogram histogram) noexcept
+    : m_histogram(histogram), m_start(std::chrono::steady_clock::now()) {}
+
+  ~MetricTimer() {
+    const auto elapsed = std::chrono::steady_clock::now() - m_start;
+    Metrics::Record(m_histogram, static_cast<uint64_t>(
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+  }
+
+  MetricTimer(const MetricTimer&) = delete;
+  MetricTimer& operator=(const MetricTimer&) = delete;
+
+private:
+  MetricHistogram m_histogram;
+  std::chrono::steady_clock::time_point m_start;
+};
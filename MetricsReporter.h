@@ -0,0 +1,173 @@
+#pragma once
+
+#include "Metrics.h"
+#include "NetworkServer.h"
+
+#include <csignal>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+
+struct MetricsOptions {
+  // выводить метрики в stderr при завершении
+  bool dumpOnExit = false;
+  // "tcp:<порт>" или "unix:<путь>" — отдавать метрики по HTTP в текстовом
+  // формате Prometheus
+  std::string listen;
+};
+
+/**
+ * @brief вывод метрик: в stderr по SIGUSR1 и при завершении, по HTTP —
+ * при заданном адресе
+ *
+ * SIGUSR1 блокируется в создающем потоке и принимается через signalfd,
+ * поэтому объект создаётся до запуска остальных потоков процесса: они
+ * наследуют маску. Итоговый вывод делается в деструкторе, так что объект,
+ * созданный первым, отчитывается уже после остановки конвейера.
+ */
+class MetricsReporter {
+public:
+  explicit MetricsReporter(const MetricsOptions& options)
+    : m_dumpOnExit(options.dumpOnExit) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    m_signalFd = ::signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    m_stopFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_signalFd < 0 || m_stopFd < 0) {
+      CloseAll();
+      throw std::runtime_error("Unable to create metrics descriptors.");
+    }
+    if (!options.listen.empty()) {
+      try {
+        m_listenFd = OpenListener(options.listen);
+      }
+      catch (...) {
+        CloseAll();
+        throw;
+      }
+      if (options.listen.compare(0, 5, "unix:") == 0) {
+        m_unixPath = options.listen.substr(5);
+      }
+    }
+    m_thread = std::thread(&MetricsReporter::Run, this);
+  }
+
+  ~MetricsReporter() {
+    const uint64_t one = 1;
+    if (::write(m_stopFd, &one, sizeof(one)) < 0) {
+      // eventfd уже взведён
+    }
+    m_thread.join();
+    CloseAll();
+    if (!m_unixPath.empty()) {
+      ::unlink(m_unixPath.c_str());
+    }
+    if (m_dumpOnExit) {
+      Dump();
+    }
+  }
+
+  MetricsReporter(const MetricsReporter&) = delete;
+  MetricsReporter& operator=(const MetricsReporter&) = delete;
+
+  static void Dump() {
+    const auto text = Metrics::FormatText();
+    WriteAll(STDERR_FILENO, text.data(), text.size());
+  }
+
+private:
+  static constexpr int REQUEST_TIMEOUT_MS = 1000;
+
+  void Run() {
+    pollfd fds[3] = {
+      {m_stopFd, POLLIN, 0},
+      {m_signalFd, POLLIN, 0},
+      {m_listenFd, POLLIN, 0}
+    };
+    const nfds_t count = m_listenFd < 0 ? 2 : 3;
+    while (true) {
+      if (::poll(fds, count, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      if (fds[0].revents) {
+        return;
+      }
+      if (fds[1].revents) {
+        signalfd_siginfo info;
+        while (::read(m_signalFd, &info, sizeof(info)) == sizeof(info)) {
+        }
+        Dump();
+      }
+      if (count > 2 && fds[2].revents) {
+        Serve();
+      }
+    }
+  }
+
+  /**
+   * @brief отвечает на запрос одного клиента; содержимое запроса не
+   * разбирается — любой путь отдаёт метрики
+   */
+  void Serve() {
+    const int client = ::accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      return;
+    }
+    pollfd request{client, POLLIN, 0};
+    if (::poll(&request, 1, REQUEST_TIMEOUT_MS) > 0) {
+      char buffer[4096];
+      if (::read(client, buffer, sizeof(buffer)) < 0) {
+        // ответ всё равно отправляется
+      }
+    }
+    const auto body = Metrics::FormatText();
+    const auto response =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n" + body;
+    WriteAll(client, response.data(), response.size(), true);
+    ::close(client);
+  }
+
+  /**
+   * @param socket сокет пишется через send: закрытое клиентом соединение
+   * не должно приводить к SIGPIPE
+   */
+  static void WriteAll(int fd, const char* data, size_t size, bool socket = false) noexcept {
+    while (size > 0) {
+      const auto written = socket ? ::send(fd, data, size, MSG_NOSIGNAL)
+                                  : ::write(fd, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
+  }
+
+  void CloseAll() noexcept {
+    for (int* fd : {&m_signalFd, &m_stopFd, &m_listenFd}) {
+      if (*fd >= 0) {
+        ::close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+  const bool m_dumpOnExit;
+  int m_signalFd = -1;
+  int m_stopFd = -1;
+  int m_listenFd = -1;
+  std::string m_unixPath;
+  std::thread m_thread;
+};
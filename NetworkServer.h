@@ -0,0 +1,323 @@
+#pragma once
+
+#include "BlockContext.h"
+#include "LineReader.h"
+#include "Placement.h"
+
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct ServerOptions {
+  // "tcp:<порт>" или "unix:<путь>"
+  std::string listen;
+  size_t threads = 1;
+  // ядра потоков соединений по кругу; пусто — без закрепления
+  std::vector<int> cpus;
+};
+
+/**
+ * @brief открывает неблокирующий слушающий сокет по адресу
+ * "tcp:<порт>" или "unix:<путь>"
+ */
+inline int OpenListener(const std::string& listen) {
+  int fd = -1;
+  if (listen.compare(0, 4, "tcp:") == 0) {
+    fd = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to create socket.");
+    }
+    const int on = 1;
+    const int off = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    sockaddr_in6 address{};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(static_cast<uint16_t>(std::stoi(listen.substr(4))));
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Unable to bind " + listen);
+    }
+  }
+  else if (listen.compare(0, 5, "unix:") == 0) {
+    sockaddr_un address{};
+    const auto path = listen.substr(5);
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error("Socket path is too long: " + path);
+    }
+    fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to create socket.");
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Unable to bind " + listen);
+    }
+  }
+  else {
+    throw std::runtime_error("Unknown listen address: " + listen);
+  }
+  if (::listen(fd, SOMAXCONN) != 0) {
+    ::close(fd);
+    throw std::runtime_error("Unable to listen on " + listen);
+  }
+  return fd;
+}
+
+/**
+ * @brief сервер приёма команд по TCP или Unix-сокету
+ *
+ * Каждый поток ведёт свой цикл epoll; слушающий сокет зарегистрирован во
+ * всех циклах с EPOLLEXCLUSIVE, так что новое подключение будит один
+ * поток, и дальше соединение обслуживается только им. Сокеты
+ * неблокирующие, строки выделяются из буфера соединения так же, как у
+ * LineReader. Каждое соединение получает свой приёмник команд — по
+ * умолчанию BlockContext общего обработчика. Когда у процесса кончаются
+ * дескрипторы, сервер освобождает запасной и сразу закрывает принятое
+ * соединение: иначе слушающий сокет остаётся готовым и цикл крутится
+ * вхолостую.
+ */
+class BulkServer {
+public:
+  using ReceiverFactory = std::function<std::unique_ptr<CommandReceiver>()>;
+
+  BulkServer(BatchCommandProcessor& processor, const ServerOptions& options)
+    : BulkServer(SharedProcessor(processor), options) {}
+
+  /**
+   * @param factory создаёт приёмник для нового соединения; вызывается из
+   * потоков сервера
+   */
+  BulkServer(ReceiverFactory factory, const ServerOptions& options)
+    : m_factory(std::move(factory)), m_cpus(options.cpus) {
+    m_listenFd = OpenListener(options.listen);
+    if (options.listen.compare(0, 5, "unix:") == 0) {
+      m_unixPath = options.listen.substr(5);
+    }
+    m_stopFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_stopFd < 0) {
+      ::close(m_listenFd);
+      throw std::runtime_error("Unable to create eventfd.");
+    }
+    m_spareFd = OpenSpare();
+    const auto threads = std::max<size_t>(options.threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+      m_loops.emplace_back(&BulkServer::RunLoop, this, i);
+    }
+  }
+
+  ~BulkServer() {
+    Stop();
+    ::close(m_stopFd);
+    ::close(m_listenFd);
+    if (m_spareFd >= 0) {
+      ::close(m_spareFd);
+    }
+    if (!m_unixPath.empty()) {
+      ::unlink(m_unixPath.c_str());
+    }
+  }
+
+  BulkServer(const BulkServer&) = delete;
+  BulkServer& operator=(const BulkServer&) = delete;
+
+  /**
+   * @brief останавливает циклы; незакрытые блоки соединений отбрасываются
+   */
+  void Stop() {
+    const uint64_t one = 1;
+    if (::write(m_stopFd, &one, sizeof(one)) < 0) {
+      // eventfd уже взведён
+    }
+    for (auto& loop : m_loops) {
+      if (loop.joinable()) {
+        loop.join();
+      }
+    }
+  }
+
+private:
+  static ReceiverFactory SharedProcessor(BatchCommandProcessor& processor) {
+    // до запуска потоков сервера
+    processor.EnableConcurrentAccess();
+    return [&processor] {
+      return std::make_unique<BlockContext>(processor);
+    };
+  }
+
+  static constexpr size_t READ_SIZE = 64 * 1024;
+  static constexpr int MAX_EVENTS = 256;
+  static constexpr std::chrono::milliseconds REJECT_BACKOFF{10};
+
+  struct Connection {
+    Connection(int socket, std::unique_ptr<CommandReceiver> commandReceiver)
+      : fd(socket), receiver(std::move(commandReceiver)) {}
+
+    int fd;
+    std::vector<char> buffer;
+    std::unique_ptr<CommandReceiver> receiver;
+  };
+
+  void RunLoop(size_t index) {
+    PinCurrentThread(m_cpus, index);
+    const int epoll = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0) {
+      return;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &m_listenFd;
+    ::epoll_ctl(epoll, EPOLL_CTL_ADD, m_listenFd, &event);
+    event.events = EPOLLIN;
+    event.data.ptr = &m_stopFd;
+    ::epoll_ctl(epoll, EPOLL_CTL_ADD, m_stopFd, &event);
+
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::vector<char> chunk(READ_SIZE);
+    epoll_event events[MAX_EVENTS];
+    for (bool running = true; running;) {
+      const int count = ::epoll_wait(epoll, events, MAX_EVENTS, -1);
+      for (int i = 0; i < count; ++i) {
+        if (events[i].data.ptr == &m_stopFd) {
+          running = false;
+        }
+        else if (events[i].data.ptr == &m_listenFd) {
+          Accept(epoll, connections);
+        }
+        else {
+          auto* connection = static_cast<Connection*>(events[i].data.ptr);
+          if (!Read(*connection, chunk)) {
+            ::epoll_ctl(epoll, EPOLL_CTL_DEL, connection->fd, nullptr);
+            ::close(connection->fd);
+            connections.erase(connection->fd);
+          }
+        }
+      }
+    }
+    for (auto& connection : connections) {
+      ::close(connection.first);
+    }
+    ::close(epoll);
+  }
+
+  void Accept(int epoll, std::unordered_map<int, std::unique_ptr<Connection>>& connections) {
+    for (;;) {
+      const int fd = ::accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        if ((errno == EMFILE || errno == ENFILE) && RejectConnection()) {
+          continue;
+        }
+        return;
+      }
+      auto connection = std::make_unique<Connection>(fd, m_factory());
+      epoll_event event{};
+      event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+      event.data.ptr = connection.get();
+      if (::epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        ::close(fd);
+        continue;
+      }
+      connections.emplace(fd, std::move(connection));
+    }
+  }
+
+  static int OpenSpare() noexcept {
+    return ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  /**
+   * @brief принимает и сразу закрывает соединение на месте запасного
+   * дескриптора, когда своих не осталось
+   * @return false, если запасного нет; тогда цикл ненадолго уступает
+   */
+  bool RejectConnection() {
+    std::lock_guard<std::mutex> lock(m_spareMutex);
+    if (m_spareFd < 0) {
+      m_spareFd = OpenSpare();
+    }
+    if (m_spareFd < 0) {
+      std::this_thread::sleep_for(REJECT_BACKOFF);
+      return false;
+    }
+    ::close(m_spareFd);
+    const int fd = ::accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    m_spareFd = OpenSpare();
+    return fd >= 0;
+  }
+
+  /**
+   * @brief дочитывает всё доступное из сокета
+   * @return false, если соединение закрыто
+   */
+  bool Read(Connection& connection, std::vector<char>& chunk) {
+    auto handler = [&connection](std::string_view text) {
+      connection.receiver->ProcessCommand(text);
+    };
+    for (;;) {
+      const auto count = ::read(connection.fd, chunk.data(), chunk.size());
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        connection.receiver->Flush();
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      if (count == 0) {
+        if (!connection.buffer.empty()) {
+          handler(std::string_view(connection.buffer.data(), connection.buffer.size()));
+        }
+        connection.receiver->Flush();
+        return false;
+      }
+
+      const char* begin = chunk.data();
+      const char* end = begin + count;
+      if (!connection.buffer.empty()) {
+        // завершаем строку, начатую прошлым чтением
+        const auto* newline = static_cast<const char*>(
+              std::memchr(begin, '\n', static_cast<size_t>(count)));
+        if (!newline) {
+          connection.buffer.insert(connection.buffer.end(), begin, end);
+          continue;
+        }
+        connection.buffer.insert(connection.buffer.end(), begin, newline);
+        handler(std::string_view(connection.buffer.data(), connection.buffer.size()));
+        connection.buffer.clear();
+        begin = newline + 1;
+      }
+      const char* rest = LineReader::ScanLines(begin, end, handler);
+      connection.buffer.assign(rest, end);
+    }
+  }
+
+  ReceiverFactory m_factory;
+  const std::vector<int> m_cpus;
+  int m_listenFd = -1;
+  int m_stopFd = -1;
+  // освобождается, чтобы принять и отклонить соединение при EMFILE/ENFILE
+  int m_spareFd = -1;
+  std::mutex m_spareMutex;
+  std::string m_unixPath;
+  std::vector<std::thread> m_loops;
+};
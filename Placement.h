@@ -0,0 +1,85 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * @brief разбирает список ядер "0-3,8,10-11"; элемент "node:N" —
+ * все ядра узла NUMA N по /sys/devices/system/node/nodeN/cpulist
+ * @return false, если список пуст или записан с ошибкой
+ */
+inline bool ParseCpuList(std::string_view spec, std::vector<int>& cpus) {
+  cpus.clear();
+  while (!spec.empty()) {
+    const auto comma = spec.find(',');
+    auto item = spec.substr(0, comma);
+    spec.remove_prefix(comma == std::string_view::npos ? spec.size() : comma + 1);
+    if (item.substr(0, 5) == "node:") {
+      std::ifstream file("/sys/devices/system/node/node" + std::string(item.substr(5)) +
+                         "/cpulist");
+      std::string list;
+      std::vector<int> nodeCpus;
+      if (!std::getline(file, list) || !ParseCpuList(list, nodeCpus)) {
+        return false;
+      }
+      cpus.insert(cpus.end(), nodeCpus.begin(), nodeCpus.end());
+      continue;
+    }
+    const auto dash = item.find('-');
+    const auto first = item.substr(0, dash);
+    const auto last = dash == std::string_view::npos ? first : item.substr(dash + 1);
+    auto parse = [](std::string_view text, int& value) {
+      value = 0;
+      for (const char c : text) {
+        if (c < '0' || c > '9' || value >= CPU_SETSIZE) {
+          return false;
+        }
+        value = value * 10 + (c - '0');
+      }
+      return !text.empty() && value < CPU_SETSIZE;
+    };
+    int begin = 0;
+    int end = 0;
+    if (!parse(first, begin) || !parse(last, end) || end < begin) {
+      return false;
+    }
+    for (int cpu = begin; cpu <= end; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return !cpus.empty();
+}
+
+/**
+ * @brief ограничивает поток ядрами cpus; пустой список ничего не меняет
+ */
+inline bool PinThread(pthread_t thread, const std::vector<int>& cpus) {
+  if (cpus.empty()) {
+    return true;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+/**
+ * @brief закрепляет вызывающий поток за index-м по кругу ядром cpus
+ *
+ * Вызывается самим потоком до того, как он выделит свою память: ядро
+ * Linux (политика по умолчанию) размещает страницу на узле NUMA потока,
+ * первым к ней обратившегося.
+ */
+inline bool PinCurrentThread(const std::vector<int>& cpus, size_t index) {
+  if (cpus.empty()) {
+    return true;
+  }
+  return PinThread(pthread_self(), {cpus[index % cpus.size()]});
+}
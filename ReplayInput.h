@@ -0,0 +1,231 @@
+#pragma once
+
+#include "BinaryFileOutput.h"
+#include "LineReader.h"
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <thread>
+
+/**
+ * @brief архив вывода bulk, подготовленный к воспроизведению
+ *
+ * Все файлы читаются заранее: двоичные сегменты (.blk) и текстовые
+ * записи (.log — сегменты RollingFileOutput и файлы ReportWriter)
+ * отображаются в память с MAP_POPULATE и разбираются в список команд,
+ * тексты которых указывают прямо в отображения. Сегменты делятся на
+ * части по индексу, текстовые файлы — по границам строк, и части
+ * разбираются пулом потоков.
+ *
+ * Команды двоичного сегмента получают исходные отметки времени, а
+ * динамические пакеты обрамляются скобками { }, чтобы при повторном вводе
+ * снова стать блоками. Текстовая запись отметок времени не хранит: всем
+ * её командам достаётся время из имени файла, а текст пакета делится на
+ * команды по ", ".
+ */
+class ReplayArchive {
+public:
+  /**
+   * @param threads потоки разбора; 0 — по числу ядер
+   */
+  ReplayArchive(const std::vector<std::string>& paths, size_t threads) {
+    if (threads == 0) {
+      threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    for (const auto& path : paths) {
+      AddFile(path, threads);
+    }
+    Load(threads);
+  }
+
+  ~ReplayArchive() {
+    for (const auto& mapping : m_mappings) {
+      ::munmap(const_cast<char*>(mapping.data()), mapping.size());
+    }
+  }
+
+  ReplayArchive(const ReplayArchive&) = delete;
+  ReplayArchive& operator=(const ReplayArchive&) = delete;
+
+  /**
+   * @brief команды в порядке файлов; действительны, пока жив архив
+   */
+  const std::vector<CommandView>& Commands() const noexcept {
+    return m_commands;
+  }
+
+  /**
+   * @brief отметка времени из имени файла вывода: bulk<секунды>.<микросекунды>-...
+   * у ReportWriter или bulk-segment-<микросекунды>-... у сегментов
+   */
+  static std::chrono::system_clock::time_point TimeStampFromName(const std::string& path) {
+    auto name = std::string_view(path);
+    if (const auto slash = name.rfind('/'); slash != std::string_view::npos) {
+      name.remove_prefix(slash + 1);
+    }
+    int64_t micros = 0;
+    if (name.substr(0, 13) == "bulk-segment-") {
+      micros = ParseNumber(name.substr(13));
+    }
+    else if (name.substr(0, 4) == "bulk") {
+      name.remove_prefix(4);
+      micros = ParseNumber(name) * 1000000;
+      if (const auto dot = name.find('.'); dot != std::string_view::npos) {
+        micros += ParseNumber(name.substr(dot + 1));
+      }
+    }
+    return std::chrono::system_clock::time_point(std::chrono::microseconds(micros));
+  }
+
+private:
+  using Task = std::function<void(std::vector<CommandView>&)>;
+
+  static int64_t ParseNumber(std::string_view text) noexcept {
+    int64_t value = 0;
+    for (const char c : text) {
+      if (c < '0' || c > '9') {
+        break;
+      }
+      value = value * 10 + (c - '0');
+    }
+    return value;
+  }
+
+  void AddFile(const std::string& path, size_t parts) {
+    char magic[sizeof(BinaryFormat::MAGIC)] = {};
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to open " + path);
+    }
+    const bool binary = ::pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        BinarySegmentReader::IsSegment(std::string_view(magic, sizeof(magic)));
+    if (binary) {
+      ::close(fd);
+      AddSegment(path, parts);
+      return;
+    }
+    struct stat info {};
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Unable to read " + path);
+    }
+    const auto size = static_cast<size_t>(info.st_size);
+    if (size == 0) {
+      ::close(fd);
+      return;
+    }
+    void* data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      throw std::runtime_error("Unable to map " + path);
+    }
+    m_mappings.emplace_back(static_cast<const char*>(data), size);
+    AddText(m_mappings.back(), TimeStampFromName(path), parts);
+  }
+
+  void AddSegment(const std::string& path, size_t parts) {
+    m_segments.push_back(std::make_unique<BinarySegmentReader>(path, true));
+    const auto* reader = m_segments.back().get();
+    const auto bounds = reader->Split(parts);
+    for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+      m_tasks.push_back([reader, begin = bounds[i], end = bounds[i + 1]]
+                        (std::vector<CommandView>& commands) {
+        reader->ForEachRecord([&commands](const BinaryRecord& record) {
+          const bool block = record.kind == Batch::Kind::Dynamic;
+          if (block) {
+            commands.push_back(CommandView{START_BLOCK, record.firstTimeStamp});
+          }
+          record.ForEachCommand([&commands](const CommandView& command) {
+            commands.push_back(command);
+          });
+          if (block) {
+            commands.push_back(CommandView{END_BLOCK, commands.back().timeStamp});
+          }
+        }, begin, end);
+      });
+    }
+  }
+
+  /**
+   * @brief делит текст на parts частей по границам строк
+   */
+  void AddText(std::string_view text, std::chrono::system_clock::time_point timeStamp,
+               size_t parts) {
+    size_t begin = 0;
+    for (size_t i = 1; i <= parts && begin < text.size(); ++i) {
+      size_t end = text.size();
+      if (i < parts) {
+        end = text.find('\n', std::max(begin, text.size() / parts * i));
+        end = end == std::string_view::npos ? text.size() : end + 1;
+      }
+      m_tasks.push_back([part = text.substr(begin, end - begin), timeStamp]
+                        (std::vector<CommandView>& commands) {
+        auto handler = [&commands, timeStamp](std::string_view line) {
+          if (line.substr(0, BULK.size()) == BULK) {
+            line.remove_prefix(BULK.size());
+          }
+          while (!line.empty()) {
+            const auto separator = line.find(BatchFormatter::SEPARATOR);
+            commands.push_back(CommandView{line.substr(0, separator), timeStamp});
+            if (separator == std::string_view::npos) {
+              break;
+            }
+            line.remove_prefix(separator + BatchFormatter::SEPARATOR.size());
+          }
+        };
+        const char* rest = LineReader::ScanLines(part.data(), part.data() + part.size(), handler);
+        if (rest != part.data() + part.size()) {
+          handler(std::string_view(rest, static_cast<size_t>(part.data() + part.size() - rest)));
+        }
+      });
+      begin = end;
+    }
+  }
+
+  void Load(size_t threads) {
+    std::vector<std::vector<CommandView>> parts(m_tasks.size());
+    std::atomic<size_t> next{0};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    auto run = [&] {
+      for (auto index = next.fetch_add(1); index < m_tasks.size(); index = next.fetch_add(1)) {
+        try {
+          m_tasks[index](parts[index]);
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(errorMutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      }
+    };
+    std::vector<std::thread> loaders;
+    for (size_t i = 1; i < std::min(threads, m_tasks.size()); ++i) {
+      loaders.emplace_back(run);
+    }
+    run();
+    for (auto& loader : loaders) {
+      loader.join();
+    }
+    m_tasks.clear();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+
+    size_t total = 0;
+    for (const auto& part : parts) {
+      total += part.size();
+    }
+    m_commands.reserve(total);
+    for (const auto& part : parts) {
+      m_commands.insert(m_commands.end(), part.begin(), part.end());
+    }
+  }
+
+  std::vector<std::unique_ptr<BinarySegmentReader>> m_segments;
+  std::vector<std::string_view> m_mappings;
+  std::vector<Task> m_tasks;
+  std::vector<CommandView> m_commands;
+};
@@ -0,0 +1,262 @@
+#pragma once
+
+#include "CommandProcessor.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief когда сбрасывать сегмент на диск
+ */
+enum class FsyncPolicy {
+  Never,       // решает ОС
+  OnRotate,    // при закрытии сегмента
+  EveryBatch   // после каждого пакета
+};
+
+struct RollingOptions {
+  std::string prefix = "bulk-segment-";
+  size_t maxSegmentBytes = 64 * 1024 * 1024;
+  std::chrono::seconds maxSegmentAge{3600};
+  size_t bufferSize = 64 * 1024;
+  // неполный буфер rolling-вывода уходит в сегмент не позже этого срока
+  std::chrono::milliseconds bufferAge{1000};
+  FsyncPolicy fsync = FsyncPolicy::OnRotate;
+};
+
+/**
+ * @brief вывод пакетов в общий файл-сегмент с ротацией
+ *
+ * Пакеты дописываются в заранее открытый сегмент по строке на пакет в
+ * том же формате, что и у ReportWriter. Новый сегмент открывается, когда
+ * текущий превышает заданный размер или возраст. Неполный буфер
+ * записывает отдельный поток, когда буферу исполнится bufferAge, даже если
+ * новых пакетов нет; ошибка этой записи пробрасывается из следующего
+ * update(), а не принятая им — выводится деструктором.
+ */
+class RollingFileOutput : public Output { // subscriber
+public:
+  RollingFileOutput(BatchCommandProcessor *processor,
+                    const RollingOptions& options = RollingOptions())
+    : m_options(options) {
+    m_buffer.reserve(m_options.bufferSize);
+    OpenSegment();
+    m_flusher = std::thread(&RollingFileOutput::RunFlusher, this);
+    if (processor) {
+      processor->subscribe(this);
+    }
+  }
+
+  ~RollingFileOutput() override {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_flushCv.notify_one();
+    m_flusher.join();
+    CloseSegment();
+    if (m_error) {
+      try {
+        std::rethrow_exception(m_error);
+      }
+      catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+    }
+  }
+
+  void update(const BatchPtr& batch) override {
+    MetricTimer timer(MetricHistogram::SegmentWriteNs);
+    TraceSpan span("write rolling", batch->TraceId(), batch->Size());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error) {
+      std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+    if (NeedRotate()) {
+      CloseSegment();
+      OpenSegment();
+    }
+    const bool wasEmpty = m_buffer.empty();
+
+    Metrics::Add(MetricCounter::SegmentBytes, batch->TextSize() + 1);
+    if (batch->Spilled()) {
+      // запись блока, вынесенного на диск, проходит через буфер по частям
+      batch->ForEachTextChunk([this](std::string_view chunk) {
+        m_buffer.append(chunk);
+        if (m_buffer.size() >= m_options.bufferSize) {
+          FlushBuffer();
+        }
+      });
+      m_buffer.push_back('\n');
+      if (m_buffer.size() >= m_options.bufferSize ||
+          m_options.fsync == FsyncPolicy::EveryBatch) {
+        FlushBuffer();
+      }
+    }
+    else if (m_buffer.size() + batch->Text().size() + 1 > m_options.bufferSize) {
+      // крупная запись уходит одним writev вместе с накопленным буфером,
+      // без копирования в него
+      WriteRecord(batch->Text());
+    }
+    else {
+      m_buffer.append(batch->Text()).push_back('\n');
+      if (m_buffer.size() >= m_options.bufferSize ||
+          m_options.fsync == FsyncPolicy::EveryBatch) {
+        FlushBuffer();
+      }
+    }
+    if (m_options.fsync == FsyncPolicy::EveryBatch) {
+      Sync();
+    }
+    if (m_buffer.empty()) {
+      return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (wasEmpty) {
+      m_bufferStart = now;
+      // ожидающий без срока поток сброса отсчитывает возраст буфера
+      m_flushCv.notify_one();
+    }
+    else if (now - m_bufferStart >= m_options.bufferAge) {
+      FlushBuffer();
+    }
+  }
+
+private:
+  /**
+   * @brief записывает неполный буфер старше bufferAge
+   */
+  void RunFlusher() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+      if (m_buffer.empty()) {
+        m_flushCv.wait(lock);
+        continue;
+      }
+      const auto deadline = m_bufferStart + m_options.bufferAge;
+      if (std::chrono::steady_clock::now() < deadline) {
+        m_flushCv.wait_until(lock, deadline);
+        continue;
+      }
+      try {
+        FlushBuffer();
+      }
+      catch (...) {
+        if (!m_error) {
+          m_error = std::current_exception();
+        }
+        m_buffer.clear();
+      }
+    }
+  }
+
+  bool NeedRotate() const {
+    return m_segmentBytes + m_buffer.size() >= m_options.maxSegmentBytes ||
+        std::chrono::steady_clock::now() - m_segmentStart >= m_options.maxSegmentAge;
+  }
+
+  void OpenSegment() {
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count();
+    const auto filename = m_options.prefix + std::to_string(micros) + "-" +
+        std::to_string(m_segmentIndex++) + ".log";
+
+    m_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Unable to open segment " + filename);
+    }
+    m_segmentBytes = 0;
+    m_segmentStart = std::chrono::steady_clock::now();
+  }
+
+  void CloseSegment() {
+    if (m_fd < 0) {
+      return;
+    }
+    FlushBuffer();
+    if (m_options.fsync != FsyncPolicy::Never) {
+      Sync();
+    }
+    ::close(m_fd);
+    m_fd = -1;
+  }
+
+  void FlushBuffer() {
+    const char* data = m_buffer.data();
+    size_t size = m_buffer.size();
+    while (size > 0) {
+      const auto written = ::write(m_fd, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Unable to write segment.");
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
+    m_segmentBytes += m_buffer.size();
+    m_buffer.clear();
+  }
+
+  void WriteRecord(std::string_view text) {
+    static const char NEWLINE = '\n';
+    iovec parts[3] = {
+      {m_buffer.data(), m_buffer.size()},
+      {const_cast<char*>(text.data()), text.size()},
+      {const_cast<char*>(&NEWLINE), 1}
+    };
+    size_t total = m_buffer.size() + text.size() + 1;
+    iovec* part = parts;
+    int count = 3;
+    while (total > 0) {
+      const auto written = ::writev(m_fd, part, count);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Unable to write segment.");
+      }
+      m_segmentBytes += static_cast<size_t>(written);
+      total -= static_cast<size_t>(written);
+      for (auto rest = static_cast<size_t>(written); rest > 0 && count > 0;) {
+        const auto step = std::min(rest, part->iov_len);
+        part->iov_base = static_cast<char*>(part->iov_base) + step;
+        part->iov_len -= step;
+        rest -= step;
+        if (part->iov_len == 0) {
+          ++part;
+          --count;
+        }
+      }
+    }
+    m_buffer.clear();
+  }
+
+  void Sync() {
+    ::fdatasync(m_fd);
+  }
+
+  const RollingOptions m_options;
+  std::mutex m_mutex;
+  std::string m_buffer;
+  int m_fd = -1;
+  size_t m_segmentIndex = 0;
+  size_t m_segmentBytes = 0;
+  std::chrono::steady_clock::time_point m_segmentStart;
+  std::chrono::steady_clock::time_point m_bufferStart;
+  std::condition_variable m_flushCv;
+  std::exception_ptr m_error;
+  bool m_stop = false;
+  std::thread m_flusher;
+};
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "BatchQueue.h"
+#include "BlockContext.h"
+#include "Placement.h"
+
+#include <functional>
+#include <unordered_map>
+
+/**
+ * @brief по какому ключу команды распределяются по шардам
+ */
+enum class ShardKey {
+  Source,      // все команды источника — в один шард, порядок сохраняется
+  CommandHash  // команды вне блоков — по хэшу текста; блок целиком идёт в
+               // шард источника, порядок между шардами не гарантирован
+};
+
+struct ShardOptions {
+  size_t count = 0;  // 0 — без шардирования
+  ShardKey key = ShardKey::Source;
+  size_t queueCapacity = 1024;
+  bool pin = true;   // закреплять поток шарда за ядром
+  // ядра шардов по кругу; пусто — шард i на ядре i
+  std::vector<int> cpus;
+};
+
+/**
+ * @brief шардированный обработчик
+ *
+ * Каждый шард — отдельный BatchCommandProcessor со своим пулом пакетов,
+ * потоком, входной очередью и очередью вывода. Источники пересылают
+ * команды шардам пачками (пакетами-посылками из общего пула), внутри шарда
+ * у каждого источника свой BlockContext. Поток слияния забирает готовые
+ * пакеты из очередей вывода шардов и публикует их через publisher; так как
+ * очередь шарда упорядочена, пакеты одного источника выходят в порядке
+ * поступления команд.
+ *
+ * Поток шарда закрепляется за ядром сам и уже потом создаёт обработчик,
+ * так что пул и пакеты шарда размещаются на его узле NUMA.
+ *
+ * Отметку времени команде ставит источник при получении — по той же
+ * TimestampPolicy, но с посылкой вместо пакета, — и шард передаёт её
+ * обработчику, так что очередь до шарда не сдвигает время команд.
+ * Неполная посылка уходит шарду в Flush() источника: его вызывают
+ * LineReader и BulkServer, когда ввод прочитан до конца доступного.
+ */
+class ShardedProcessor {
+public:
+  ShardedProcessor(BatchCommandProcessor& publisher, const ShardOptions& options,
+                   int bulkSize, TimestampPolicy timestamps,
+                   const FlushOptions& flush)
+    : m_publisher(publisher), m_options(options), m_clock(timestamps),
+      m_chunks(BatchPool::Create()) {
+    const auto count = std::max<size_t>(m_options.count, 1);
+    if (m_options.pin) {
+      m_cpus = m_options.cpus;
+      if (m_cpus.empty()) {
+        const auto cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned core = 0; core < cores; ++core) {
+          m_cpus.push_back(static_cast<int>(core));
+        }
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      m_shards.push_back(std::make_unique<Shard>(m_options.queueCapacity, m_outputReady));
+    }
+    for (size_t i = 0; i < count; ++i) {
+      m_shards[i]->thread = std::thread(&ShardedProcessor::RunShard, this,
+                                        std::ref(*m_shards[i]), i, bulkSize, timestamps,
+                                        flush);
+    }
+    m_merger = std::thread(&ShardedProcessor::RunMerger, this);
+  }
+
+  /**
+   * @brief дорабатывает очереди шардов и слияния; источники к этому
+   * моменту должны быть уничтожены
+   */
+  ~ShardedProcessor() {
+    m_stopShards.store(true, std::memory_order_release);
+    for (auto& shard : m_shards) {
+      shard->inputReady.Notify();
+      shard->thread.join();
+      // последний статический пакет шарда уходит в его очередь вывода
+      shard->processor.reset();
+    }
+    m_stopMerger.store(true, std::memory_order_release);
+    m_outputReady.Notify();
+    m_merger.join();
+  }
+
+  ShardedProcessor(const ShardedProcessor&) = delete;
+  ShardedProcessor& operator=(const ShardedProcessor&) = delete;
+
+  /**
+   * @brief создаёт источник команд; каждый источник используется одним
+   * потоком
+   */
+  std::unique_ptr<CommandReceiver> CreateSource() {
+    return std::make_unique<Source>(*this, m_nextSource.fetch_add(1));
+  }
+
+  size_t ShardCount() const noexcept {
+    return m_shards.size();
+  }
+
+private:
+  static constexpr size_t CHUNK_SIZE = 256;
+
+  struct Message {
+    uint64_t source = 0;
+    bool close = false;  // источник отключился
+    BatchPtr chunk;
+  };
+
+  /**
+   * @brief очередь вывода шарда
+   */
+  class ShardOutput : public Output { // subscriber
+  public:
+    ShardOutput(size_t capacity, Parker& ready)
+      : m_batches(capacity), m_ready(ready) {}
+
+    void update(const BatchPtr& batch) override {
+      BatchPtr value = batch;
+      if (!m_batches.TryPush(value)) {
+        m_notFull.Wait([&] { return m_batches.TryPush(value); });
+      }
+      m_ready.Notify();
+    }
+
+    bool Empty() const noexcept {
+      return m_batches.Size() == 0;
+    }
+
+    bool TryPop(BatchPtr& batch) {
+      if (!m_batches.TryPop(batch)) {
+        return false;
+      }
+      m_notFull.Notify();
+      return true;
+    }
+
+  private:
+    SpscRing<BatchPtr> m_batches;
+    Parker& m_ready;
+    Parker m_notFull;
+  };
+
+  struct Shard {
+    Shard(size_t capacity, Parker& outputReady)
+      : input(capacity), output(capacity, outputReady) {}
+
+    MpmcRing<Message> input;
+    Parker inputReady;
+    Parker inputFree;
+    ShardOutput output;
+    // создаётся потоком шарда
+    std::unique_ptr<BatchCommandProcessor> processor;
+    std::unordered_map<uint64_t, std::unique_ptr<BlockContext>> contexts;
+    std::thread thread;
+  };
+
+  /**
+   * @brief источник: раскладывает команды по посылкам для шардов
+   */
+  class Source : public CommandReceiver {
+  public:
+    Source(ShardedProcessor& owner, uint64_t id)
+      : m_owner(owner), m_id(id),
+        m_home(std::hash<uint64_t>()(id) % owner.m_shards.size()),
+        m_pending(owner.m_shards.size()), m_used(owner.m_shards.size(), false) {}
+
+    ~Source() override {
+      Flush();
+      for (size_t shard = 0; shard < m_used.size(); ++shard) {
+        if (m_used[shard]) {
+          m_owner.Submit(shard, Message{m_id, true, nullptr});
+        }
+      }
+    }
+
+    void ProcessCommand(std::string_view text) override {
+      size_t shard = m_home;
+      switch (Classify(text)) {
+      case CommandKind::StartBlock:
+        ++m_blockDepth;
+        break;
+      case CommandKind::EndBlock:
+        m_blockDepth = std::max(m_blockDepth - 1, 0);
+        break;
+      case CommandKind::Command:
+        if (m_blockDepth == 0 && m_owner.m_options.key == ShardKey::CommandHash) {
+          shard = std::hash<std::string_view>()(text) % m_pending.size();
+        }
+        break;
+      }
+
+      auto& chunk = m_pending[shard];
+      if (!chunk) {
+        chunk = m_owner.m_chunks->Acquire();
+        chunk->Reserve(CHUNK_SIZE);
+      }
+      if (chunk->Empty() || m_owner.m_clock.EveryCommand()) {
+        m_timeStamp = m_owner.m_clock.Now();
+      }
+      chunk->Append(text, m_timeStamp);
+      if (chunk->Size() >= CHUNK_SIZE) {
+        Send(shard);
+      }
+    }
+
+    void Flush() override {
+      for (size_t shard = 0; shard < m_pending.size(); ++shard) {
+        if (m_pending[shard]) {
+          Send(shard);
+        }
+      }
+    }
+
+  private:
+    void Send(size_t shard) {
+      m_used[shard] = true;
+      m_owner.Submit(shard, Message{m_id, false,
+                                    m_owner.m_chunks->Seal(std::move(m_pending[shard]))});
+    }
+
+    ShardedProcessor& m_owner;
+    const uint64_t m_id;
+    const size_t m_home;
+    int m_blockDepth = 0;
+    std::chrono::system_clock::time_point m_timeStamp;
+    std::vector<std::unique_ptr<Batch>> m_pending;
+    std::vector<bool> m_used;
+  };
+
+  void Submit(size_t index, Message&& message) {
+    auto& shard = *m_shards[index];
+    if (!shard.input.TryPush(message)) {
+      shard.inputFree.Wait([&] { return shard.input.TryPush(message); });
+    }
+    shard.inputReady.Notify();
+  }
+
+  void RunShard(Shard& shard, size_t index, int bulkSize, TimestampPolicy timestamps,
+                FlushOptions flush) {
+    PinCurrentThread(m_cpus, index);
+    shard.processor = std::make_unique<BatchCommandProcessor>(bulkSize, timestamps, flush);
+    // пакеты шардов интернируются в общую с publisher таблицу
+    if (const auto& table = m_publisher.GetCommandTable()) {
+      shard.processor->SetCommandTable(table);
+    }
+    shard.processor->subscribe(&shard.output);
+    Message message;
+    for (;;) {
+      bool received = false;
+      shard.inputReady.Wait([&] {
+        received = shard.input.TryPop(message);
+        return received || m_stopShards.load(std::memory_order_acquire);
+      });
+      if (!received && !shard.input.TryPop(message)) {
+        return;
+      }
+      shard.inputFree.Notify();
+
+      auto& context = shard.contexts[message.source];
+      if (message.close) {
+        shard.contexts.erase(message.source);
+        continue;
+      }
+      if (!context) {
+        context = std::make_unique<BlockContext>(*shard.processor);
+      }
+      for (const auto command : *message.chunk) {
+        context->ProcessCommand(command.text, command.timeStamp);
+      }
+      message.chunk.reset();
+    }
+  }
+
+  void RunMerger() {
+    BatchPtr batch;
+    for (;;) {
+      bool merged = false;
+      for (auto& shard : m_shards) {
+        while (shard->output.TryPop(batch)) {
+          m_publisher.notify(batch);
+          batch.reset();
+          merged = true;
+        }
+      }
+      if (!merged) {
+        if (m_stopMerger.load(std::memory_order_acquire)) {
+          return;
+        }
+        m_outputReady.Wait([&] {
+          return m_stopMerger.load(std::memory_order_acquire) || HasOutput();
+        });
+      }
+    }
+  }
+
+  bool HasOutput() const noexcept {
+    return std::any_of(m_shards.begin(), m_shards.end(), [](const auto& shard) {
+      return !shard->output.Empty();
+    });
+  }
+
+  BatchCommandProcessor& m_publisher;
+  const ShardOptions m_options;
+  // отметки времени команд источников
+  const Timestamper m_clock;
+  // ядра шардов; пусто — без закрепления
+  std::vector<int> m_cpus;
+  std::shared_ptr<BatchPool> m_chunks;
+  std::vector<std::unique_ptr<Shard>> m_shards;
+  Parker m_outputReady;
+  std::atomic<uint64_t> m_nextSource{0};
+  std::atomic<bool> m_stopShards{false};
+  std::atomic<bool> m_stopMerger{false};
+  std::thread m_merger;
+};
@@ -0,0 +1,310 @@
+#pragma once
+
+#include "LockFreeRing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct TraceOptions {
+  // файл событий в формате Chrome trace (JSON-массив); пусто — без трассировки
+  std::string path;
+  // трассировать каждый N-й пакет каждого потока ввода
+  uint32_t sampleEvery = 100;
+};
+
+/**
+ * @brief отрезок работы над пакетом
+ */
+struct TraceEvent {
+  const char* name = nullptr;  // строковый литерал
+  uint64_t batch = 0;
+  int64_t start = 0;           // steady_clock, наносекунды
+  int64_t duration = 0;
+  uint64_t commands = 0;
+};
+
+/**
+ * @brief трассировка пакетов по этапам конвейера
+ *
+ * Трассируется выборка пакетов: пакет, получивший при первой команде
+ * номер трассировки (Sample()), оставляет событие на каждом этапе —
+ * наполнение до запечатывания, рассылка, форматирование, запись каждым
+ * подписчиком. Остальные пакеты обходятся одной проверкой номера.
+ *
+ * Каждый поток пишет события в собственное кольцо SpscRing без
+ * блокировок; кольцо регистрируется при первом событии потока, а
+ * переполненное кольцо теряет событие и увеличивает счётчик Dropped().
+ * Кольца опустошает TraceWriter. Кольцо завершившегося потока остаётся в
+ * реестре, пока его не вычитают.
+ */
+class Tracer {
+public:
+  static constexpr size_t RING_SIZE = 4096;
+
+  static bool Enabled() noexcept {
+    return Instance().every.load(std::memory_order_relaxed) != 0;
+  }
+
+  /**
+   * @brief номер трассировки для очередного пакета потока; 0 — пакет не
+   * попал в выборку
+   */
+  static uint64_t Sample() noexcept {
+    auto& registry = Instance();
+    const auto every = registry.every.load(std::memory_order_relaxed);
+    thread_local uint32_t counter = 0;
+    if (every == 0 || ++counter < every) {
+      return 0;
+    }
+    counter = 0;
+    return registry.nextBatch.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static int64_t Now() noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  /**
+   * @brief событие этапа name пакета batch от start до текущего момента
+   */
+  static void Record(const char* name, uint64_t batch, int64_t start,
+                     uint64_t commands) noexcept {
+    TraceEvent event{name, batch, start, Now() - start, commands};
+    if (!Local().events.TryPush(event)) {
+      Instance().dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @brief включает трассировку; вызывается до подачи команд
+   */
+  static void Enable(uint32_t sampleEvery) noexcept {
+    Instance().every.store(std::max<uint32_t>(sampleEvery, 1), std::memory_order_relaxed);
+  }
+
+  static void Disable() noexcept {
+    Instance().every.store(0, std::memory_order_relaxed);
+  }
+
+  /**
+   * @brief передаёт handler(tid, event) все накопленные события и
+   * забывает вычитанные кольца завершившихся потоков; вызывается из
+   * одного потока
+   */
+  template <typename Handler>
+  static void Drain(Handler&& handler) {
+    auto& registry = Instance();
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      rings = registry.rings;
+    }
+    TraceEvent event;
+    for (const auto& ring : rings) {
+      const bool retired = ring->retired.load(std::memory_order_acquire);
+      while (ring->events.TryPop(event)) {
+        handler(ring->tid, event);
+      }
+      if (retired) {
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        auto& all = registry.rings;
+        all.erase(std::remove(all.begin(), all.end(), ring), all.end());
+      }
+    }
+  }
+
+  static uint64_t Dropped() noexcept {
+    return Instance().dropped.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Ring {
+    SpscRing<TraceEvent> events{RING_SIZE};
+    const long tid = ::syscall(SYS_gettid);
+    std::atomic<bool> retired{false};
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    std::atomic<uint32_t> every{0};
+    std::atomic<uint64_t> nextBatch{1};
+    std::atomic<uint64_t> dropped{0};
+  };
+
+  struct LocalRing {
+    LocalRing() : ring(std::make_shared<Ring>()) {
+      auto& registry = Instance();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.rings.push_back(ring);
+    }
+
+    ~LocalRing() {
+      ring->retired.store(true, std::memory_order_release);
+    }
+
+    std::shared_ptr<Ring> ring;
+  };
+
+  static Registry& Instance() {
+    static Registry registry;
+    return registry;
+  }
+
+  static Ring& Local() {
+    thread_local LocalRing local;
+    return *local.ring;
+  }
+};
+
+/**
+ * @brief записывает событие этапа на время жизни объекта, если пакет
+ * трассируется
+ */
+class TraceSpan {
+public:
+  TraceSpan(const char* name, uint64_t batch, uint64_t commands) noexcept
+    : m_name(name), m_batch(batch), m_commands(commands),
+      m_start(batch != 0 ? Tracer::Now() : 0) {}
+
+  ~TraceSpan() {
+    if (m_batch != 0) {
+      Tracer::Record(m_name, m_batch, m_start, m_commands);
+    }
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+  const char* m_name;
+  uint64_t m_batch;
+  uint64_t m_commands;
+  int64_t m_start;
+};
+
+/**
+ * @brief выгрузка событий трассировки в файл
+ *
+ * Файл — JSON-массив событий "X" формата Chrome trace, который открывают
+ * chrome://tracing и Perfetto: этап, поток, начало и длительность в
+ * микросекундах, номер трассировки пакета и число команд в args. Поток
+ * выгрузки раз в FLUSH_INTERVAL опустошает кольца потоков. Массив
+ * закрывается в деструкторе, но и незакрытый файл после сбоя читается
+ * обоими инструментами. Объект создаётся до конвейера, чтобы выгрузить
+ * события уже после его остановки.
+ */
+class TraceWriter {
+public:
+  static constexpr std::chrono::milliseconds FLUSH_INTERVAL{100};
+
+  explicit TraceWriter(const TraceOptions& options) {
+    if (options.path.empty()) {
+      return;
+    }
+    m_fd = ::open(options.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Unable to open trace file " + options.path);
+    }
+    m_buffer = "[";
+    Tracer::Enable(options.sampleEvery);
+    m_thread = std::thread(&TraceWriter::Run, this);
+  }
+
+  ~TraceWriter() {
+    if (m_fd < 0) {
+      return;
+    }
+    Tracer::Disable();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+    Drain();
+    if (const auto dropped = Tracer::Dropped()) {
+      Separate();
+      m_buffer += "{\"name\":\"dropped\",\"ph\":\"M\",\"pid\":" + std::to_string(::getpid()) +
+          ",\"args\":{\"events\":" + std::to_string(dropped) + "}}";
+    }
+    m_buffer += "\n]\n";
+    Write();
+    ::close(m_fd);
+  }
+
+  TraceWriter(const TraceWriter&) = delete;
+  TraceWriter& operator=(const TraceWriter&) = delete;
+
+private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+      m_cv.wait_for(lock, FLUSH_INTERVAL);
+      Drain();
+    }
+  }
+
+  void Drain() {
+    const auto pid = ::getpid();
+    Tracer::Drain([this, pid](long tid, const TraceEvent& event) {
+      char line[256];
+      const int size = std::snprintf(
+            line, sizeof(line),
+            "{\"name\":\"%s\",\"cat\":\"bulk\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"batch\":%llu,\"commands\":%llu}}",
+            event.name, static_cast<int>(pid), tid, event.start / 1000.0,
+            event.duration / 1000.0, static_cast<unsigned long long>(event.batch),
+            static_cast<unsigned long long>(event.commands));
+      Separate();
+      m_buffer.append(line, static_cast<size_t>(std::max(size, 0)));
+    });
+    Write();
+  }
+
+  void Separate() {
+    m_buffer += m_first ? "\n" : ",\n";
+    m_first = false;
+  }
+
+  void Write() noexcept {
+    const char* data = m_buffer.data();
+    size_t size = m_buffer.size();
+    while (size > 0) {
+      const auto written = ::write(m_fd, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
+    m_buffer.clear();
+  }
+
+  int m_fd = -1;
+  std::string m_buffer;
+  bool m_first = true;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_stop = false;
+  std::thread m_thread;
+};
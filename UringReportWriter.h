@@ -0,0 +1,659 @@
+#pragma once
+
+#include "AsyncSink.h"
+#include "CommandProcessor.h"
+
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+struct UringOptions {
+  // писать файлы пакетов через io_uring
+  bool enabled = false;
+  // одновременно создаваемых файлов
+  unsigned depth = 64;
+  // зарегистрированный буфер на файл; запись длиннее пишется прямо из пакета
+  size_t bufferSize = 64 * 1024;
+};
+
+/**
+ * @brief кольцо io_uring поверх системных вызовов
+ *
+ * Очереди отправки и завершения отображаются в память процесса; головы и
+ * хвосты читаются и пишутся с acquire/release, как этого требует ядро.
+ * Объект не потокобезопасен; только Wait() может ждать в одном потоке,
+ * пока другой готовит и отправляет элементы.
+ */
+class IoUring {
+public:
+  explicit IoUring(unsigned entries) {
+    io_uring_params params{};
+    m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+      throw std::runtime_error("io_uring is not available.");
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      ::close(m_fd);
+      throw std::runtime_error("io_uring is too old.");
+    }
+    m_ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                          params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    m_ring = ::mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    m_fd, IORING_OFF_SQ_RING);
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = static_cast<io_uring_sqe*>(
+          ::mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 m_fd, IORING_OFF_SQES));
+    if (m_ring == MAP_FAILED || m_sqes == MAP_FAILED) {
+      Release();
+      throw std::runtime_error("Unable to map io_uring.");
+    }
+    auto* base = static_cast<char*>(m_ring);
+    m_sqHead = reinterpret_cast<uint32_t*>(base + params.sq_off.head);
+    m_sqTail = reinterpret_cast<uint32_t*>(base + params.sq_off.tail);
+    m_sqMask = *reinterpret_cast<uint32_t*>(base + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<uint32_t*>(base + params.sq_off.array);
+    m_sqEntries = params.sq_entries;
+    m_cqHead = reinterpret_cast<uint32_t*>(base + params.cq_off.head);
+    m_cqTail = reinterpret_cast<uint32_t*>(base + params.cq_off.tail);
+    m_cqMask = *reinterpret_cast<uint32_t*>(base + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+    m_localTail = *m_sqTail;
+  }
+
+  ~IoUring() {
+    Release();
+  }
+
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  /**
+   * @brief очередной элемент отправки, обнулённый; nullptr, если очередь
+   * полна
+   */
+  io_uring_sqe* GetSqe() noexcept {
+    const auto head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (m_localTail - head >= m_sqEntries) {
+      return nullptr;
+    }
+    const auto index = m_localTail & m_sqMask;
+    m_sqArray[index] = index;
+    ++m_localTail;
+    auto* sqe = &m_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  /**
+   * @brief число свободных элементов отправки
+   */
+  unsigned SqeSpace() const noexcept {
+    return m_sqEntries - (m_localTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));
+  }
+
+  /**
+   * @brief отправляет подготовленные и ещё не принятые ядром элементы и
+   * ждёт waitFor завершений
+   */
+  void Submit(unsigned waitFor = 0) {
+    const auto submitted = m_localTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if (submitted == 0 && waitFor == 0) {
+      return;
+    }
+    __atomic_store_n(m_sqTail, m_localTail, __ATOMIC_RELEASE);
+    while (::syscall(__NR_io_uring_enter, m_fd, submitted, waitFor,
+                     waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        throw std::runtime_error("io_uring_enter failed.");
+      }
+    }
+  }
+
+  /**
+   * @brief ждёт waitFor завершений, ничего не отправляя
+   */
+  void Wait(unsigned waitFor) {
+    while (::syscall(__NR_io_uring_enter, m_fd, 0, waitFor, IORING_ENTER_GETEVENTS,
+                     nullptr, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        throw std::runtime_error("io_uring_enter failed.");
+      }
+    }
+  }
+
+  /**
+   * @brief передаёт handler'у готовые завершения
+   * @return их число
+   */
+  template <typename Handler>
+  unsigned ForEachCompletion(Handler&& handler) {
+    auto head = *m_cqHead;
+    const auto tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    for (; head != tail; ++head, ++count) {
+      const auto& cqe = m_cqes[head & m_cqMask];
+      handler(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  int Register(unsigned opcode, const void* arg, unsigned count) noexcept {
+    return static_cast<int>(::syscall(__NR_io_uring_register, m_fd, opcode, arg, count));
+  }
+
+  /**
+   * @brief поддерживает ли ядро операцию opcode
+   */
+  bool Supports(uint8_t opcode) {
+    constexpr unsigned OPS = 256;
+    std::vector<char> storage(sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+    if (Register(IORING_REGISTER_PROBE, probe, OPS) < 0 || opcode > probe->last_op) {
+      return false;
+    }
+    return probe->ops[opcode].flags & IO_URING_OP_SUPPORTED;
+  }
+
+private:
+  void Release() noexcept {
+    if (m_sqes && m_sqes != MAP_FAILED) {
+      ::munmap(m_sqes, m_sqesSize);
+    }
+    if (m_ring && m_ring != MAP_FAILED) {
+      ::munmap(m_ring, m_ringSize);
+    }
+    ::close(m_fd);
+  }
+
+  int m_fd = -1;
+  void* m_ring = nullptr;
+  size_t m_ringSize = 0;
+  io_uring_sqe* m_sqes = nullptr;
+  size_t m_sqesSize = 0;
+  uint32_t* m_sqHead = nullptr;
+  uint32_t* m_sqTail = nullptr;
+  uint32_t* m_sqArray = nullptr;
+  uint32_t m_sqMask = 0;
+  uint32_t m_sqEntries = 0;
+  uint32_t m_localTail = 0;
+  uint32_t* m_cqHead = nullptr;
+  uint32_t* m_cqTail = nullptr;
+  uint32_t m_cqMask = 0;
+  io_uring_cqe* m_cqes = nullptr;
+};
+
+/**
+ * @brief запись файлов пакетов через io_uring
+ *
+ * Каждый пакет — цепочка связанных операций openat → write → close над
+ * прямым дескриптором кольца: поток не ждёт ни одной из них и не делает
+ * системных вызовов, кроме одного io_uring_enter на пакет. В полёте
+ * держится до depth файлов; у каждого свой слот — зарегистрированный
+ * буфер, прямой дескриптор и имя файла. Запись, помещающаяся в буфер,
+ * копируется в него и уходит write_fixed, более длинная пишется прямо из
+ * текста пакета, который слот удерживает до завершения. Блок, вынесенный на
+ * диск, пишется обычным ReportWriter. Имена файлов — как у ReportWriter.
+ * Если запись в кольце не дописала текст (ошибка, короткая запись,
+ * оборванная цепочка), файл по завершении цепочки переписывается
+ * обычными вызовами из того же буфера или пакета и учитывается в
+ * FileRetries. Если не удалась и повторная запись, ошибка пробрасывается
+ * из следующего update() (у UringSink — из write()), а не принятая им
+ * выводится деструктором.
+ *
+ * Если ядро не даёт io_uring или нужных операций, Create() возвращает
+ * ReportWriter.
+ */
+class UringReportWriter : public Output { // subscriber
+  friend class UringSink;
+
+public:
+  static std::unique_ptr<Output> Create(BatchCommandProcessor *processor,
+                                        const UringOptions& options) {
+    std::unique_ptr<Output> writer;
+    try {
+      writer = std::unique_ptr<Output>(new UringReportWriter(options));
+    }
+    catch (const std::runtime_error&) {
+      writer = std::make_unique<ReportWriter>(nullptr);
+    }
+    if (processor) {
+      processor->subscribe(writer.get());
+    }
+    return writer;
+  }
+
+  ~UringReportWriter() override {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    try {
+      while (m_inFlight != 0) {
+        Reap(1);
+      }
+      if (m_error) {
+        std::rethrow_exception(m_error);
+      }
+    }
+    catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+    // закрывает прямые дескрипторы, если какие-то цепочки оборвались
+    m_ring.Register(IORING_UNREGISTER_FILES, nullptr, 0);
+  }
+
+  void update(const BatchPtr& batch) override {
+    if (batch->Spilled()) {
+      m_fallback.update(batch);
+      return;
+    }
+    MetricTimer timer(MetricHistogram::FileWriteNs);
+    // запись завершается в ядре: отрезок — постановка цепочки в кольцо
+    TraceSpan span("write files", batch->TraceId(), batch->Size());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Reap(0);
+    ThrowError();
+    while (!TrySubmit(batch)) {
+      Reap(1);
+    }
+  }
+
+private:
+  static constexpr unsigned OPERATIONS = 3;
+  // user_data операции, которая только будит ждущий завершений поток
+  static constexpr uint64_t WAKE = UINT64_MAX;
+
+  // операция цепочки в user_data завершения
+  enum class Operation : uint64_t {
+    Open,
+    Write,
+    Close
+  };
+
+  struct Slot {
+    char filename[ReportWriter::FILENAME_SIZE];
+    char* buffer = nullptr;
+    // длинная запись пишется из текста пакета
+    BatchPtr batch;
+    size_t size = 0;
+    unsigned pending = 0;
+    bool incomplete = false;
+  };
+
+  static uint64_t UserData(unsigned index, Operation operation) noexcept {
+    return static_cast<uint64_t>(index) * OPERATIONS + static_cast<uint64_t>(operation);
+  }
+
+  /**
+   * @brief ставит в кольцо цепочку файла пакета; вызывается под m_mutex
+   * @return false, если нет свободного слота или места в очереди отправки
+   * на все операции цепочки: её нельзя разрывать
+   */
+  bool TrySubmit(const BatchPtr& batch) {
+    if (m_free.empty() || m_ring.SqeSpace() < OPERATIONS) {
+      return false;
+    }
+    const auto index = m_free.back();
+    m_free.pop_back();
+    auto& slot = m_slots[index];
+    ReportWriter::GetFilename(*batch, slot.filename);
+
+    const auto text = batch->Text();
+    auto* open = m_ring.GetSqe();
+    auto* write = m_ring.GetSqe();
+    auto* close = m_ring.GetSqe();
+    open->opcode = IORING_OP_OPENAT;
+    open->fd = AT_FDCWD;
+    open->addr = reinterpret_cast<uint64_t>(slot.filename);
+    // прямой дескриптор не принадлежит процессу: O_CLOEXEC ядро отвергает
+    open->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    open->len = 0644;
+    open->file_index = index + 1;
+    open->flags = IOSQE_IO_LINK;
+    open->user_data = UserData(index, Operation::Open);
+
+    write->fd = static_cast<int>(index);
+    write->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    write->len = static_cast<uint32_t>(text.size());
+    write->user_data = UserData(index, Operation::Write);
+    slot.size = text.size();
+    slot.incomplete = false;
+    if (text.size() <= m_options.bufferSize) {
+      std::memcpy(slot.buffer, text.data(), text.size());
+      write->opcode = IORING_OP_WRITE_FIXED;
+      write->addr = reinterpret_cast<uint64_t>(slot.buffer);
+      write->buf_index = static_cast<uint16_t>(index);
+    }
+    else {
+      write->opcode = IORING_OP_WRITE;
+      write->addr = reinterpret_cast<uint64_t>(text.data());
+      slot.batch = batch;
+    }
+
+    close->opcode = IORING_OP_CLOSE;
+    close->file_index = index + 1;
+    close->user_data = UserData(index, Operation::Close);
+
+    slot.pending = OPERATIONS;
+    ++m_inFlight;
+    m_ring.Submit();
+    Metrics::Add(MetricCounter::FileBytes, text.size());
+    return true;
+  }
+
+  explicit UringReportWriter(const UringOptions& options)
+    : m_options(options), m_ring(std::max(options.depth, 1u) * OPERATIONS),
+      m_fallback(nullptr) {
+    for (const uint8_t opcode : {IORING_OP_OPENAT, IORING_OP_WRITE_FIXED,
+                                 IORING_OP_WRITE, IORING_OP_CLOSE}) {
+      if (!m_ring.Supports(opcode)) {
+        throw std::runtime_error("io_uring lacks a required operation.");
+      }
+    }
+    const auto depth = std::max(options.depth, 1u);
+    m_slots.resize(depth);
+    m_buffers = std::make_unique<char[]>(depth * m_options.bufferSize);
+    std::vector<iovec> buffers(depth);
+    // пустая таблица прямых дескрипторов: openat сам занимает слот
+    std::vector<int> files(depth, -1);
+    for (unsigned i = 0; i < depth; ++i) {
+      m_slots[i].buffer = m_buffers.get() + i * m_options.bufferSize;
+      buffers[i] = iovec{m_slots[i].buffer, m_options.bufferSize};
+      m_free.push_back(depth - 1 - i);
+    }
+    if (m_ring.Register(IORING_REGISTER_BUFFERS, buffers.data(), depth) < 0 ||
+        m_ring.Register(IORING_REGISTER_FILES, files.data(), depth) < 0) {
+      throw std::runtime_error("Unable to register io_uring resources.");
+    }
+    CheckDirectFiles();
+  }
+
+  /**
+   * @brief openat и close с прямым дескриптором появились позже самих
+   * операций, и проба их не различает: проверяется цепочка над /dev/null
+   */
+  void CheckDirectFiles() {
+    static const char NULL_DEVICE[] = "/dev/null";
+    auto* open = m_ring.GetSqe();
+    auto* close = m_ring.GetSqe();
+    if (!open || !close) {
+      throw std::runtime_error("io_uring submission queue is too small.");
+    }
+    open->opcode = IORING_OP_OPENAT;
+    open->fd = AT_FDCWD;
+    open->addr = reinterpret_cast<uint64_t>(NULL_DEVICE);
+    open->open_flags = O_WRONLY;
+    open->file_index = 1;
+    open->flags = IOSQE_IO_LINK;
+    close->opcode = IORING_OP_CLOSE;
+    close->file_index = 1;
+    m_ring.Submit(2);
+    bool ok = true;
+    unsigned completed = 0;
+    while (completed < 2) {
+      completed += m_ring.ForEachCompletion([&ok](uint64_t, int result) {
+        ok = ok && result >= 0;
+      });
+      if (completed < 2) {
+        m_ring.Submit(1);
+      }
+    }
+    if (!ok) {
+      throw std::runtime_error("io_uring lacks direct descriptors.");
+    }
+  }
+
+  /**
+   * @brief разбирает завершения; слот освобождается после последней
+   * операции цепочки (оборванная цепочка тоже завершает каждую операцию)
+   */
+  void Reap(unsigned waitFor) {
+    if (waitFor) {
+      m_ring.Submit(waitFor);
+    }
+    m_ring.ForEachCompletion([this](uint64_t data, int result) {
+      if (data == WAKE) {
+        return;
+      }
+      const auto index = static_cast<unsigned>(data / OPERATIONS);
+      auto& slot = m_slots[index];
+      if (static_cast<Operation>(data % OPERATIONS) == Operation::Write &&
+          (result < 0 || static_cast<size_t>(result) != slot.size)) {
+        slot.incomplete = true;
+      }
+      if (--slot.pending == 0) {
+        if (slot.incomplete) {
+          Rewrite(slot);
+        }
+        slot.batch.reset();
+        m_free.push_back(index);
+        --m_inFlight;
+      }
+    });
+  }
+
+  /**
+   * @brief переписывает файл слота обычными вызовами после неполной
+   * записи в кольце; первая неудача запоминается для update()
+   */
+  void Rewrite(const Slot& slot) noexcept {
+    const int fd = ::open(slot.filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      SetError(std::string("Unable to open file ") + slot.filename);
+      return;
+    }
+    Metrics::Add(MetricCounter::FileRetries, 1);
+    const char* data = slot.batch ? slot.batch->Text().data() : slot.buffer;
+    size_t size = slot.size;
+    while (size > 0) {
+      const auto written = ::write(fd, data, size);
+      if (written < 0 && errno == EINTR) {
+        continue;
+      }
+      if (written <= 0) {
+        SetError(std::string("Unable to write file ") + slot.filename);
+        break;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+    }
+    ::close(fd);
+  }
+
+  void SetError(const std::string& message) noexcept {
+    if (!m_error) {
+      m_error = std::make_exception_ptr(std::runtime_error(message));
+    }
+  }
+
+  /**
+   * @brief пробрасывает ошибку повторной записи; вызывается под m_mutex
+   */
+  void ThrowError() {
+    if (m_error) {
+      std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+  }
+
+  const UringOptions m_options;
+  IoUring m_ring;
+  ReportWriter m_fallback;
+  std::unique_ptr<char[]> m_buffers;
+  std::vector<Slot> m_slots;
+  std::vector<unsigned> m_free;
+  unsigned m_inFlight = 0;
+  // первая ошибка повторной записи, ещё не проброшенная
+  std::exception_ptr m_error;
+  std::mutex m_mutex;
+};
+
+/**
+ * @brief сопрограммный вывод файлов пакетов через io_uring
+ *
+ * write() ставит цепочку файла в кольцо UringReportWriter и завершается,
+ * не дожидаясь диска. Если все depth слотов в полёте, сопрограмма
+ * приостанавливается до завершения одной из цепочек и поток исполнителя
+ * не занимает. Завершения разбирает собственный поток вывода: он ждёт их
+ * в io_uring_enter и возобновляет ожидающую сопрограмму на исполнителе.
+ * Отмена будит ожидающую запись, и её пакет отбрасывается; уже
+ * поставленные в кольцо цепочки дорабатывает деструктор. Записи одного
+ * вывода идут по очереди (см. AsyncSinkOutput), поэтому ожидающая
+ * сопрограмма всегда одна.
+ *
+ * Если ядро не даёт io_uring или нужных операций, Create() возвращает
+ * OutputSink над ReportWriter.
+ */
+class UringSink : public AsyncSink {
+public:
+  static std::unique_ptr<AsyncSink> Create(const UringOptions& options,
+                                           SinkExecutor& executor) {
+    try {
+      return std::unique_ptr<AsyncSink>(new UringSink(options, executor));
+    }
+    catch (const std::runtime_error&) {
+      return std::make_unique<OutputSink>(std::make_unique<ReportWriter>(nullptr));
+    }
+  }
+
+  ~UringSink() override {
+    {
+      std::lock_guard<std::mutex> lock(m_writer.m_mutex);
+      m_stop = true;
+      // поток завершений ждёт в ядре: его будит NOP; очередь отправки
+      // освобождается отправкой, так как ядро принимает её целиком
+      io_uring_sqe* nop;
+      while (!(nop = m_writer.m_ring.GetSqe())) {
+        m_writer.m_ring.Submit();
+      }
+      nop->opcode = IORING_OP_NOP;
+      nop->user_data = UringReportWriter::WAKE;
+      m_writer.m_ring.Submit();
+    }
+    m_reaper.join();
+  }
+
+  SinkTask write(BatchPtr batch, std::stop_token stop) override;
+
+private:
+  UringSink(const UringOptions& options, SinkExecutor& executor)
+    : m_writer(options), m_executor(executor) {
+    m_reaper = std::thread(&UringSink::RunReaper, this);
+  }
+
+  /**
+   * @brief ожидание свободного слота; не приостанавливает, если слот уже
+   * освободился или запрошена отмена
+   */
+  auto SlotFreed(const std::stop_token& stop) noexcept {
+    struct Awaiter {
+      UringSink* sink;
+      const std::stop_token& stop;
+
+      bool await_ready() const noexcept {
+        return false;
+      }
+
+      bool await_suspend(std::coroutine_handle<> handle) const {
+        std::lock_guard<std::mutex> lock(sink->m_writer.m_mutex);
+        if (!sink->m_writer.m_free.empty() || stop.stop_requested() ||
+            sink->m_failed.load(std::memory_order_relaxed)) {
+          return false;
+        }
+        sink->m_waiting = handle;
+        return true;
+      }
+
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{this, stop};
+  }
+
+  /**
+   * @brief возобновляет ожидающую запись, если она есть
+   */
+  void Wake() {
+    std::coroutine_handle<> waiting;
+    {
+      std::lock_guard<std::mutex> lock(m_writer.m_mutex);
+      waiting = std::exchange(m_waiting, {});
+    }
+    if (waiting) {
+      m_executor.Post(waiting);
+    }
+  }
+
+  /**
+   * @brief разбирает завершения, пока вывод не закрыт и цепочки в полёте;
+   * без завершений записи идут через ReportWriter
+   */
+  void RunReaper() {
+    try {
+      for (;;) {
+        m_writer.m_ring.Wait(1);
+        std::coroutine_handle<> waiting;
+        bool done = false;
+        {
+          std::lock_guard<std::mutex> lock(m_writer.m_mutex);
+          m_writer.Reap(0);
+          if (!m_writer.m_free.empty()) {
+            waiting = std::exchange(m_waiting, {});
+          }
+          done = m_stop && m_writer.m_inFlight == 0;
+        }
+        if (waiting) {
+          m_executor.Post(waiting);
+        }
+        if (done) {
+          return;
+        }
+      }
+    }
+    catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      m_failed.store(true, std::memory_order_release);
+      Wake();
+    }
+  }
+
+  UringReportWriter m_writer;
+  SinkExecutor& m_executor;
+  // под m_writer.m_mutex
+  std::coroutine_handle<> m_waiting;
+  bool m_stop = false;
+  std::atomic<bool> m_failed{false};
+  std::thread m_reaper;
+};
+
+inline SinkTask UringSink::write(BatchPtr batch, std::stop_token stop) {
+  if (batch->Spilled() || m_failed.load(std::memory_order_acquire)) {
+    m_writer.m_fallback.update(batch);
+    co_return;
+  }
+  // отрезок — постановка цепочки в кольцо вместе с ожиданием слота
+  TraceSpan span("write files", batch->TraceId(), batch->Size());
+  std::stop_callback wake(stop, [this] { Wake(); });
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> lock(m_writer.m_mutex);
+      m_writer.ThrowError();
+      if (stop.stop_requested() || m_writer.TrySubmit(batch)) {
+        break;
+      }
+    }
+    co_await SlotFreed(stop);
+    if (m_failed.load(std::memory_order_acquire)) {
+      m_writer.m_fallback.update(batch);
+      break;
+    }
+  }
+}
@@ -0,0 +1,469 @@
+#pragma once
+
+#include "CommandProcessor.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <utility>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+struct WalOptions {
+  // файл журнала; пустой — журнал выключен
+  std::string path;
+  // как часто записывать накопленные записи и вызывать fdatasync; 0 —
+  // сразу, как только они появились
+  std::chrono::milliseconds syncInterval{10};
+  // размер, заранее выделяемый файлу журнала
+  size_t preallocate = 64 * 1024 * 1024;
+};
+
+/**
+ * @brief журнал ввода с групповой фиксацией
+ *
+ * Команды и начала блоков дописываются в память под мьютексом журнала;
+ * отдельный поток раз в syncInterval записывает всё накопленное одним
+ * проходом и вызывает fdatasync, так что при сбое теряется не больше
+ * интервала ввода, а поток ввода диска не ждёт. Если диск не успевает и
+ * в памяти набирается MAX_PENDING байт, запись ждёт потока фиксации.
+ *
+ * Формат: заголовок "BLKW", версия (1 байт), 3 байта нулей и поколение
+ * (u64); далее записи — crc32 остальной части записи (u32), длина текста и
+ * вид записи в старших 4 битах (u32), поколение (u32), порядковый номер
+ * (u32), отметка времени (i64) и текст. Записи действительны, пока номера
+ * идут подряд и совпадает поколение заголовка.
+ *
+ * Файл выделяется заранее и используется по кругу: когда обработчик пуст
+ * (Checkpoint) и журнал занял больше половины выделенного места, запись
+ * продолжается с начала файла, а старые записи за ней отсекаются номером.
+ * Длинный блок без отметок увеличивает файл.
+ *
+ * При открытии журнал читает записи после последней отметки — то, что
+ * было в обработчике при сбое, включая незакрытый блок — и начинает новое
+ * поколение. Если что-то прочитано, новое поколение с этими записями
+ * собирается во временном файле рядом, сбрасывается на диск и атомарно
+ * заменяет журнал переименованием, поэтому повторный сбой во время
+ * восстановления застаёт либо старый журнал, либо новый — с теми же
+ * записями. Replay() передаёт прочитанное обратно в контекст ввода, не
+ * журналируя его заново; отметки рассылки на время Replay() тоже не
+ * пишутся, так что при повторном сбое всё восстановленное вернётся ещё
+ * раз. Если сбой случился после рассылки пакета, но до фиксации отметки,
+ * пакет будет разослан повторно. Нормальное завершение ставит отметку, и
+ * незакрытый блок отбрасывается, как и без журнала.
+ */
+class WriteAheadLog : public CommandJournal {
+public:
+  static constexpr char MAGIC[4] = {'B', 'L', 'K', 'W'};
+  static constexpr uint8_t VERSION = 1;
+  static constexpr size_t HEADER_SIZE = 16;
+  static constexpr size_t RECORD_HEADER_SIZE = 24;
+  static constexpr size_t MAX_PENDING = 64 * 1024 * 1024;
+  static constexpr size_t GROUP_SIZE = 1024 * 1024;
+
+  enum class RecordType : uint8_t {
+    Command = 1,
+    StartBlock = 2,
+    Checkpoint = 3
+  };
+
+  explicit WriteAheadLog(const WalOptions& options)
+    : m_options(options), m_capacity(std::max(options.preallocate, HEADER_SIZE * 2)) {
+    m_fd = ::open(options.path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Unable to open write-ahead log " + options.path);
+    }
+    try {
+      Recover();
+      if (m_recovered.records.empty()) {
+        StartGeneration();
+      }
+      else {
+        RewriteRecovered();
+      }
+    }
+    catch (...) {
+      ::close(m_fd);
+      throw;
+    }
+    m_thread = std::thread(&WriteAheadLog::Run, this);
+  }
+
+  ~WriteAheadLog() override {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      AppendRecord(RecordType::Checkpoint, std::string_view(), {});
+      m_stop = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+    ::close(m_fd);
+  }
+
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  /**
+   * @brief передаёт handler'у ввод, не дошедший до подписчиков перед
+   * сбоем: команды с их отметками времени и "{" в начале блока
+   */
+  template <typename Handler>
+  void Replay(Handler&& handler) {
+    auto recovered = std::move(m_recovered);
+    // записи уже лежат в новом поколении
+    m_replaying.store(true, std::memory_order_relaxed);
+    struct Finish {
+      std::atomic<bool>& replaying;
+      ~Finish() { replaying.store(false, std::memory_order_relaxed); }
+    } finish{m_replaying};
+    for (const auto& record : recovered.records) {
+      if (record.type == RecordType::StartBlock) {
+        handler(std::string_view(START_BLOCK), record.timeStamp);
+      }
+      else {
+        handler(std::string_view(recovered.text).substr(record.offset, record.length),
+                record.timeStamp);
+      }
+    }
+  }
+
+  /**
+   * @brief сколько команд и начал блоков восстановлено при открытии
+   */
+  size_t Recovered() const noexcept {
+    return m_recovered.records.size();
+  }
+
+  void Command(std::string_view text,
+               std::chrono::system_clock::time_point timeStamp) override {
+    Append(RecordType::Command, text, timeStamp);
+  }
+
+  void StartBlock() override {
+    Append(RecordType::StartBlock, std::string_view(), {});
+  }
+
+  void Checkpoint() override {
+    Append(RecordType::Checkpoint, std::string_view(), {});
+  }
+
+private:
+  struct Chunk {
+    uint64_t offset;
+    std::string bytes;
+  };
+
+  struct RecoveredRecord {
+    RecordType type;
+    size_t offset;
+    size_t length;
+    std::chrono::system_clock::time_point timeStamp;
+  };
+
+  struct RecoveredInput {
+    std::string text;
+    std::vector<RecoveredRecord> records;
+  };
+
+  static constexpr uint32_t LENGTH_MASK = (1u << 28) - 1;
+
+  void Append(RecordType type, std::string_view text,
+              std::chrono::system_clock::time_point timeStamp) {
+    if (m_replaying.load(std::memory_order_relaxed)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_pendingBytes >= MAX_PENDING) {
+      m_drained.wait(lock, [this] { return m_pendingBytes < MAX_PENDING || m_failed; });
+    }
+    if (m_failed) {
+      throw std::runtime_error("Unable to write write-ahead log " + m_options.path);
+    }
+    AppendRecord(type, text, timeStamp);
+    if (type == RecordType::Checkpoint && m_tail > m_capacity / 2) {
+      // обработчик пуст: запись продолжается с начала файла
+      m_tail = HEADER_SIZE;
+      AppendRecord(RecordType::Checkpoint, std::string_view(), {});
+    }
+    if (m_options.syncInterval.count() == 0 || m_pendingBytes >= GROUP_SIZE) {
+      m_cv.notify_one();
+    }
+  }
+
+  void AppendRecord(RecordType type, std::string_view text,
+                    std::chrono::system_clock::time_point timeStamp) {
+    if (text.size() > LENGTH_MASK) {
+      throw std::runtime_error("Command is too long for the write-ahead log.");
+    }
+    if (m_chunks.empty() || m_chunks.back().offset + m_chunks.back().bytes.size() != m_tail) {
+      m_chunks.push_back(Chunk{m_tail, std::string()});
+    }
+    auto& bytes = m_chunks.back().bytes;
+    const auto start = bytes.size();
+    bytes.resize(start + RECORD_HEADER_SIZE);
+    bytes.append(text);
+    char* header = bytes.data() + start;
+    const uint32_t lengthAndType = static_cast<uint32_t>(text.size()) |
+        (static_cast<uint32_t>(type) << 28);
+    const auto generation = static_cast<uint32_t>(m_generation);
+    const auto sequence = m_sequence++;
+    const auto ticks = static_cast<int64_t>(timeStamp.time_since_epoch().count());
+    std::memcpy(header + 4, &lengthAndType, sizeof(lengthAndType));
+    std::memcpy(header + 8, &generation, sizeof(generation));
+    std::memcpy(header + 12, &sequence, sizeof(sequence));
+    std::memcpy(header + 16, &ticks, sizeof(ticks));
+    const auto crc = static_cast<uint32_t>(
+          crc32_z(crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(header + 4),
+                  RECORD_HEADER_SIZE - 4 + text.size()));
+    std::memcpy(header, &crc, sizeof(crc));
+    m_tail += RECORD_HEADER_SIZE + text.size();
+    m_pendingBytes += RECORD_HEADER_SIZE + text.size();
+  }
+
+  /**
+   * @brief поток групповой фиксации
+   */
+  void Run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+      if (m_options.syncInterval.count() == 0) {
+        m_cv.wait(lock, [this] { return m_stop || !m_chunks.empty(); });
+      }
+      else {
+        m_cv.wait_for(lock, m_options.syncInterval,
+                      [this] { return m_stop || m_pendingBytes >= GROUP_SIZE; });
+      }
+      if (m_chunks.empty()) {
+        if (m_stop) {
+          return;
+        }
+        continue;
+      }
+      std::deque<Chunk> chunks;
+      chunks.swap(m_chunks);
+      lock.unlock();
+      const bool written = WriteChunks(chunks);
+      lock.lock();
+      m_pendingBytes = 0;
+      for (const auto& chunk : m_chunks) {
+        m_pendingBytes += chunk.bytes.size();
+      }
+      m_failed = m_failed || !written;
+      m_drained.notify_all();
+    }
+  }
+
+  bool WriteChunks(const std::deque<Chunk>& chunks) {
+    MetricTimer timer(MetricHistogram::WalSyncNs);
+    for (const auto& chunk : chunks) {
+      const auto end = chunk.offset + chunk.bytes.size();
+      if (end > m_allocated) {
+        // блок без отметок не поместился: файл растёт вдвое
+        const auto size = std::max<uint64_t>(end, m_allocated * 2);
+        ::posix_fallocate(m_fd, 0, static_cast<off_t>(size));
+        m_allocated = size;
+      }
+      if (!WriteAt(chunk.bytes.data(), chunk.bytes.size(), chunk.offset)) {
+        return false;
+      }
+      Metrics::Add(MetricCounter::WalBytes, chunk.bytes.size());
+    }
+    return ::fdatasync(m_fd) == 0;
+  }
+
+  bool WriteAt(const char* data, size_t size, uint64_t offset) {
+    while (size > 0) {
+      const auto written = ::pwrite(m_fd, data, size, static_cast<off_t>(offset));
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      data += written;
+      size -= static_cast<size_t>(written);
+      offset += static_cast<uint64_t>(written);
+    }
+    return true;
+  }
+
+  /**
+   * @brief читает цепочку записей текущего поколения и сохраняет ввод
+   * после последней отметки
+   */
+  void Recover() {
+    struct stat info {};
+    if (::fstat(m_fd, &info) != 0) {
+      throw std::runtime_error("Unable to read write-ahead log " + m_options.path);
+    }
+    const auto size = static_cast<size_t>(info.st_size);
+    m_allocated = size;
+    if (size < HEADER_SIZE) {
+      return;
+    }
+    void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::runtime_error("Unable to map write-ahead log " + m_options.path);
+    }
+    const char* data = static_cast<const char*>(mapping);
+    if (std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0 ||
+        static_cast<uint8_t>(data[4]) != VERSION) {
+      ::munmap(mapping, size);
+      throw std::runtime_error("Not a bulk write-ahead log: " + m_options.path);
+    }
+    std::memcpy(&m_generation, data + 8, sizeof(m_generation));
+
+    const char* pending = nullptr;
+    const char* end = nullptr;
+    const char* position = data + HEADER_SIZE;
+    bool first = true;
+    uint32_t expected = 0;
+    while (static_cast<size_t>(data + size - position) >= RECORD_HEADER_SIZE) {
+      uint32_t crc = 0;
+      uint32_t lengthAndType = 0;
+      uint32_t generation = 0;
+      uint32_t sequence = 0;
+      std::memcpy(&crc, position, sizeof(crc));
+      std::memcpy(&lengthAndType, position + 4, sizeof(lengthAndType));
+      std::memcpy(&generation, position + 8, sizeof(generation));
+      std::memcpy(&sequence, position + 12, sizeof(sequence));
+      const size_t length = lengthAndType & LENGTH_MASK;
+      if (generation != static_cast<uint32_t>(m_generation) ||
+          (!first && sequence != expected) ||
+          static_cast<size_t>(data + size - position) - RECORD_HEADER_SIZE < length ||
+          crc32_z(crc32(0, nullptr, 0), reinterpret_cast<const Bytef*>(position + 4),
+                  RECORD_HEADER_SIZE - 4 + length) != crc) {
+        break;
+      }
+      first = false;
+      expected = sequence + 1;
+      const auto next = position + RECORD_HEADER_SIZE + length;
+      if (static_cast<RecordType>(lengthAndType >> 28) == RecordType::Checkpoint) {
+        pending = next;
+      }
+      else if (!pending) {
+        // запись до первой отметки поколения — его начало
+        pending = position;
+      }
+      position = next;
+      end = next;
+    }
+
+    for (position = pending; position && position < end;) {
+      uint32_t lengthAndType = 0;
+      int64_t ticks = 0;
+      std::memcpy(&lengthAndType, position + 4, sizeof(lengthAndType));
+      std::memcpy(&ticks, position + 16, sizeof(ticks));
+      const size_t length = lengthAndType & LENGTH_MASK;
+      m_recovered.records.push_back(RecoveredRecord{
+                                      static_cast<RecordType>(lengthAndType >> 28),
+                                      m_recovered.text.size(), length,
+                                      std::chrono::system_clock::time_point(
+                                        std::chrono::system_clock::duration(ticks))});
+      m_recovered.text.append(position + RECORD_HEADER_SIZE, length);
+      position += RECORD_HEADER_SIZE + length;
+    }
+    ::munmap(mapping, size);
+  }
+
+  /**
+   * @brief записывает заголовок нового поколения: записи прежнего
+   * становятся недействительными
+   */
+  void StartGeneration() {
+    ++m_generation;
+    if (m_allocated < m_capacity) {
+      if (::posix_fallocate(m_fd, 0, static_cast<off_t>(m_capacity)) == 0) {
+        m_allocated = m_capacity;
+      }
+    }
+    char header[HEADER_SIZE] = {};
+    std::memcpy(header, MAGIC, sizeof(MAGIC));
+    header[4] = static_cast<char>(VERSION);
+    std::memcpy(header + 8, &m_generation, sizeof(m_generation));
+    if (!WriteAt(header, sizeof(header), 0) || ::fdatasync(m_fd) != 0) {
+      throw std::runtime_error("Unable to write write-ahead log " + m_options.path);
+    }
+    m_tail = HEADER_SIZE;
+  }
+
+  /**
+   * @brief начинает новое поколение с восстановленными записями в
+   * отдельном файле и заменяет им журнал только после fdatasync
+   *
+   * Запись нового поколения на место старого сделала бы прежние записи
+   * недействительными раньше, чем новые окажутся на диске.
+   */
+  void RewriteRecovered() {
+    const auto temporary = m_options.path + ".tmp";
+    const int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to create " + temporary);
+    }
+    const int previous = std::exchange(m_fd, fd);
+    m_allocated = 0;
+    try {
+      StartGeneration();
+      for (const auto& record : m_recovered.records) {
+        AppendRecord(record.type,
+                     std::string_view(m_recovered.text).substr(record.offset, record.length),
+                     record.timeStamp);
+      }
+      if (!WriteChunks(m_chunks) || ::rename(temporary.c_str(), m_options.path.c_str()) != 0) {
+        throw std::runtime_error("Unable to write write-ahead log " + m_options.path);
+      }
+      SyncDirectory();
+    }
+    catch (...) {
+      ::close(fd);
+      ::unlink(temporary.c_str());
+      m_fd = previous;
+      throw;
+    }
+    ::close(previous);
+    m_chunks.clear();
+    m_pendingBytes = 0;
+  }
+
+  /**
+   * @brief фиксирует переименование журнала
+   */
+  void SyncDirectory() {
+    const auto slash = m_options.path.rfind('/');
+    const auto directory = slash == std::string::npos ? std::string(".")
+                                                      : m_options.path.substr(0, slash + 1);
+    const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Unable to open directory " + directory);
+    }
+    const bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    if (!synced) {
+      throw std::runtime_error("Unable to sync directory " + directory);
+    }
+  }
+
+  const WalOptions m_options;
+  const uint64_t m_capacity;
+  int m_fd = -1;
+  uint64_t m_generation = 0;
+  // выделенный файлу размер; меняется только потоком фиксации
+  uint64_t m_allocated = 0;
+  RecoveredInput m_recovered;
+  std::atomic<bool> m_replaying{false};
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::condition_variable m_drained;
+  std::deque<Chunk> m_chunks;
+  uint64_t m_tail = HEADER_SIZE;
+  uint32_t m_sequence = 0;
+  size_t m_pendingBytes = 0;
+  bool m_stop = false;
+  bool m_failed = false;
+  std::thread m_thread;
+};
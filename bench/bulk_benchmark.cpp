@@ -0,0 +1,427 @@
+#include "BatchConsoleInput.h"
+#include "LineReader.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <ftw.h>
+
+/**
+ * Бенчмарки конвейера bulk: форматирование, накопление пакетов, разбор
+ * блоков, запись файлов и полный путь stdin -> подписчики. Для тестов
+ * пропускной способности выводятся счётчики lines/s и batches/s, для
+ * сквозного пути — задержки p50/p99 от первой команды пакета до
+ * подписчика.
+ */
+
+namespace {
+
+/**
+ * @brief синтетическая нагрузка
+ */
+enum class Workload {
+  Short,       // короткие команды
+  Long,        // команды по 200 байт
+  DeepNesting, // вложенность блоков 64
+  HugeBlock,   // один динамический блок на всю нагрузку
+  Repeated     // 300 различных команд вперемешку
+};
+
+std::string MakeInput(Workload workload, size_t lines) {
+  std::string input;
+  const std::string longText(200, 'x');
+  switch (workload) {
+  case Workload::Short:
+    for (size_t i = 0; i < lines; ++i) {
+      input.append("cmd").append(std::to_string(i)).push_back('\n');
+    }
+    break;
+  case Workload::Long:
+    for (size_t i = 0; i < lines; ++i) {
+      input.append(longText).append(std::to_string(i)).push_back('\n');
+    }
+    break;
+  case Workload::DeepNesting:
+    for (size_t i = 0; i < lines;) {
+      for (int depth = 0; depth < 64; ++depth, ++i) {
+        input.append("{\ncmd").append(std::to_string(i)).push_back('\n');
+      }
+      for (int depth = 0; depth < 64; ++depth) {
+        input.append("}\n");
+      }
+    }
+    break;
+  case Workload::HugeBlock:
+    input.append("{\n");
+    for (size_t i = 0; i < lines; ++i) {
+      input.append("cmd").append(std::to_string(i)).push_back('\n');
+    }
+    input.append("}\n");
+    break;
+  case Workload::Repeated:
+    for (size_t i = 0; i < lines; ++i) {
+      input.append("command").append(std::to_string(i * 7919 % 300)).push_back('\n');
+    }
+    break;
+  }
+  return input;
+}
+
+std::vector<std::string_view> SplitLines(const std::string& input) {
+  std::vector<std::string_view> lines;
+  auto handler = [&lines](std::string_view line) { lines.push_back(line); };
+  LineReader::ScanLines(input.data(), input.data() + input.size(), handler);
+  return lines;
+}
+
+/**
+ * @brief подписчик, считающий пакеты и задержки доставки
+ */
+class CountingOutput : public Output { // subscriber
+public:
+  void update(const BatchPtr& batch) override {
+    ++batches;
+    commands += batch->Size();
+    if (format) {
+      benchmark::DoNotOptimize(batch->Text().data());
+    }
+    if (recordLatency) {
+      latencies.push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::system_clock::now() -
+                            batch->Front().timeStamp).count());
+    }
+  }
+
+  bool recordLatency = false;
+  bool format = false;
+  size_t batches = 0;
+  size_t commands = 0;
+  std::vector<double> latencies;
+};
+
+void ReportRates(benchmark::State& state, size_t lines, size_t batches) {
+  state.SetItemsProcessed(static_cast<int64_t>(lines));
+  state.counters["lines/s"] = benchmark::Counter(static_cast<double>(lines),
+                                                 benchmark::Counter::kIsRate);
+  state.counters["batches/s"] = benchmark::Counter(static_cast<double>(batches),
+                                                   benchmark::Counter::kIsRate);
+}
+
+void ReportLatency(benchmark::State& state, std::vector<double>& latencies) {
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  const auto percentile = [&latencies](double p) {
+    return latencies[static_cast<size_t>(p * static_cast<double>(latencies.size() - 1))];
+  };
+  state.counters["p50_us"] = percentile(0.50);
+  state.counters["p99_us"] = percentile(0.99);
+}
+
+void BM_Format(benchmark::State& state) {
+  const auto commands = static_cast<size_t>(state.range(0));
+  const auto input = MakeInput(Workload::Short, commands);
+  Batch batch;
+  for (const auto line : SplitLines(input)) {
+    batch.Append(line, {});
+  }
+  std::string buffer(BatchFormatter::FormattedSize(batch), '\0');
+  for (auto _ : state) {
+    BatchFormatter::FormatTo(batch, buffer.data());
+    benchmark::DoNotOptimize(buffer.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * buffer.size()));
+  ReportRates(state, state.iterations() * commands, state.iterations());
+}
+BENCHMARK(BM_Format)->Arg(3)->Arg(100)->Arg(10000);
+
+void BM_ProcessCommand(benchmark::State& state) {
+  const auto bulkSize = static_cast<int>(state.range(0));
+  const auto input = MakeInput(Workload::Short, 1 << 16);
+  const auto lines = SplitLines(input);
+  CountingOutput output;
+  BatchCommandProcessor processor(bulkSize, TimestampPolicy::FirstInBatch);
+  processor.subscribe(&output);
+  size_t processed = 0;
+  for (auto _ : state) {
+    processor.ProcessCommand(lines[processed++ & (lines.size() - 1)]);
+  }
+  ReportRates(state, processed, output.batches);
+}
+BENCHMARK(BM_ProcessCommand)->Arg(1)->Arg(3)->Arg(100)->Arg(10000);
+
+void BM_NestedBlocks(benchmark::State& state) {
+  const auto input = MakeInput(Workload::DeepNesting, 1 << 14);
+  const auto lines = SplitLines(input);
+  CountingOutput output;
+  size_t processed = 0;
+  for (auto _ : state) {
+    BatchCommandProcessor processor(3, TimestampPolicy::FirstInBatch);
+    processor.subscribe(&output);
+    StreamContext context(processor);
+    for (const auto line : lines) {
+      context.ProcessCommand(line);
+    }
+    processed += lines.size();
+  }
+  ReportRates(state, processed, output.batches);
+}
+BENCHMARK(BM_NestedBlocks);
+
+/**
+ * @brief наполнение и форматирование пакетов из повторяющихся команд
+ * без таблицы интернирования (0) и с ней (1)
+ */
+void BM_Intern(benchmark::State& state) {
+  const auto input = MakeInput(Workload::Repeated, 1 << 16);
+  const auto lines = SplitLines(input);
+  CountingOutput output;
+  output.format = true;
+  BatchCommandProcessor processor(100, TimestampPolicy::FirstInBatch);
+  if (state.range(0) != 0) {
+    processor.SetCommandTable(std::make_shared<CommandTable>());
+  }
+  processor.subscribe(&output);
+  size_t processed = 0;
+  for (auto _ : state) {
+    processor.ProcessCommands(lines.data(), lines.size());
+    processed += lines.size();
+  }
+  ReportRates(state, processed, output.batches);
+}
+BENCHMARK(BM_Intern)->Arg(0)->Arg(1);
+
+/**
+ * @brief разбор ввода построчно: каждая строка проверяется на скобку и
+ * подаётся обработчику отдельно
+ */
+void BM_ScanLines(benchmark::State& state) {
+  const auto input = MakeInput(static_cast<Workload>(state.range(0)), 1 << 16);
+  CountingOutput output;
+  size_t processed = 0;
+  for (auto _ : state) {
+    BatchCommandProcessor processor(100, TimestampPolicy::FirstInBatch);
+    processor.subscribe(&output);
+    StreamContext context(processor);
+    auto handler = [&context, &processed](std::string_view text) {
+      context.ProcessCommand(text);
+      ++processed;
+    };
+    LineReader::ScanLines(input.data(), input.data() + input.size(), handler);
+  }
+  ReportRates(state, processed, output.batches);
+}
+BENCHMARK(BM_ScanLines)
+  ->Arg(static_cast<int>(Workload::Short))->Arg(static_cast<int>(Workload::DeepNesting));
+
+/**
+ * @brief разбор ввода сериями: скобки распознаются при поиске переводов
+ * строк, команды подаются обработчику пачками
+ */
+void BM_ScanCommands(benchmark::State& state) {
+  const auto input = MakeInput(static_cast<Workload>(state.range(0)), 1 << 16);
+  const auto lineCount = SplitLines(input).size();
+  CountingOutput output;
+  size_t processed = 0;
+  for (auto _ : state) {
+    BatchCommandProcessor processor(100, TimestampPolicy::FirstInBatch);
+    processor.subscribe(&output);
+    StreamContext context(processor);
+    LineReader::ScanCommands(input.data(), input.data() + input.size(), context);
+    processed += lineCount;
+  }
+  ReportRates(state, processed, output.batches);
+}
+BENCHMARK(BM_ScanCommands)
+  ->Arg(static_cast<int>(Workload::Short))->Arg(static_cast<int>(Workload::DeepNesting));
+
+void BM_ReportWriter(benchmark::State& state) {
+  const auto input = MakeInput(Workload::Short, 3);
+  auto pool = BatchPool::Create();
+  auto batch = pool->Acquire();
+  for (const auto line : SplitLines(input)) {
+    batch->Append(line, std::chrono::system_clock::now());
+  }
+  const auto sealed = pool->Seal(std::move(batch));
+  ReportWriter writer(nullptr);
+  for (auto _ : state) {
+    writer.update(sealed);
+  }
+  ReportRates(state, state.iterations() * 3, state.iterations());
+}
+BENCHMARK(BM_ReportWriter);
+
+/**
+ * @brief то же через io_uring; в установившемся режиме update() ждёт
+ * освобождения слота, так что время включает завершение файлов
+ */
+void BM_UringReportWriter(benchmark::State& state) {
+  const auto input = MakeInput(Workload::Short, 3);
+  auto pool = BatchPool::Create();
+  auto batch = pool->Acquire();
+  for (const auto line : SplitLines(input)) {
+    batch->Append(line, std::chrono::system_clock::now());
+  }
+  const auto sealed = pool->Seal(std::move(batch));
+  UringOptions options;
+  options.enabled = true;
+  const auto writer = UringReportWriter::Create(nullptr, options);
+  for (auto _ : state) {
+    writer->update(sealed);
+  }
+  ReportRates(state, state.iterations() * 3, state.iterations());
+}
+BENCHMARK(BM_UringReportWriter);
+
+/**
+ * @brief передача пакетов сопрограммному выводу: очередь AsyncSinkOutput,
+ * исполнитель и адаптер OutputSink; время включает ожидание места в
+ * очереди
+ */
+void BM_AsyncSink(benchmark::State& state) {
+  const auto input = MakeInput(Workload::Short, 3);
+  auto pool = BatchPool::Create();
+  auto batch = pool->Acquire();
+  for (const auto line : SplitLines(input)) {
+    batch->Append(line, std::chrono::system_clock::now());
+  }
+  const auto sealed = pool->Seal(std::move(batch));
+  SinkExecutor executor(1);
+  {
+    // деструктор дожидается записи всех пакетов
+    AsyncSinkOutput sink(nullptr, std::make_unique<OutputSink>(std::make_unique<CountingOutput>()),
+                         executor);
+    for (auto _ : state) {
+      sink.update(sealed);
+    }
+  }
+  ReportRates(state, state.iterations() * 3, state.iterations());
+}
+BENCHMARK(BM_AsyncSink);
+
+/**
+ * Цена метрик на горячем пути: приращение счётчика и запись в гистограмму
+ */
+void BM_MetricsAdd(benchmark::State& state) {
+  for (auto _ : state) {
+    Metrics::Add(MetricCounter::CommandsIn);
+  }
+}
+BENCHMARK(BM_MetricsAdd);
+
+void BM_MetricsRecord(benchmark::State& state) {
+  uint64_t value = 0;
+  for (auto _ : state) {
+    Metrics::Record(MetricHistogram::BatchCommands, ++value & 1023);
+  }
+}
+BENCHMARK(BM_MetricsRecord);
+
+/**
+ * @brief stdin -> LineReader -> BatchConsoleInput -> консоль и файлы;
+ * вывод консоли перенаправлен в /dev/null
+ */
+void BM_EndToEnd(benchmark::State& state) {
+  const auto workload = static_cast<Workload>(state.range(0));
+  const auto sink = static_cast<FileSink>(state.range(1));
+  const auto input = MakeInput(workload, 1 << 16);
+
+  char path[] = "bulk_input_XXXXXX";
+  const int fd = ::mkstemp(path);
+  if (fd < 0 || ::write(fd, input.data(), input.size()) !=
+      static_cast<ssize_t>(input.size())) {
+    state.SkipWithError("Unable to create input file.");
+    return;
+  }
+
+  const auto lineCount = SplitLines(input).size();
+  // std::cout нужен и отчёту бенчмарка, поэтому перенаправляется только на
+  // время замера
+  std::ofstream devNull("/dev/null");
+  auto* const consoleBuffer = std::cout.rdbuf(devNull.rdbuf());
+  CountingOutput latency;
+  latency.recordLatency = true;
+  size_t processed = 0;
+  for (auto _ : state) {
+    BulkOptions options;
+    options.bulkSize = 100;
+    options.fileSink = sink;
+    options.fileThreads = 2;
+    options.console.mode = ConsoleMode::Buffered;
+    BatchConsoleInput consoleInput(options);
+    consoleInput.Processor().subscribe(&latency);
+
+    ::lseek(fd, 0, SEEK_SET);
+    LineReader reader(fd);
+    reader.ForEachCommand(consoleInput);
+    processed += lineCount;
+  }
+  std::cout.rdbuf(consoleBuffer);
+  ::close(fd);
+  ::unlink(path);
+  ReportRates(state, processed, latency.batches);
+  ReportLatency(state, latency.latencies);
+}
+BENCHMARK(BM_EndToEnd)
+  ->ArgsProduct({{static_cast<int>(Workload::Short), static_cast<int>(Workload::Long),
+                  static_cast<int>(Workload::DeepNesting), static_cast<int>(Workload::HugeBlock)},
+                 {static_cast<int>(FileSink::PerBatch), static_cast<int>(FileSink::Rolling)}})
+  ->Unit(benchmark::kMillisecond)
+  ->UseRealTime();
+
+int RemoveEntry(const char* path, const struct stat*, int, FTW*) {
+  return ::remove(path);
+}
+
+/**
+ * @brief записывает нагрузки бенчмарка в каталог directory — обучающие
+ * входы для PGO-сборки bulk (цель pgo-train)
+ */
+bool WriteTrainingInputs(const std::string& directory) {
+  const std::pair<Workload, const char*> inputs[] = {
+    {Workload::Short, "short.txt"},
+    {Workload::Long, "long.txt"},
+    {Workload::DeepNesting, "nesting.txt"},
+    {Workload::HugeBlock, "huge.txt"}
+  };
+  for (const auto& [workload, name] : inputs) {
+    std::ofstream file(directory + '/' + name, std::ios::binary);
+    file << MakeInput(workload, 1 << 16);
+    if (!file) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+/**
+ * Файлы пакетов пишутся во временный каталог, который удаляется по
+ * завершении. С --write_training_inputs=<каталог> бенчмарки не
+ * запускаются: в каталог записываются входы для обучения PGO.
+ */
+int main(int argc, char** argv) {
+  const std::string_view trainingFlag = "--write_training_inputs=";
+  if (argc == 2 && std::string_view(argv[1]).substr(0, trainingFlag.size()) == trainingFlag) {
+    return WriteTrainingInputs(argv[1] + trainingFlag.size()) ? 0 : 1;
+  }
+
+  char directory[] = "/tmp/bulk_benchmark_XXXXXX";
+  if (!::mkdtemp(directory) || ::chdir(directory) != 0) {
+    return 1;
+  }
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  ::nftw(directory, RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+  return 0;
+}
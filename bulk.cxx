@@ -1,36 +1,105 @@
-#include "CommandProcessor.h"
+#include "BatchConsoleInput.h"
+#include "CommandLine.h"
+#include "FileInput.h"
+#include "LineReader.h"
 
+#include <csignal>
 
-void RunBulk(int bulkSize) {
-  BatchConsoleInput consoleInput(bulkSize);
+#include <signal.h>
+#include <unistd.h>
 
-  std::string text;
-  while (std::getline(std::cin, text)) {
-    consoleInput.ProcessCommand(Command{text, std::chrono::system_clock::now()});
+void RunBulk(const BulkOptions& options) {
+  if (options.console.mode == ConsoleMode::Buffered) {
+    // консоль буферизуется самим ConsoleOutput: синхронизация с stdio и
+    // сброс cout перед каждым чтением cin только мешают
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
   }
+
+  // создаётся первым: блокирует SIGUSR1 до запуска остальных потоков и
+  // отчитывается после их остановки
+  MetricsReporter metrics(options.metrics);
+
+  // сигналы завершения сервера принимает только основной поток, поэтому
+  // они блокируются до запуска любых потоков
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  if (!options.server.listen.empty()) {
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+  }
+
+  // до конвейера: выгружает события уже после его остановки
+  TraceWriter trace(options.trace);
+
+  BatchConsoleInput consoleInput(options);
+
+  std::unique_ptr<ShardedProcessor> sharded;
+  if (options.shards.count > 0) {
+    // шарды публикуют готовые пакеты подписчикам consoleInput
+    sharded = std::make_unique<ShardedProcessor>(consoleInput.Processor(), options.shards,
+                                                 options.bulkSize, options.timestamps,
+                                                 options.flush);
+  }
+
+  if (!options.server.listen.empty()) {
+    auto server = sharded
+        ? std::make_unique<BulkServer>([&sharded] { return sharded->CreateSource(); },
+                                       options.server)
+        : std::make_unique<BulkServer>(consoleInput.Processor(), options.server);
+    int signal = 0;
+    sigwait(&signals, &signal);
+    return;
+  }
+
+  if (!options.input.paths.empty()) {
+    FileInput::ReceiverFactory factory;
+    if (sharded) {
+      factory = [&sharded] { return sharded->CreateSource(); };
+    }
+    else if (options.input.paths.size() == 1) {
+      // единственный файл разбирается так же, как stdin, тем же контекстом,
+      // что и ввод, восстановленный из журнала
+      factory = [&consoleInput] {
+        return consoleInput.CreateReceiver();
+      };
+    }
+    else {
+      // до запуска потоков чтения
+      consoleInput.Processor().EnableConcurrentAccess();
+      factory = [&consoleInput] {
+        return std::make_unique<BlockContext>(consoleInput.Processor());
+      };
+    }
+    FileInput(std::move(factory), options.input).Run();
+    return;
+  }
+
+  // поток stdin закрепляется последним: потоки конвейера наследуют маску
+  PinCurrentThread(options.input.cpus, 0);
+  LineReader reader(STDIN_FILENO);
+  if (sharded) {
+    auto source = sharded->CreateSource();
+    reader.ForEachCommand(*source);
+    return;
+  }
+  reader.ForEachCommand(consoleInput);
 }
 
 int main(int argc, char const** argv) {
-//  try {
-//    if (argc < 2) {
-//      std::cerr << "Bulk size is not specified." << std::endl;
-//      return 1;
-//    }
-
-//    int bulkSize = atoi(argv[1]);
-//    if (bulkSize == 0) {
-//      std::cerr << "Invalid bulk size." << std::endl;
-//      return 1;
-//    }
-
-//    RunBulk(bulkSize);
-//    return 0;
-//  }
-//  catch (const std::exception &e) {
-//    std::cerr << e.what() << std::endl;
-//  }
-
-  RunBulk(3);
-
-  return 0;
+  try {
+    BulkOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+      return 1;
+    }
+
+    RunBulk(options);
+    return 0;
+  }
+  catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+
+  return 1;
 }
@@ -0,0 +1,94 @@
+#include "BatchConsoleInput.h"
+#include "CommandLine.h"
+#include "ReplayInput.h"
+
+#include <cmath>
+
+/**
+ * @brief подаёт команды архива обработчику
+ * @param speed множитель исходного темпа; 0 — без пауз
+ */
+void Replay(BatchConsoleInput& input, const std::vector<CommandView>& commands, double speed) {
+  if (speed <= 0 || commands.empty()) {
+    for (const auto& command : commands) {
+      input.ProcessCommand(command.text, command.timeStamp);
+    }
+    return;
+  }
+  const auto start = std::chrono::steady_clock::now();
+  const auto origin = commands.front().timeStamp;
+  for (const auto& command : commands) {
+    const auto offset = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          (command.timeStamp - origin) / speed);
+    if (offset > std::chrono::steady_clock::duration::zero() &&
+        std::chrono::steady_clock::now() - start < offset) {
+      std::this_thread::sleep_until(start + offset);
+    }
+    input.ProcessCommand(command.text, command.timeStamp);
+  }
+}
+
+/**
+ * @brief воспроизводит архив вывода bulk через обработчик:
+ * bulk_replay [--speed=X] [параметры bulk] FILE...
+ *
+ * FILE — двоичные сегменты (.blk) или текстовые записи bulk*.log. Архив
+ * целиком загружается до начала замера, так что чтение не влияет на
+ * измеряемую скорость вывода. --speed=X воспроизводит команды в X раз
+ * быстрее исходного темпа по их отметкам времени; по умолчанию — без
+ * пауз. Остальные параметры — как у bulk; разбор файлов делят
+ * --input-threads потоков. Итог замера выводится в stderr.
+ */
+int main(int argc, char const** argv) {
+  try {
+    BulkOptions options;
+    double speed = 0;
+    const bool parsed = ParseOptions(argc, argv, options, [&speed](const char* arg) {
+      if (std::strncmp(arg, "--speed=", 8) == 0) {
+        speed = std::strtod(arg + 8, nullptr);
+        return true;
+      }
+      return false;
+    });
+    if (!parsed) {
+      return 1;
+    }
+    if (options.input.paths.empty()) {
+      std::cerr << "Usage: bulk_replay [--speed=X] [bulk options] FILE..." << std::endl;
+      return 1;
+    }
+    if (!options.server.listen.empty() || options.shards.count > 0) {
+      std::cerr << "bulk_replay does not support --listen and --shards." << std::endl;
+      return 1;
+    }
+    if (options.console.mode == ConsoleMode::Buffered) {
+      std::ios::sync_with_stdio(false);
+    }
+
+    MetricsReporter metrics(options.metrics);
+    TraceWriter trace(options.trace);
+    const auto loadStart = std::chrono::steady_clock::now();
+    ReplayArchive archive(options.input.paths, options.input.threads);
+    const auto loadTime = std::chrono::steady_clock::now() - loadStart;
+
+    const auto start = std::chrono::steady_clock::now();
+    {
+      BatchConsoleInput input(options);
+      PinCurrentThread(options.input.cpus, 0);
+      Replay(input, archive.Commands(), speed);
+      // выводы дорабатывают очереди в деструкторе и входят в замер
+    }
+    const auto seconds = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+    const auto count = archive.Commands().size();
+    std::cerr << "loaded " << count << " commands in "
+              << std::chrono::duration<double>(loadTime).count() << " s, replayed in "
+              << seconds << " s (" << std::llround(count / std::max(seconds, 1e-9))
+              << " commands/s)" << std::endl;
+    return 0;
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+  return 1;
+}
@@ -0,0 +1,95 @@
+#include "BinaryFileOutput.h"
+#include "CompressedFileOutput.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+void UnpackCompressed(int fd) {
+  CompressedSegmentReader reader(fd);
+  reader.ForEachFrame([](std::string_view text) {
+    std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+  });
+}
+
+/**
+ * @brief выводит пакеты двоичного сегмента записями "bulk: a, b, c",
+ * начиная с пакета fromBatch
+ */
+void UnpackBinary(const char* path, uint64_t fromBatch) {
+  BinarySegmentReader reader(path);
+  std::string text;
+  reader.ForEachRecord([&text, fromBatch](const BinaryRecord& record) {
+    if (record.id < fromBatch) {
+      return;
+    }
+    text = BULK;
+    bool first = true;
+    record.ForEachCommand([&text, &first](const CommandView& command) {
+      if (!first) {
+        text.append(BatchFormatter::SEPARATOR);
+      }
+      first = false;
+      text.append(command.text);
+    });
+    text.push_back('\n');
+    std::cout.write(text.data(), static_cast<std::streamsize>(text.size()));
+  }, reader.FindBatch(fromBatch));
+}
+
+}
+
+/**
+ * @brief выводит сегменты bulk в текстовом виде в stdout:
+ * bulk_unpack [--from-batch=ID] FILE...
+ *
+ * Сжатые сегменты распаковываются, двоичные форматируются; формат
+ * определяется по заголовку файла. --from-batch пропускает пакеты
+ * двоичных сегментов с меньшими номерами, начиная чтение по индексу.
+ */
+int main(int argc, char const** argv) {
+  uint64_t fromBatch = 0;
+  int first = 1;
+  if (argc > 1 && std::strncmp(argv[1], "--from-batch=", 13) == 0) {
+    fromBatch = std::strtoull(argv[1] + 13, nullptr, 10);
+    first = 2;
+  }
+  if (first >= argc) {
+    std::cerr << "Usage: bulk_unpack [--from-batch=ID] FILE..." << std::endl;
+    return 1;
+  }
+  try {
+    for (int i = first; i < argc; ++i) {
+      const int fd = ::open(argv[i], O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        throw std::runtime_error(std::string("Unable to open ") + argv[i]);
+      }
+      char magic[sizeof(BinaryFormat::MAGIC)] = {};
+      const bool binary = ::pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+          BinarySegmentReader::IsSegment(std::string_view(magic, sizeof(magic)));
+      try {
+        if (binary) {
+          UnpackBinary(argv[i], fromBatch);
+        }
+        else {
+          UnpackCompressed(fd);
+        }
+      }
+      catch (...) {
+        ::close(fd);
+        throw;
+      }
+      ::close(fd);
+    }
+    std::cout.flush();
+    return 0;
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
+  return 1;
+}
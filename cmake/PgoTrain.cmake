@@ -0,0 +1,36 @@
+# Обучающий прогон PGO: инструментированный bulk обрабатывает входы
+# бенчмарка (bulk_benchmark --write_training_inputs) в основных режимах.
+# Вызывается целью pgo-train:
+#   cmake -DBULK=<bulk> -DINPUTS=<каталог входов> -P PgoTrain.cmake
+
+if(NOT BULK OR NOT INPUTS)
+    message(FATAL_ERROR "BULK and INPUTS must be set")
+endif()
+
+set(MODES
+    "3"
+    "100"
+    "100 --sink=rolling"
+    "100 --file-threads=2 --console=buffered"
+    "100 --sink=rolling --file-threads=1 --timestamps=coarse"
+    "100 --adaptive --shards=2 --no-pin"
+)
+
+set(WORK_DIR "${INPUTS}/run")
+file(GLOB TRAINING_INPUTS "${INPUTS}/*.txt")
+foreach(INPUT ${TRAINING_INPUTS})
+    foreach(MODE ${MODES})
+        separate_arguments(ARGS UNIX_COMMAND "${MODE}")
+        file(REMOVE_RECURSE "${WORK_DIR}")
+        file(MAKE_DIRECTORY "${WORK_DIR}")
+        execute_process(COMMAND "${BULK}" ${ARGS}
+                        INPUT_FILE "${INPUT}"
+                        OUTPUT_FILE /dev/null
+                        WORKING_DIRECTORY "${WORK_DIR}"
+                        RESULT_VARIABLE RESULT)
+        if(NOT RESULT EQUAL 0)
+            message(FATAL_ERROR "bulk ${MODE} < ${INPUT} failed: ${RESULT}")
+        endif()
+    endforeach()
+endforeach()
+file(REMOVE_RECURSE "${WORK_DIR}")